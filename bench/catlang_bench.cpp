@@ -0,0 +1,403 @@
+// Times each stage of running a script and a set of variant micro benchmarks,
+// and writes the results as JSON so runs of two builds can be compared.
+//
+//   catlang_bench [--repetitions n] [--filter text] [--output file] [--baseline file]
+//
+// Scripts go through the same stages interpret does: parse, expand (the
+// optimizer), compile and execute, each timed on its own. Every repetition uses
+// a fresh interpreter, so nothing jitted or cached carries over. --baseline reads
+// the JSON of an earlier run and prints how each median changed to stderr.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "basic_types.h"
+#include "compiler.h"
+#include "interpreter.h"
+#include "parser.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+// Sink for results so the optimizer can't drop the measured work
+static volatile int64_t sink;
+
+struct workload_t
+{
+	const char* name;
+	std::string source;
+	// Printed value of the last form, checked so a broken build can't post good numbers
+	std::string expected;
+};
+
+// Times of one stage or micro benchmark, one entry per repetition
+struct result_t
+{
+	std::string workload;
+	std::string stage;
+	// Per repetition, the times are per iteration
+	std::int64_t iterations;
+	std::vector<double> ns;
+};
+
+static const char* const stage_names[] = { "parse", "expand", "compile", "execute", "total" };
+static const size_t stage_count = sizeof(stage_names) / sizeof(stage_names[0]);
+
+static double elapsed_ns(bench_clock::time_point start, bench_clock::time_point end)
+{
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+// A quoted list of count ints, nested every 16 items so the tree isn't flat
+static std::string make_quoted_list(int count)
+{
+	std::string source = "'(";
+	for (int i = 0; i < count; ++i)
+	{
+		if (i % 16 == 0)
+			source += i ? ") (" : "(";
+		source += std::to_string(i);
+		source += ' ';
+	}
+	return source + "))";
+}
+
+static std::vector<workload_t> make_workloads()
+{
+	std::vector<workload_t> workloads;
+	workloads.push_back({ "fib",
+		"(def (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))\n"
+		"(fib 27)\n",
+		"196418" });
+	workloads.push_back({ "while_loop",
+		"(def i 0)\n"
+		"(def total 0)\n"
+		"(while (< i 3000000) (set total (+ total i)) (set i (+ i 1)))\n"
+		"total\n",
+		"4499998500000" });
+	workloads.push_back({ "closures",
+		"(def (make-adder n) (lambda (x) (+ x n)))\n"
+		"(def (compose f g) (lambda (x) (f (g x))))\n"
+		"(def (map f xs) (if (length xs) (cons (f (head xs)) (map f (tail xs))) '()))\n"
+		"(def (fold f acc xs) (if (length xs) (fold f (f acc (head xs)) (tail xs)) acc))\n"
+		"(def (range n acc) (if (< n 1) acc (range (- n 1) (cons n acc))))\n"
+		"(def xs (range 1000 '()))\n"
+		"(def total 0)\n"
+		"(def j 0)\n"
+		"(while (< j 300)\n"
+		"  (set total (+ total (fold (lambda (a b) (+ a b)) 0 (map (compose (make-adder j) (make-adder 1)) xs))))\n"
+		"  (set j (+ j 1)))\n"
+		"total\n",
+		"195300000" });
+	// Mostly parsing and copying the literal into a constant
+	workloads.push_back({ "quoted_list",
+		"(def xs " + make_quoted_list(200000) + ")\n"
+		"(length xs)\n",
+		"12500" });
+	return workloads;
+}
+
+// Runs every stage of workload once in a fresh interpreter, storing each one's time in times
+static void run_workload(const workload_t& workload, double* times)
+{
+	interpreter_t interpreter;
+	arena_scope_t scope{ &interpreter.arena };
+	heap_scope_t heap{ interpreter.vm.heap };
+
+	auto start = bench_clock::now();
+	auto forms = parse(workload.source);
+	auto parsed = bench_clock::now();
+	for (auto&& form : forms)
+		form = interpreter.expand_list(std::move(form));
+	auto expanded = bench_clock::now();
+	std::vector<std::shared_ptr<const function_t>> functions;
+	// Rooted like interpreter_t::compile does, a collection while one form runs
+	// must not free the constants of the ones after it
+	for (auto&& form : forms)
+	{
+		functions.push_back(compile(form));
+		interpreter.vm.add_root(functions.back());
+	}
+	auto compiled = bench_clock::now();
+	value_t result;
+	for (auto&& function : functions)
+		result = interpreter.vm.execute(function);
+	auto executed = bench_clock::now();
+
+	times[0] = elapsed_ns(start, parsed);
+	times[1] = elapsed_ns(parsed, expanded);
+	times[2] = elapsed_ns(expanded, compiled);
+	times[3] = elapsed_ns(compiled, executed);
+	times[4] = elapsed_ns(start, executed);
+
+	std::ostringstream stream;
+	stream << result;
+	// Printed values end in a space
+	auto printed = stream.str();
+	printed.erase(printed.find_last_not_of(' ') + 1);
+	if (printed != workload.expected)
+		throw std::runtime_error{ std::string{ workload.name } + " gave " + printed + ", expected " + workload.expected };
+}
+
+static void bench_workload(const workload_t& workload, int repetitions, std::vector<result_t>& results)
+{
+	double times[stage_count];
+	// Faults in the code and the allocator's pages
+	run_workload(workload, times);
+
+	auto first = results.size();
+	for (auto stage : stage_names)
+		results.push_back({ workload.name, stage, 1, {} });
+	for (int i = 0; i < repetitions; ++i)
+	{
+		run_workload(workload, times);
+		for (size_t stage = 0; stage < stage_count; ++stage)
+			results[first + stage].ns.push_back(times[stage]);
+	}
+}
+
+template <typename fn_t>
+static void bench_micro(const char* name, std::int64_t iterations, int repetitions, std::vector<result_t>& results, fn_t&& fn)
+{
+	result_t result{ "variant", name, iterations, {} };
+	for (int i = -1; i < repetitions; ++i)
+	{
+		auto start = bench_clock::now();
+		for (std::int64_t j = 0; j < iterations; ++j)
+			fn();
+		auto ns = elapsed_ns(start, bench_clock::now()) / static_cast<double>(iterations);
+		// The first round only warms up
+		if (i >= 0)
+			result.ns.push_back(ns);
+	}
+	results.push_back(std::move(result));
+}
+
+static object make_int_list(int64_t size)
+{
+	list_t list;
+	for (int64_t i = 0; i < size; ++i)
+		list.emplace_back(i);
+	return list;
+}
+
+static void bench_variant(int repetitions, const std::string& filter, std::vector<result_t>& results)
+{
+	const std::int64_t iterations = 200000;
+	auto micro = [&](const char* name, std::int64_t count, auto&& fn)
+	{
+		if (filter.empty() || std::strstr("variant", filter.c_str()) || std::strstr(name, filter.c_str()))
+			bench_micro(name, count, repetitions, results, fn);
+	};
+
+	auto list = make_int_list(100);
+	micro("copy_list_100", iterations, [&]
+	{
+		object copy{ list };
+		sink = copy.get_type_index();
+	});
+	micro("move_list_100", iterations, [&]
+	{
+		object moved{ std::move(list) };
+		list = std::move(moved);
+		sink = list.get_type_index();
+	});
+
+	object str{ std::string(100, 'x') };
+	micro("copy_string_100", iterations, [&]
+	{
+		object copy{ str };
+		sink = copy.get_type_index();
+	});
+	micro("move_string_100", iterations, [&]
+	{
+		object moved{ std::move(str) };
+		str = std::move(moved);
+		sink = str.get_type_index();
+	});
+
+	micro("grow_vector_1000_strings", iterations / 100, [&]
+	{
+		std::vector<object> vec;
+		for (int i = 0; i < 1000; ++i)
+			vec.emplace_back(std::string(40, 'x'));
+		sink = vec.size();
+	});
+
+	object first{ nil_t{} };
+	micro("visit_first_alternative", iterations * 10, [&]
+	{
+		first.visit([](auto&& item) { sink = sizeof(item); });
+	});
+	micro("visit_last_alternative", iterations * 10, [&]
+	{
+		list.visit([](auto&& item) { sink = sizeof(item); });
+	});
+
+	// Unpredictable alternatives, which is what the interpreter sees
+	std::vector<object> mixed;
+	for (int i = 0; i < 1024; ++i)
+	{
+		switch ((i * 7919) % 5)
+		{
+		case 0: mixed.emplace_back(nil_t{}); break;
+		case 1: mixed.emplace_back(int64_t{ i }); break;
+		case 2: mixed.emplace_back(i * 0.5); break;
+		case 3: mixed.emplace_back(std::string(i % 30, 'x')); break;
+		case 4: mixed.emplace_back(make_int_list(i % 4)); break;
+		}
+	}
+	micro("visit_mixed_1024", iterations / 100, [&]
+	{
+		int64_t total = 0;
+		for (auto&& item : mixed)
+			item.visit([&](auto&& val) { total += sizeof(val); });
+		sink = total;
+	});
+}
+
+static double median(std::vector<double> values)
+{
+	std::sort(values.begin(), values.end());
+	auto middle = values.size() / 2;
+	return values.size() % 2 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+// One result per line, so a baseline can be read back without a JSON parser
+static void write_json(std::ostream& out, int repetitions, const std::vector<result_t>& results)
+{
+	out << "{\n";
+	out << "\t\"format\": 1,\n";
+#ifdef __VERSION__
+	out << "\t\"compiler\": \"" << __VERSION__ << "\",\n";
+#endif
+	out << "\t\"jit\": " << (interpreter_t{}.vm.jit_enabled ? "true" : "false") << ",\n";
+	out << "\t\"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "\t\"repetitions\": " << repetitions << ",\n";
+	out << "\t\"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		auto&& result = results[i];
+		char line[512];
+		std::snprintf(line, sizeof(line),
+			"\t\t{ \"workload\": \"%s\", \"stage\": \"%s\", \"iterations\": %lld, \"median_ns\": %.1f, \"min_ns\": %.1f, \"max_ns\": %.1f }%s\n",
+			result.workload.c_str(), result.stage.c_str(), static_cast<long long>(result.iterations), median(result.ns),
+			*std::min_element(result.ns.begin(), result.ns.end()), *std::max_element(result.ns.begin(), result.ns.end()),
+			i + 1 < results.size() ? "," : "");
+		out << line;
+	}
+	out << "\t]\n";
+	out << "}\n";
+}
+
+// The string value of "key": "value" in line, empty when it's missing
+static std::string find_field(const std::string& line, const std::string& key)
+{
+	auto pos = line.find("\"" + key + "\": ");
+	if (pos == std::string::npos)
+		return{};
+	pos += key.size() + 4;
+	if (pos < line.size() && line[pos] == '"')
+	{
+		auto end = line.find('"', pos + 1);
+		return line.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+	}
+	return line.substr(pos, line.find_first_of(",}", pos) - pos);
+}
+
+// Medians of a file write_json wrote, by workload and stage
+static std::map<std::pair<std::string, std::string>, double> read_baseline(const std::string& path)
+{
+	std::ifstream file{ path };
+	if (file.fail())
+		throw std::runtime_error{ "Failed to open baseline " + path };
+	std::map<std::pair<std::string, std::string>, double> medians;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		auto workload = find_field(line, "workload");
+		auto value = find_field(line, "median_ns");
+		if (!workload.empty() && !value.empty())
+			medians[{ workload, find_field(line, "stage") }] = std::strtod(value.c_str(), nullptr);
+	}
+	return medians;
+}
+
+static void print_comparison(const std::map<std::pair<std::string, std::string>, double>& baseline, const std::vector<result_t>& results)
+{
+	std::fprintf(stderr, "%-12s %-26s %14s %14s %8s\n", "workload", "stage", "baseline ns", "candidate ns", "change");
+	for (auto&& result : results)
+	{
+		auto it = baseline.find({ result.workload, result.stage });
+		if (it == baseline.end())
+			continue;
+		auto candidate = median(result.ns);
+		std::fprintf(stderr, "%-12s %-26s %14.1f %14.1f %+7.1f%%\n", result.workload.c_str(), result.stage.c_str(),
+			it->second, candidate, it->second > 0 ? (candidate / it->second - 1) * 100 : 0.0);
+	}
+}
+
+int main(int argc, char** argv)
+try
+{
+	int repetitions = 5;
+	std::string filter;
+	std::string output;
+	std::string baseline;
+	for (auto i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (i + 1 == argc)
+			throw std::runtime_error{ "Missing value for " + arg };
+		if (arg == "--repetitions")
+			repetitions = std::max(1, std::atoi(argv[++i]));
+		else if (arg == "--filter")
+			filter = argv[++i];
+		else if (arg == "--output")
+			output = argv[++i];
+		else if (arg == "--baseline")
+			baseline = argv[++i];
+		else
+			throw std::runtime_error{ "Unknown option " + arg };
+	}
+
+	std::vector<result_t> results;
+	for (auto&& workload : make_workloads())
+	{
+		if (!filter.empty() && !std::strstr(workload.name, filter.c_str()))
+			continue;
+		std::cerr << workload.name << "..." << std::endl;
+		bench_workload(workload, repetitions, results);
+	}
+	std::cerr << "variant..." << std::endl;
+	bench_variant(repetitions, filter, results);
+	if (results.empty())
+		throw std::runtime_error{ "Nothing matches " + filter };
+
+	if (output.empty())
+		write_json(std::cout, repetitions, results);
+	else
+	{
+		std::ofstream file{ output };
+		write_json(file, repetitions, results);
+		if (!file)
+			throw std::runtime_error{ "Failed to write " + output };
+	}
+	if (!baseline.empty())
+		print_comparison(read_baseline(baseline), results);
+	return 0;
+}
+catch (std::runtime_error& e)
+{
+	std::cerr << "catlang_bench: " << e.what() << std::endl;
+	return 1;
+}
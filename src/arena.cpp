@@ -0,0 +1,82 @@
+#include "arena.h"
+
+static thread_local arena_t* current_arena = nullptr;
+
+void* arena_t::allocate_chunk(std::size_t size, std::size_t alignment)
+{
+	// Oversized requests get a chunk to themselves so they don't waste the rest of one
+	auto new_chunk_size = size + alignment > chunk_size ? size + alignment : chunk_size;
+	chunks.emplace_back(new char[new_chunk_size]);
+	auto chunk = chunks.back().get();
+	auto aligned = reinterpret_cast<char*>(
+		(reinterpret_cast<std::uintptr_t>(chunk) + alignment - 1) & ~(alignment - 1));
+	pos = aligned + size;
+	end = chunk + new_chunk_size;
+	return aligned;
+}
+
+void arena_t::release()
+{
+	if (chunks.empty())
+		return;
+	chunks.resize(1);
+	pos = chunks[0].get();
+	end = pos + chunk_size;
+}
+
+void arena_t::rewind(const mark_t& mark)
+{
+	// Nothing was allocated before the mark, keep the first chunk like release does
+	if (mark.chunk_count == 0)
+	{
+		release();
+		return;
+	}
+	chunks.resize(mark.chunk_count);
+	pos = mark.pos;
+	end = mark.end;
+}
+
+arena_t* arena_t::current()
+{
+	return current_arena;
+}
+
+arena_scope_t::arena_scope_t(arena_t* arena)
+	: arena(arena), previous(current_arena), start(arena ? arena->mark() : arena_t::mark_t{})
+{
+	current_arena = arena;
+}
+
+arena_scope_t::~arena_scope_t()
+{
+	current_arena = previous;
+	if (arena)
+		arena->rewind(start);
+}
+
+// Keeps the object after it aligned as strictly as new would
+union arena_header_t
+{
+	arena_t* arena;
+	std::max_align_t align;
+};
+
+void* arena_allocated::operator new(std::size_t size)
+{
+	auto arena = current_arena;
+	auto header = static_cast<arena_header_t*>(arena
+		? arena->allocate(sizeof(arena_header_t) + size, alignof(arena_header_t))
+		: ::operator new(sizeof(arena_header_t) + size));
+	header->arena = arena;
+	return header + 1;
+}
+
+void arena_allocated::operator delete(void* ptr)
+{
+	if (!ptr)
+		return;
+	auto header = static_cast<arena_header_t*>(ptr) - 1;
+	if (!header->arena)
+		::operator delete(header);
+}
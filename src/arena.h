@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <type_traits>
+#include "stats.h"
+
+// Bump allocator for memory that all dies at once, like the syntax tree of one
+// evaluation. Nothing is freed individually, release drops everything.
+struct arena_t
+{
+	explicit arena_t(std::size_t chunk_size = 64 * 1024)
+		: chunk_size(chunk_size) {}
+	arena_t(const arena_t&) = delete;
+	arena_t& operator =(const arena_t&) = delete;
+
+	void* allocate(std::size_t size, std::size_t alignment)
+	{
+		auto aligned = reinterpret_cast<char*>(
+			(reinterpret_cast<std::uintptr_t>(pos) + alignment - 1) & ~(alignment - 1));
+		if (aligned + size > end || !pos)
+			return allocate_chunk(size, alignment);
+		pos = aligned + size;
+		return aligned;
+	}
+	// Frees everything, the first chunk is kept for the next round
+	void release();
+
+	// Where the next allocation goes, rewind frees everything allocated after it
+	struct mark_t
+	{
+		std::size_t chunk_count;
+		char* pos;
+		char* end;
+	};
+	mark_t mark() const { return{ chunks.size(), pos, end }; }
+	void rewind(const mark_t& mark);
+
+	// Arena new allocations go to on this thread, null means the global heap
+	static arena_t* current();
+
+private:
+	friend struct arena_scope_t;
+	void* allocate_chunk(std::size_t size, std::size_t alignment);
+
+	std::size_t chunk_size;
+	std::vector<std::unique_ptr<char[]>> chunks;
+	char* pos = nullptr;
+	char* end = nullptr;
+};
+
+// Makes arena the current one until the scope ends, then frees what was allocated
+// from it meanwhile. Scopes nest, an inner one leaves the outer one's memory alone.
+// Pass null to allocate on the heap, that's how values that outlive an arena get
+// copied out.
+struct arena_scope_t
+{
+	explicit arena_scope_t(arena_t* arena);
+	~arena_scope_t();
+	arena_scope_t(const arena_scope_t&) = delete;
+	arena_scope_t& operator =(const arena_scope_t&) = delete;
+
+	arena_t* arena;
+	arena_t* previous;
+	arena_t::mark_t start;
+};
+
+// Allocates from the arena that was current when the container was created.
+// Copies pick up the arena that is current at the time of the copy.
+template <typename T>
+struct arena_allocator
+{
+	using value_type = T;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	arena_allocator()
+		: arena(arena_t::current()) {}
+	template <typename U>
+	arena_allocator(const arena_allocator<U>& src)
+		: arena(src.arena) {}
+
+	// Only list_t uses it, so these are counted as syntax tree list storage
+	T* allocate(std::size_t n)
+	{
+		CATLANG_COUNT(stat_syntax_list_allocations);
+		CATLANG_COUNT_BY(stat_syntax_list_bytes, n * sizeof(T));
+		if (arena)
+			return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(T* ptr, std::size_t)
+	{
+		if (!arena)
+			::operator delete(ptr);
+	}
+
+	arena_allocator select_on_container_copy_construction() const { return{}; }
+
+	arena_t* arena;
+};
+
+template <typename T, typename U>
+bool operator ==(const arena_allocator<T>& lhs, const arena_allocator<U>& rhs) { return lhs.arena == rhs.arena; }
+template <typename T, typename U>
+bool operator !=(const arena_allocator<T>& lhs, const arena_allocator<U>& rhs) { return lhs.arena != rhs.arena; }
+
+// Base for types allocated one at a time with new that should come from the
+// current arena. A header in front of each block remembers where it came from.
+struct arena_allocated
+{
+	static void* operator new(std::size_t size);
+	static void operator delete(void* ptr);
+	// Declaring the above hides these
+	static void* operator new(std::size_t, void* where) { return where; }
+	static void operator delete(void*, void*) {}
+};
@@ -1,10 +1,13 @@
 #pragma once
 
 #include "variant.h"
+#include "symbol.h"
+#include "arena.h"
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <cstdint>
+#include <cstddef>
 #include <functional>
 #include <iostream>
 #include <memory>
@@ -13,10 +16,11 @@ using std::int64_t;
 #define TOKENIZE_IMPL(a, b) a##b
 #define TOKENIZE(a, b) TOKENIZE_IMPL(a, b)
 
+// Syntax tree lists come from the current arena while one is active, see interpret_line
 template <typename T>
-struct list_impl : std::vector<T>
+struct list_impl : std::vector<T, arena_allocator<T>>, arena_allocated
 {
-	using std::vector<T>::vector;
+	using std::vector<T, arena_allocator<T>>::vector;
 
 	template <typename U>
 	void visit(U&& fn)
@@ -36,30 +40,18 @@ struct list_impl : std::vector<T>
 };
 
 template <typename tag>
-struct tagged_string : std::string
+struct tagged_symbol
 {
-	using std::string::string;
-	using std::string::operator=;
+	const std::string& name() const { return get_symbol_name(symbol); }
 
-	tagged_string(const std::string& str)
-	{
-		*this = str;
-	}
+	symbol_t symbol;
 };
 
-using statement = tagged_string<struct statement_tag>;
-using variable_reference = tagged_string<struct variable_reference_tag>;
+using statement = tagged_symbol<struct statement_tag>;
+using variable_reference = tagged_symbol<struct variable_reference_tag>;
 
 struct nil_t {};
 
-template <typename T>
-struct lambda_impl
-{
-	std::vector<std::string> parameters;
-	list_impl<T> body;
-	std::unordered_map<std::string, std::shared_ptr<T>> context;
-};
-
 using object = recursive_variant<
 	nil_t,
 	bool,
@@ -68,13 +60,9 @@ using object = recursive_variant<
 	std::string,
 	statement,
 	variable_reference,
-	heap_wrapper<lambda_impl<recursive_variant_tag>>,
-	std::function<recursive_variant_tag(const list_impl<recursive_variant_tag>&, struct context_t&)>,
 	list_impl<recursive_variant_tag>>;
 
 using list_t = list_impl<object>;
-using lambda_t = lambda_impl<object>;
-using builtin_func_t = std::function<object(const list_t&, struct context_t&)>;
 
 inline std::ostream& operator <<(std::ostream& lhs, nil_t)
 {
@@ -84,19 +72,10 @@ inline std::ostream& operator <<(std::ostream& lhs, nil_t)
 
 inline std::ostream& operator <<(std::ostream& lhs, const list_t& rhs);
 
-inline std::ostream& operator <<(std::ostream& lhs, const lambda_t& rhs)
-{
-	lhs << "lambda: {parameters:";
-	for (auto&& item : rhs.parameters)
-		lhs << " " << item;
-	lhs << std::endl;
-	lhs << ", body: " << rhs.body << "}\n";
-	return lhs;
-}
-
-inline std::ostream& operator <<(std::ostream& lhs, const builtin_func_t&)
+template <typename tag>
+std::ostream& operator <<(std::ostream& lhs, const tagged_symbol<tag>& rhs)
 {
-	lhs << "(builtin func)";
+	lhs << rhs.name();
 	return lhs;
 }
 
@@ -113,48 +92,3 @@ inline std::ostream& operator <<(std::ostream& lhs, const list_t& rhs)
 	lhs << "}";
 	return lhs;
 }
-
-#ifdef _MSC_VER
-#define TYPE_CHECK auto check = [&](auto&& val) { return val.is_type<int64_t>() || val.is_type<double>(); };
-#else
-#define TYPE_CHECK auto check = [&](auto&& val) { return val.template is_type<int64_t>() || val.template is_type<double>(); };
-#endif
-#define MAKE_SEXPR_OP_OVERLOAD_IMPL(op, op_name) \
-template <typename T1, typename T2, typename... types> \
-std::enable_if_t<is_part_of<T1, types...>::value && is_part_of<T2, types...>::value, object> op_name(T1&& lhs, T2&& rhs) \
-{ \
-	return lhs op rhs; \
-} \
-template <typename T1, typename T2, typename... types> \
-std::enable_if_t<!(is_part_of<T1, types...>::value && is_part_of<T2, types...>::value), object> op_name(T1&&, T2&&) \
-{ \
-	return nil_t{}; \
-} \
-inline object operator op(const object& lhs, const object& rhs) \
-{ \
-	TYPE_CHECK \
-	if (!check(lhs) || !check(rhs)) \
-		throw std::runtime_error{ std::string{"Can't " #op " types "} +std::to_string(lhs.get_type_index()) + " and " + std::to_string(rhs.get_type_index()) }; \
-	object ret{ 0ll }; \
-	lhs.visit([&](auto&& lhs_item) \
-	{ \
-		/* Fix for bug with decltype in nested lambdas in GCC 4.9.3 */ \
-		using lhs_type = decltype(lhs_item); \
-		rhs.visit([&](auto&& rhs_item) \
-		{ \
-			ret = op_name<lhs_type, decltype(rhs_item), int64_t, double>(lhs_item, rhs_item); \
-		}); \
-	}); \
-	return ret; \
-}
-
-#define MAKE_SEXPR_OP_OVERLOAD(op) MAKE_SEXPR_OP_OVERLOAD_IMPL(op, TOKENIZE(do_op, __COUNTER__))
-
-MAKE_SEXPR_OP_OVERLOAD(+)
-MAKE_SEXPR_OP_OVERLOAD(-)
-MAKE_SEXPR_OP_OVERLOAD(*)
-MAKE_SEXPR_OP_OVERLOAD(/)
-MAKE_SEXPR_OP_OVERLOAD(<)
-MAKE_SEXPR_OP_OVERLOAD(>)
-MAKE_SEXPR_OP_OVERLOAD(<=)
-MAKE_SEXPR_OP_OVERLOAD(>=)
@@ -0,0 +1,607 @@
+#include "compiler.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include "util.h"
+#include "stats.h"
+
+struct variable_address_t
+{
+	enum { local, enclosing, global } kind;
+	std::uint16_t depth;
+	std::int32_t index;
+};
+
+struct compiler_t
+{
+	// parent is the compiler of the enclosing lambda, null at the top level
+	compiler_t(function_t& function, compiler_t* parent)
+		: function(function), parent(parent) {}
+
+	// tail is true when the value is returned from the lambda right away, calls
+	// there reuse the caller's frame
+	void compile(const object& obj, bool tail = false);
+	void compile_list(const list_t& list, bool tail);
+	void compile_body(const list_t& list, size_t start, bool tail);
+	void compile_lambda(const list_t& parameters, const list_t& list, size_t body_start, symbol_t name);
+	symbol_t get_anonymous_name() const;
+
+	void lambda(const list_t& list, bool tail);
+	void def(const list_t& list, bool tail);
+	void set(const list_t& list, bool tail);
+	void cond(const list_t& list, bool tail);
+	void while_(const list_t& list, bool tail);
+	void print(const list_t& list, bool tail);
+	void vars(const list_t& list, bool tail);
+	void if_(const list_t& list, bool tail);
+	void pmap(const list_t& list, bool tail);
+	void pfor(const list_t& list, bool tail);
+	void preduce(const list_t& list, bool tail);
+	void parallel(const list_t& list, parallel_op op, symbol_t name, size_t argument_count);
+	void import(const list_t& list, bool tail);
+	void profile(const list_t& list, bool tail);
+	void guard(const list_t& list, bool tail);
+
+	size_t emit(opcode op, std::int32_t operand = 0, std::uint16_t depth = 0);
+	void patch_jump(size_t at);
+	void push_constant(value_t value);
+	std::int32_t add_name(symbol_t name);
+	std::int32_t define_local(symbol_t name);
+	variable_address_t local_address(std::int32_t slot) const;
+	variable_address_t resolve(symbol_t name);
+	void emit_load(const variable_address_t& address);
+	void emit_store(const variable_address_t& address);
+	// Ends the function, nothing can be emitted after this
+	void finish();
+	bool is_toplevel() const { return parent == nullptr; }
+
+	function_t& function;
+	compiler_t* parent;
+};
+
+using statement_compiler_t = void (compiler_t::*)(const list_t&, bool);
+
+// Indexed by the statement's symbol, see symbol.h for the order
+static const statement_compiler_t statements[] = {
+	&compiler_t::lambda,
+	&compiler_t::def,
+	&compiler_t::set,
+	&compiler_t::cond,
+	&compiler_t::while_,
+	&compiler_t::vars,
+	&compiler_t::print,
+	&compiler_t::if_,
+	&compiler_t::pmap,
+	&compiler_t::pfor,
+	&compiler_t::preduce,
+	&compiler_t::import,
+	&compiler_t::profile,
+	&compiler_t::guard,
+};
+static_assert(sizeof(statements) / sizeof(statements[0]) == statement_count,
+	"every statement needs a compiler");
+
+static symbol_t get_name(const object& obj, const char* where)
+{
+	if (!obj.is_type<variable_reference>())
+		throw std::runtime_error{ std::string{ "Expected a name in " } +where };
+	return obj.get_ref<variable_reference>().symbol;
+}
+
+static const list_t& get_list(const object& obj, const char* where)
+{
+	if (!obj.is_type<list_t>())
+		throw std::runtime_error{ std::string{ "Expected a list in " } +where };
+	return obj.get_ref<list_t>();
+}
+
+static void check_size(const list_t& list, size_t min, size_t max, const char* where)
+{
+	if (list.size() < min || list.size() > max)
+		throw std::runtime_error{ std::string{ "Wrong number of arguments to " } +where };
+}
+
+// Names a lambda body uses, found before compiling it so we know up front whether its
+// locals have to outlive the call
+struct scope_info_t
+{
+	// Referenced in the body or in a nested lambda without being one of its parameters
+	std::vector<symbol_t> free;
+	// Free in a directly nested lambda
+	std::vector<symbol_t> captured;
+	// Bound by def at this level
+	std::vector<symbol_t> defined;
+};
+
+static void analyze(const object& obj, scope_info_t& info);
+
+static void analyze_lambda(const list_t& parameters, size_t first_parameter,
+	const list_t& list, size_t body_start, scope_info_t& outer)
+{
+	scope_info_t inner;
+	for (auto i = body_start; i < list.size(); ++i)
+		analyze(list[i], inner);
+
+	for (auto&& name : inner.free)
+	{
+		auto is_parameter = std::any_of(parameters.begin() + first_parameter, parameters.end(),
+			[&](const object& param) {
+				return param.is_type<variable_reference>() && param.get_ref<variable_reference>().symbol == name;
+			});
+		if (is_parameter)
+			continue;
+		outer.free.push_back(name);
+		outer.captured.push_back(name);
+	}
+}
+
+// Doesn't validate anything, malformed forms are reported when they're compiled
+static void analyze(const object& obj, scope_info_t& info)
+{
+	if (obj.is_type<variable_reference>())
+		return info.free.push_back(obj.get_ref<variable_reference>().symbol);
+
+	if (!obj.is_type<list_t>())
+		return;
+	auto&& list = obj.get_ref<list_t>();
+	if (list.quoted)
+		return;
+
+	if (!list.empty() && list[0].is_type<statement>())
+	{
+		auto symbol = list[0].get_ref<statement>().symbol;
+		if (symbol == symbol_lambda && list.size() >= 2 && list[1].is_type<list_t>())
+			return analyze_lambda(list[1].get_ref<list_t>(), 0, list, 2, info);
+		// The expression is compiled into a lambda, the path along with it is only conservative
+		if (symbol == symbol_profile)
+			return analyze_lambda(list_t{}, 0, list, 1, info);
+
+		if (symbol == symbol_def && list.size() >= 3)
+		{
+			if (list[1].is_type<list_t>() && !list[1].get_ref<list_t>().empty())
+			{
+				auto&& signature = list[1].get_ref<list_t>();
+				if (signature[0].is_type<variable_reference>())
+					info.defined.push_back(signature[0].get_ref<variable_reference>().symbol);
+				return analyze_lambda(signature, 1, list, 2, info);
+			}
+			if (list[1].is_type<variable_reference>())
+			{
+				info.defined.push_back(list[1].get_ref<variable_reference>().symbol);
+				for (auto i = 2u; i < list.size(); ++i)
+					analyze(list[i], info);
+				return;
+			}
+		}
+	}
+
+	for (auto&& item : list)
+		analyze(item, info);
+}
+
+static bool contains(const std::vector<symbol_t>& names, symbol_t name)
+{
+	return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+size_t compiler_t::emit(opcode op, std::int32_t operand, std::uint16_t depth)
+{
+	function.code.push_back({ op, depth, operand });
+	return function.code.size() - 1;
+}
+
+void compiler_t::patch_jump(size_t at)
+{
+	function.code[at].operand = static_cast<std::int32_t>(function.code.size());
+}
+
+void compiler_t::push_constant(value_t value)
+{
+	function.constants.emplace_back(std::move(value));
+	emit(opcode::push_constant, static_cast<std::int32_t>(function.constants.size() - 1));
+}
+
+std::int32_t compiler_t::add_name(symbol_t name)
+{
+	auto it = std::find(function.names.begin(), function.names.end(), name);
+	if (it != function.names.end())
+		return static_cast<std::int32_t>(it - function.names.begin());
+	function.names.push_back(name);
+	return static_cast<std::int32_t>(function.names.size() - 1);
+}
+
+std::int32_t compiler_t::define_local(symbol_t name)
+{
+	auto&& locals = function.locals;
+	auto it = std::find(locals.begin(), locals.end(), name);
+	if (it != locals.end())
+		return static_cast<std::int32_t>(it - locals.begin());
+	locals.push_back(name);
+	return static_cast<std::int32_t>(locals.size() - 1);
+}
+
+variable_address_t compiler_t::local_address(std::int32_t slot) const
+{
+	if (function.has_environment)
+		return{ variable_address_t::enclosing, 0, slot };
+	return{ variable_address_t::local, 0, slot };
+}
+
+// Lambda scopes are searched innermost first, anything not bound in one of them is a global.
+// Only lambdas with an environment add a frame to the chain, so only they count towards depth.
+variable_address_t compiler_t::resolve(symbol_t name)
+{
+	std::uint16_t depth = 0;
+	for (auto compiler = this; !compiler->is_toplevel(); compiler = compiler->parent)
+	{
+		auto&& locals = compiler->function.locals;
+		auto it = std::find(locals.begin(), locals.end(), name);
+		if (it == locals.end())
+		{
+			if (compiler->function.has_environment)
+				++depth;
+			continue;
+		}
+
+		auto slot = static_cast<std::int32_t>(it - locals.begin());
+		if (compiler == this)
+			return local_address(slot);
+
+		// The analysis in compile_lambda is conservative, anything captured has a frame
+		assert(compiler->function.has_environment);
+		for (auto inner = this; inner != compiler; inner = inner->parent)
+			inner->function.captures_environment = true;
+		return{ variable_address_t::enclosing, depth, slot };
+	}
+
+	return{ variable_address_t::global, 0, add_name(name) };
+}
+
+void compiler_t::emit_load(const variable_address_t& address)
+{
+	switch (address.kind)
+	{
+	case variable_address_t::local: emit(opcode::load_local, address.index); break;
+	case variable_address_t::enclosing: emit(opcode::load_enclosing, address.index, address.depth); break;
+	case variable_address_t::global: emit(opcode::load_global, address.index); break;
+	}
+}
+
+void compiler_t::emit_store(const variable_address_t& address)
+{
+	switch (address.kind)
+	{
+	case variable_address_t::local: emit(opcode::store_local, address.index); break;
+	case variable_address_t::enclosing: emit(opcode::store_enclosing, address.index, address.depth); break;
+	case variable_address_t::global:
+		if (is_constant_global(function.names[address.index]))
+			throw std::runtime_error{ "Can't assign constant " + get_symbol_name(function.names[address.index]) };
+		emit(opcode::store_global, address.index);
+		break;
+	}
+}
+
+void compiler_t::finish()
+{
+	emit(opcode::return_);
+	function.resolved_globals.resize(function.names.size());
+}
+
+void compiler_t::compile(const object& obj, bool tail)
+{
+	if (obj.is_type<list_t>())
+		return compile_list(obj.get_ref<list_t>(), tail);
+
+	if (obj.is_type<variable_reference>())
+		return emit_load(resolve(obj.get_ref<variable_reference>().symbol));
+
+	if (obj.is_type<statement>())
+		throw std::runtime_error{ "Unexpected statement " + obj.get_ref<statement>().name() };
+
+	push_constant(to_value(obj));
+}
+
+void compiler_t::compile_list(const list_t& list, bool tail)
+{
+	if (list.quoted)
+		return push_constant(to_value(list));
+
+	if (list.empty())
+		return push_constant(nil_t{});
+
+	if (list[0].is_type<statement>())
+	{
+		CATLANG_COUNT(stat_statement + list[0].get_ref<statement>().symbol);
+		return (this->*statements[list[0].get_ref<statement>().symbol])(list, tail);
+	}
+
+	// Calls through a global name get an inline cache, see call_cache_t
+	auto cache = -1;
+	if (list[0].is_type<variable_reference>())
+	{
+		auto address = resolve(list[0].get_ref<variable_reference>().symbol);
+		emit_load(address);
+		if (address.kind == variable_address_t::global && function.call_caches.size() < UINT16_MAX)
+		{
+			cache = static_cast<int>(function.call_caches.size());
+			function.call_caches.push_back({ address.index });
+		}
+	}
+	else
+		compile(list[0]);
+
+	for (auto i = 1u; i < list.size(); ++i)
+		compile(list[i]);
+	auto argument_count = static_cast<std::int32_t>(list.size() - 1);
+	if (cache >= 0)
+		emit(tail ? opcode::tail_call_global : opcode::call_global, argument_count, static_cast<std::uint16_t>(cache));
+	else
+		emit(tail ? opcode::tail_call : opcode::call, argument_count);
+}
+
+// Evaluates list[start..] in order, leaving only the last value on the stack
+void compiler_t::compile_body(const list_t& list, size_t start, bool tail)
+{
+	if (start >= list.size())
+		return push_constant(nil_t{});
+
+	for (auto i = start; i < list.size(); ++i)
+	{
+		if (i != start)
+			emit(opcode::pop);
+		compile(list[i], tail && i + 1 == list.size());
+	}
+}
+
+void compiler_t::compile_lambda(const list_t& parameters, const list_t& list, size_t body_start, symbol_t name)
+{
+	auto new_function = std::make_shared<function_t>();
+	new_function->name = name;
+	compiler_t child{ *new_function, this };
+	for (auto&& param : parameters)
+	{
+		auto name = get_name(param, "lambda parameter list");
+		if (static_cast<size_t>(child.define_local(name)) != new_function->parameters.size())
+			throw std::runtime_error{ "Duplicate parameter " + get_symbol_name(name) };
+		new_function->parameters.push_back(name);
+	}
+	{
+		// The body outlives the syntax tree's arena
+		arena_scope_t heap{ nullptr };
+		new_function->body = slice(list, static_cast<int>(body_start));
+	}
+
+	scope_info_t info;
+	for (auto i = body_start; i < list.size(); ++i)
+		analyze(list[i], info);
+	new_function->has_environment =
+		std::any_of(new_function->parameters.begin(), new_function->parameters.end(),
+			[&](symbol_t name) { return contains(info.captured, name); }) ||
+		std::any_of(info.defined.begin(), info.defined.end(),
+			[&](symbol_t name) { return contains(info.captured, name); });
+
+	child.compile_body(list, body_start, true);
+	child.finish();
+
+	function.functions.push_back(std::move(new_function));
+	emit(opcode::make_lambda, static_cast<std::int32_t>(function.functions.size() - 1));
+}
+
+// A lambda inside a named one is named after it, make-adder/lambda
+symbol_t compiler_t::get_anonymous_name() const
+{
+	if (is_toplevel())
+		return symbol_lambda;
+	return intern(get_symbol_name(function.name) + "/lambda");
+}
+
+void compiler_t::lambda(const list_t& list, bool)
+{
+	check_size(list, 2, static_cast<size_t>(-1), "lambda");
+	compile_lambda(get_list(list[1], "lambda"), list, 2, get_anonymous_name());
+}
+
+void compiler_t::def(const list_t& list, bool)
+{
+	check_size(list, 3, static_cast<size_t>(-1), "def");
+
+	if (list[1].is_type<list_t>())
+	{
+		// (def (name params...) body...)
+		auto&& signature = list[1].get_ref<list_t>();
+		if (signature.empty())
+			throw std::runtime_error{ "Expected a name in def" };
+		auto name = get_name(signature[0], "def");
+		// Bind the name first so the body can refer to itself
+		auto address = is_toplevel() ? resolve(name) : local_address(define_local(name));
+		compile_lambda(slice(signature, 1), list, 2, name);
+		emit_store(address);
+	}
+	else
+	{
+		check_size(list, 3, 3, "def");
+		auto name = get_name(list[1], "def");
+		// (def name (lambda ...)) names the lambda too
+		auto&& value = list[2];
+		if (value.is_type<list_t>() && !value.get_ref<list_t>().quoted && value.get_ref<list_t>().size() >= 2
+			&& value.get_ref<list_t>()[0].is_type<statement>() && value.get_ref<list_t>()[0].get_ref<statement>().symbol == symbol_lambda)
+			compile_lambda(get_list(value.get_ref<list_t>()[1], "lambda"), value.get_ref<list_t>(), 2, name);
+		else
+			compile(value);
+		emit_store(is_toplevel() ? resolve(name) : local_address(define_local(name)));
+	}
+
+	push_constant(nil_t{});
+}
+
+// Unlike def, set assigns to whichever binding the name resolves to
+void compiler_t::set(const list_t& list, bool)
+{
+	check_size(list, 3, 3, "set");
+	auto name = get_name(list[1], "set");
+	compile(list[2]);
+	emit_store(resolve(name));
+	push_constant(nil_t{});
+}
+
+void compiler_t::cond(const list_t& list, bool tail)
+{
+	std::vector<size_t> end_jumps;
+
+	for (auto i = 1u; i < list.size(); ++i)
+	{
+		auto&& clause = get_list(list[i], "cond");
+		check_size(clause, 1, static_cast<size_t>(-1), "cond clause");
+		compile(clause[0]);
+		auto next = emit(opcode::jump_if_false);
+		compile_body(clause, 1, tail);
+		end_jumps.push_back(emit(opcode::jump));
+		patch_jump(next);
+	}
+
+	push_constant(nil_t{});
+	for (auto&& jump : end_jumps)
+		patch_jump(jump);
+}
+
+void compiler_t::while_(const list_t& list, bool)
+{
+	check_size(list, 2, static_cast<size_t>(-1), "while");
+
+	emit(opcode::profile_enter, symbol_while);
+	auto start = function.code.size();
+	compile(list[1]);
+	auto exit = emit(opcode::jump_if_false);
+	for (auto i = 2u; i < list.size(); ++i)
+	{
+		compile(list[i]);
+		emit(opcode::pop);
+	}
+	emit(opcode::jump, static_cast<std::int32_t>(start));
+	patch_jump(exit);
+	emit(opcode::profile_exit);
+
+	push_constant(nil_t{});
+}
+
+void compiler_t::print(const list_t& list, bool)
+{
+	check_size(list, 2, 2, "print");
+	compile(list[1]);
+	emit(opcode::profile_enter, symbol_print);
+	emit(opcode::print);
+	emit(opcode::profile_exit);
+}
+
+void compiler_t::vars(const list_t& list, bool)
+{
+	check_size(list, 1, 1, "vars");
+	emit(opcode::profile_enter, symbol_vars);
+	emit(opcode::vars);
+	emit(opcode::profile_exit);
+}
+
+void compiler_t::if_(const list_t& list, bool tail)
+{
+	check_size(list, 3, 4, "if");
+
+	compile(list[1]);
+	auto else_jump = emit(opcode::jump_if_false);
+	compile(list[2], tail);
+	auto end_jump = emit(opcode::jump);
+	patch_jump(else_jump);
+	if (list.size() == 4)
+		compile(list[3], tail);
+	else
+		push_constant(nil_t{});
+	patch_jump(end_jump);
+}
+
+void compiler_t::pmap(const list_t& list, bool)
+{
+	parallel(list, parallel_op::map, symbol_pmap, 2);
+}
+
+void compiler_t::pfor(const list_t& list, bool)
+{
+	parallel(list, parallel_op::for_, symbol_pfor, 3);
+}
+
+void compiler_t::preduce(const list_t& list, bool)
+{
+	parallel(list, parallel_op::reduce, symbol_preduce, 3);
+}
+
+// Top-level imports are loaded by the interpreter before anything is compiled,
+// see interpreter_t::compile_forms
+void compiler_t::import(const list_t&, bool)
+{
+	throw std::runtime_error{ "import is only allowed at the top level" };
+}
+
+// The parallel forms evaluate their arguments like a call, the VM does the rest
+void compiler_t::parallel(const list_t& list, parallel_op op, symbol_t name, size_t argument_count)
+{
+	check_size(list, argument_count + 1, argument_count + 1, get_symbol_name(name).c_str());
+	for (auto i = 1u; i < list.size(); ++i)
+		compile(list[i]);
+	emit(opcode::profile_enter, static_cast<std::int32_t>(name));
+	emit(opcode::parallel, static_cast<std::int32_t>(op), static_cast<std::uint16_t>(argument_count));
+	emit(opcode::profile_exit);
+}
+
+// (profile expr [path]) runs expr as the body of a lambda, which the VM calls
+// with a profiler set
+void compiler_t::profile(const list_t& list, bool)
+{
+	check_size(list, 2, 3, "profile");
+	list_t body{ list[0], list[1] };
+	compile_lambda(list_t{}, body, 1, symbol_profile);
+	if (list.size() == 3)
+		compile(list[2]);
+	emit(opcode::profile, static_cast<std::int32_t>(list.size() - 2));
+}
+
+// (guard (name version ...) optimized original): optimized while every name's global
+// still has the version the optimizer folded it at, original after any was rebound
+void compiler_t::guard(const list_t& list, bool tail)
+{
+	check_size(list, 4, 4, "guard");
+	auto&& names = get_list(list[1], "guard");
+	if (function.guards.size() + names.size() / 2 > UINT16_MAX)
+		return compile(list[3], tail);
+
+	std::vector<size_t> rebound_jumps;
+	for (size_t i = 0; i + 1 < names.size(); i += 2)
+	{
+		auto address = resolve(get_name(names[i], "guard"));
+		if (address.kind != variable_address_t::global || !names[i + 1].is_type<int64_t>())
+			throw std::runtime_error{ "Malformed guard" };
+		function.guards.push_back({ address.index, static_cast<std::uint64_t>(names[i + 1].get_ref<int64_t>()) });
+		rebound_jumps.push_back(emit(opcode::jump_if_rebound, 0, static_cast<std::uint16_t>(function.guards.size() - 1)));
+	}
+	compile(list[2], tail);
+	auto end_jump = emit(opcode::jump);
+	for (auto jump : rebound_jumps)
+		patch_jump(jump);
+	compile(list[3], tail);
+	patch_jump(end_jump);
+}
+
+bool is_constant_global(symbol_t name)
+{
+	static const symbol_t constants[] = { intern("true"), intern("false"), intern("nil") };
+	return std::find(std::begin(constants), std::end(constants), name) != std::end(constants);
+}
+
+std::shared_ptr<const function_t> compile(const object& ast, symbol_t name, std::uint32_t line)
+{
+	auto function = std::make_shared<function_t>();
+	function->name = name;
+	function->line = line;
+	compiler_t compiler{ *function, nullptr };
+	compiler.compile(ast);
+	compiler.finish();
+	return function;
+}
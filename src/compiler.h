@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "basic_types.h"
+#include "value.h"
+#include "jit.h"
+
+struct global_t;
+
+enum class opcode : std::uint8_t
+{
+	push_constant,   // push constants[operand]
+	load_local,      // push stack slot operand of the current call
+	load_enclosing,  // push slot operand of the environment frame depth levels up
+	load_global,     // push the global named names[operand]
+	store_local,     // pop into stack slot operand of the current call
+	store_enclosing, // pop into slot operand of the environment frame depth levels up
+	store_global,    // pop into the global named names[operand]
+	pop,
+	jump,            // pc = operand
+	jump_if_false,   // pop, pc = operand if the value is falsy
+	jump_if_rebound, // pc = operand if guards[depth] no longer holds
+	make_lambda,     // push a closure over functions[operand]
+	call,            // operand = argument count, callee sits below the arguments
+	tail_call,       // call in place of the current frame, then return its result
+	call_global,     // call whose callee came from load_global, depth = index into call_caches
+	tail_call_global,
+	return_,
+	print,           // pop and print, push nil
+	vars,            // print the current scope, push nil
+	parallel,        // run the parallel_op operand on the depth values on top, push its result
+	profile,         // pop a path if operand is set and a lambda, push what calling it under a profiler gives
+	profile_enter,   // the form named operand starts, nothing unless a profiler is set, see profiler.h
+	profile_exit,    // the form entered last ends
+};
+
+// What a parallel instruction does, see vm_t::run_parallel
+enum class parallel_op : std::int32_t
+{
+	map,    // (pmap f items): list of (f item) for each item, in order
+	for_,   // (pfor start end f): calls (f i) for each int in [start, end), nil
+	reduce, // (preduce f init items): folds items with f starting from init
+};
+
+struct instruction
+{
+	opcode op;
+	// Number of environment frames to walk up for load_enclosing/store_enclosing
+	std::uint16_t depth;
+	std::int32_t operand;
+};
+
+// Code the optimizer folded with the value a global had is only right while it has
+// that version, see compiler_t::guard
+struct guard_t
+{
+	// Index into names
+	std::int32_t name;
+	std::uint64_t version;
+};
+
+// Inline cache of a call_global. Remembers the builtin its global held at one
+// version of the binding, while the version is unchanged the call goes straight
+// to it. A lambda callee is remembered too, its calls skip the lookup and the
+// refill and go to vm_t::call, which only has to push its frame.
+struct call_cache_t
+{
+	// Index into names of the callee
+	std::int32_t name;
+	global_t* global = nullptr;
+	std::uint64_t version = 0;
+	builtin_func_t builtin = nullptr;
+};
+
+struct function_t
+{
+	// Shown in profiles, the name def bound the lambda to
+	symbol_t name = symbol_lambda;
+	// Where a top-level form starts in the file it's named after, 0 for anything else
+	std::uint32_t line = 0;
+	std::vector<symbol_t> parameters;
+	// Source form of the body, only kept for printing
+	list_t body;
+
+	std::vector<instruction> code;
+	std::vector<value_t> constants;
+	// Global names referenced by the code
+	std::vector<symbol_t> names;
+	std::vector<std::shared_ptr<const function_t>> functions;
+	std::vector<guard_t> guards;
+	// Name of each frame slot, parameters come first
+	std::vector<symbol_t> locals;
+	// Locals live in a heap frame_t when a nested lambda captures one of them,
+	// otherwise they stay on the VM stack
+	bool has_environment = false;
+	// Whether closures over this function need the frame they are created in
+	bool captures_environment = false;
+
+	// Filled in by the VM as the code runs, so they're written through const
+	// functions. They only remember what a lookup would find anyway.
+	// Binding of each of names, resolved the first time it's used
+	mutable std::vector<global_t*> resolved_globals;
+	mutable std::vector<call_cache_t> call_caches;
+	mutable jit_state_t jit;
+};
+
+// Globals code can't assign: true, false and nil. The optimizer prunes branches on them.
+bool is_constant_global(symbol_t name);
+
+// name and line are what the top-level code is shown as, see function_t
+std::shared_ptr<const function_t> compile(const object& ast, symbol_t name = symbol_lambda, std::uint32_t line = 0);
@@ -0,0 +1,165 @@
+#include "value.h"
+#include "compiler.h"
+#include "heap_profiler.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+
+static thread_local heap_t* current_heap = nullptr;
+
+static std::uint32_t next_heap_id()
+{
+	static std::atomic<std::uint32_t> next{ 1 };
+	return next++;
+}
+
+heap_t::heap_t()
+	: id(next_heap_id()) {}
+
+heap_t::~heap_t()
+{
+	while (objects)
+	{
+		auto next = objects->next;
+		destroy_object(objects);
+		objects = next;
+	}
+}
+
+void heap_t::add(heap_object_t* object, std::size_t size)
+{
+	object->heap = id;
+	object->next = objects;
+	objects = object;
+	++object_count;
+	allocated += size;
+#if CATLANG_STATS
+	auto&& stats = get_stat_block();
+	count_stat(stats, stat_heap_objects);
+	count_stat(stats, stat_heap_bytes, size);
+	if (object->type == value_type::list)
+		count_stat(stats, stat_list_cells);
+#endif
+	if (heap_profiler)
+		heap_profiler->add(*object);
+}
+
+void heap_t::mark(const value_t& value)
+{
+	if (value.is_object())
+		mark(value.get_object());
+}
+
+void heap_t::mark(heap_object_t* object)
+{
+	if (object && owns(object) && !object->marked)
+	{
+		object->marked = true;
+		gray.push_back(object);
+	}
+}
+
+void heap_t::mark(const function_t& function)
+{
+	for (auto&& constant : function.constants)
+		mark(constant);
+	for (auto&& nested : function.functions)
+		mark(*nested);
+}
+
+void heap_t::sweep()
+{
+	// An explicit stack instead of recursion, lists can be millions of cells long
+	while (!gray.empty())
+	{
+		auto object = gray.back();
+		gray.pop_back();
+
+		switch (object->type)
+		{
+		case value_type::list:
+		{
+			auto&& list = *static_cast<list_object*>(object);
+			mark(list.head);
+			mark(list.tail);
+			break;
+		}
+		case value_type::lambda:
+		{
+			auto&& lambda = *static_cast<lambda_object*>(object);
+			mark(lambda.frame);
+			mark(*lambda.function);
+			break;
+		}
+		case value_type::frame:
+		{
+			auto&& frame = *static_cast<frame_t*>(object);
+			for (auto&& slot : frame.slots)
+				mark(slot);
+			mark(frame.parent);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	std::size_t live = 0;
+	for (auto link = &objects; *link; )
+	{
+		auto object = *link;
+		if (object->marked)
+		{
+			object->marked = false;
+			++live;
+			link = &object->next;
+		}
+		else
+		{
+			*link = object->next;
+			destroy_object(object);
+		}
+	}
+
+	// Sizes aren't tracked per object, scale the byte count by what survived
+	allocated = object_count ? allocated * live / object_count : 0;
+	object_count = live;
+	threshold = std::max<std::size_t>(1 << 20, allocated * 2);
+}
+
+void heap_t::adopt(heap_t& other)
+{
+	if (!other.objects)
+		return;
+	auto last = other.objects;
+	for (auto object = other.objects; object; object = object->next)
+	{
+		object->heap = id;
+		last = object;
+	}
+	last->next = objects;
+	objects = other.objects;
+	object_count += other.object_count;
+	allocated += other.allocated;
+
+	other.objects = nullptr;
+	other.object_count = 0;
+	other.allocated = 0;
+}
+
+heap_t& heap_t::current()
+{
+	static thread_local heap_t fallback;
+	return current_heap ? *current_heap : fallback;
+}
+
+heap_scope_t::heap_scope_t(heap_t& heap)
+	: previous(current_heap)
+{
+	current_heap = &heap;
+}
+
+heap_scope_t::~heap_scope_t()
+{
+	current_heap = previous;
+}
@@ -0,0 +1,228 @@
+#include "heap_profiler.h"
+#include "vm.h"
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+
+heap_profiler_t* heap_profiler = nullptr;
+
+const std::size_t default_heap_report_rows = 20;
+
+// Sites that get no id of their own are all counted under the last one
+static const std::uint16_t max_site_id = std::numeric_limits<std::uint16_t>::max();
+// A reclaim that frees nothing scans every site, so the next one waits this many new sites
+static const std::size_t reclaim_interval = 4096;
+static const std::size_t binding_type = heap_type_count - 1;
+
+allocation_site_t& get_allocation_site()
+{
+	static thread_local allocation_site_t site{ no_symbol, no_symbol, 0, 0, 0 };
+	return site;
+}
+
+// What the object and whatever it alone owns take. Nothing is resized once
+// it's made, so it's the same when it's freed.
+static std::size_t get_object_size(const heap_object_t& object)
+{
+	switch (object.type)
+	{
+	case value_type::int64: return sizeof(int64_object);
+	case value_type::string:
+	{
+		auto&& value = static_cast<const string_object&>(object).value;
+		auto begin = reinterpret_cast<const char*>(&object);
+		// Short strings are stored inside the object
+		auto inline_data = value.data() >= begin && value.data() < begin + sizeof(string_object);
+		return sizeof(string_object) + (inline_data ? 0 : value.capacity() + 1);
+	}
+	case value_type::list: return sizeof(list_object);
+	// The function is shared with every other lambda made from it
+	case value_type::lambda: return sizeof(lambda_object);
+	case value_type::builtin: return sizeof(builtin_object);
+	case value_type::int_vector:
+		return sizeof(int_vector_object) + static_cast<const int_vector_object&>(object).items.capacity() * sizeof(int64_t);
+	case value_type::double_vector:
+		return sizeof(double_vector_object) + static_cast<const double_vector_object&>(object).items.capacity() * sizeof(double);
+	case value_type::frame:
+		return sizeof(frame_t) + static_cast<const frame_t&>(object).slots.capacity() * sizeof(value_t);
+	default: return 0;
+	}
+}
+
+// Id 0 is for objects that weren't accounted
+heap_profiler_t::heap_profiler_t()
+	: sites(1, allocation_site_t{ no_symbol, no_symbol, 0, 0, 0 }), counts(1) {}
+
+heap_profiler_t::site_key heap_profiler_t::get_site_key(const allocation_site_t& site)
+{
+	return{ static_cast<std::uint64_t>(site.function) << 32 | site.builtin, site.line };
+}
+
+// Looks the id up the first time site allocates, and again after ids were reclaimed
+std::uint16_t heap_profiler_t::get_site_id(allocation_site_t& site)
+{
+	if (!site.id || site.generation != generation)
+	{
+		auto it = site_ids.find(get_site_key(site));
+		site.id = it != site_ids.end() ? it->second : add_site(site);
+		site.generation = generation;
+	}
+	return site.id;
+}
+
+std::uint16_t heap_profiler_t::add_site(const allocation_site_t& site)
+{
+	if (free_ids.empty() && sites.size() >= max_site_id)
+		reclaim_sites();
+	std::uint16_t id;
+	if (!free_ids.empty())
+	{
+		id = free_ids.back();
+		free_ids.pop_back();
+		sites[id] = site;
+	}
+	else if (sites.size() < max_site_id)
+	{
+		id = static_cast<std::uint16_t>(sites.size());
+		sites.push_back(site);
+		counts.emplace_back();
+	}
+	else
+	{
+		if (!warned)
+			std::cerr << "heap profile: more than " << max_site_id - 1 << " sites hold live objects, the rest are counted under ...\n";
+		warned = true;
+		counts.resize(max_site_id + 1u);
+		return max_site_id;
+	}
+	site_ids.emplace(get_site_key(site), id);
+	return id;
+}
+
+// Frees the ids of the sites nothing made is live from any more
+void heap_profiler_t::reclaim_sites()
+{
+	if (reclaim_delay > 0)
+	{
+		--reclaim_delay;
+		return;
+	}
+	for (std::uint16_t id = 1; id < max_site_id; ++id)
+	{
+		auto&& site = counts[id];
+		if (std::all_of(site.begin(), site.end(), [](const heap_count_t& count) { return count.objects == 0; }))
+		{
+			site_ids.erase(get_site_key(sites[id]));
+			free_ids.push_back(id);
+		}
+	}
+	if (free_ids.empty())
+		reclaim_delay = reclaim_interval;
+	else
+		++generation;
+}
+
+void heap_profiler_t::count(std::uint16_t site, std::size_t type, std::int64_t bytes)
+{
+	auto&& count = counts[site][type];
+	count.objects += bytes < 0 ? -1 : 1;
+	count.bytes += bytes;
+}
+
+void heap_profiler_t::add(heap_object_t& object)
+{
+	auto&& site = get_allocation_site();
+	std::lock_guard<std::mutex> lock{ mutex };
+	object.site = get_site_id(site);
+	count(object.site, static_cast<std::size_t>(object.type), static_cast<std::int64_t>(get_object_size(object)));
+}
+
+void heap_profiler_t::remove(const heap_object_t& object)
+{
+	std::lock_guard<std::mutex> lock{ mutex };
+	count(object.site, static_cast<std::size_t>(object.type), -static_cast<std::int64_t>(get_object_size(object)));
+}
+
+void heap_profiler_t::add_binding()
+{
+	auto&& site = get_allocation_site();
+	std::lock_guard<std::mutex> lock{ mutex };
+	// A node of the map, the buckets aren't counted
+	count(get_site_id(site), binding_type, sizeof(variable_map_t::value_type) + sizeof(void*));
+}
+
+static const char* get_heap_type_name(std::size_t type)
+{
+	return type == binding_type ? "binding" : get_type_name(static_cast<value_type>(type));
+}
+
+std::string heap_profiler_t::get_site_name(std::uint16_t site) const
+{
+	if (site == max_site_id)
+		return "...";
+	auto&& function = sites[site].function;
+	auto&& builtin = sites[site].builtin;
+	auto name = function == no_symbol ? std::string{ "host" } : get_symbol_name(function);
+	if (sites[site].line)
+		name += ":" + std::to_string(sites[site].line);
+	return builtin == no_symbol ? name : get_symbol_name(builtin) + " in " + name;
+}
+
+std::vector<heap_row_t> heap_profiler_t::get_rows(std::size_t count) const
+{
+	std::vector<heap_row_t> rows;
+	std::lock_guard<std::mutex> lock{ mutex };
+	for (size_t site = 1; site < counts.size(); ++site)
+	{
+		for (size_t type = 0; type < heap_type_count; ++type)
+		{
+			if (counts[site][type].objects > 0)
+				rows.push_back({ get_site_name(static_cast<std::uint16_t>(site)), get_heap_type_name(type), counts[site][type] });
+		}
+	}
+	count = std::min(count, rows.size());
+	std::partial_sort(rows.begin(), rows.begin() + count, rows.end(), [](const heap_row_t& lhs, const heap_row_t& rhs)
+	{
+		return lhs.live.bytes > rhs.live.bytes;
+	});
+	rows.resize(count);
+	return rows;
+}
+
+void heap_profiler_t::write_report(std::ostream& out, std::size_t count) const
+{
+	counts_t totals;
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		for (auto&& site : counts)
+		{
+			for (size_t type = 0; type < heap_type_count; ++type)
+			{
+				totals[type].objects += site[type].objects;
+				totals[type].bytes += site[type].bytes;
+			}
+		}
+	}
+
+	char line[256];
+	std::snprintf(line, sizeof(line), "%12s %14s  %s\n", "objects", "bytes", "type");
+	out << line;
+	for (size_t type = 0; type < heap_type_count; ++type)
+	{
+		if (!totals[type].objects)
+			continue;
+		std::snprintf(line, sizeof(line), "%12lld %14lld  %s\n", static_cast<long long>(totals[type].objects),
+			static_cast<long long>(totals[type].bytes), get_heap_type_name(type));
+		out << line;
+	}
+
+	std::snprintf(line, sizeof(line), "\n%12s %14s  %-14s %s\n", "objects", "bytes", "type", "site");
+	out << line;
+	for (auto&& row : get_rows(count))
+	{
+		std::snprintf(line, sizeof(line), "%12lld %14lld  %-14s ", static_cast<long long>(row.live.objects),
+			static_cast<long long>(row.live.bytes), row.type);
+		out << line << row.site << '\n';
+	}
+}
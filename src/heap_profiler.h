@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "symbol.h"
+#include "value.h"
+
+// Heap accounting behind --heap-profile and (heap-report). While one is set,
+// every object made is counted under its type and the site that made it, and
+// taken off again when the collector frees it, so the counts are what's live.
+// A site is the lambda that was running and the builtin it was in, if any:
+// "cons in range". Top-level forms are named by the script or module they're
+// in and the line they start on, "cons in lib.cat:12". Global bindings are
+// counted too, they're never freed.
+//
+// Sites are numbered in the padding of heap_object_t, so there are 65534 ids.
+// When they run out, the ids of sites with nothing live left are reused. If
+// every site still holds something, objects from new ones are counted under a
+// site shown as "..." and a warning is printed the first time.
+//
+// The VM keeps this thread's site current while one is set and doesn't use
+// native code meanwhile, which calls lambdas without it. It has to be set
+// before anything it should see is allocated and stay set, objects made
+// before are left out.
+struct allocation_site_t
+{
+	// Name of the running lambda, no_symbol outside of any
+	symbol_t function;
+	// Name of the builtin it called, no_symbol when it's running its own code
+	symbol_t builtin;
+	// Where the top-level form named function starts, 0 in a lambda
+	std::uint32_t line;
+	// Of the site in the heap profiler, 0 until something is allocated
+	std::uint16_t id;
+	// The profiler's generation when id was looked up, ids from before one are stale
+	std::uint32_t generation;
+};
+
+const symbol_t no_symbol = static_cast<symbol_t>(-1);
+
+// Where objects made on this thread are attributed
+allocation_site_t& get_allocation_site();
+inline void set_allocation_site(symbol_t function, symbol_t builtin = no_symbol, std::uint32_t line = 0)
+{
+	get_allocation_site() = { function, builtin, line, 0, 0 };
+}
+
+// Every value_type, then global bindings
+const std::size_t heap_type_count = static_cast<std::size_t>(value_type::frame) + 2;
+
+struct heap_count_t
+{
+	std::int64_t objects = 0;
+	std::int64_t bytes = 0;
+};
+
+struct heap_row_t
+{
+	std::string site;
+	const char* type;
+	heap_count_t live;
+};
+
+struct heap_profiler_t
+{
+	heap_profiler_t();
+
+	void add(heap_object_t& object);
+	void remove(const heap_object_t& object);
+	// A global binding was created
+	void add_binding();
+
+	// Live objects and bytes per site and type, the count with the most bytes first
+	std::vector<heap_row_t> get_rows(std::size_t count) const;
+	// Totals per type, then the count rows with the most bytes
+	void write_report(std::ostream& out, std::size_t count) const;
+
+private:
+	using counts_t = std::array<heap_count_t, heap_type_count>;
+
+	struct site_key
+	{
+		// function << 32 | builtin
+		std::uint64_t names;
+		std::uint32_t line;
+
+		bool operator ==(const site_key& rhs) const
+		{
+			return names == rhs.names && line == rhs.line;
+		}
+	};
+
+	struct site_key_hash
+	{
+		std::size_t operator ()(const site_key& key) const
+		{
+			return std::hash<std::uint64_t>{}(key.names ^ key.line * 0x9e3779b97f4a7c15ull);
+		}
+	};
+
+	static site_key get_site_key(const allocation_site_t& site);
+
+	// Call these with mutex locked
+	std::uint16_t get_site_id(allocation_site_t& site);
+	std::uint16_t add_site(const allocation_site_t& site);
+	void reclaim_sites();
+	void count(std::uint16_t site, std::size_t type, std::int64_t bytes);
+	std::string get_site_name(std::uint16_t site) const;
+
+	// Objects are counted from every thread that allocates
+	mutable std::mutex mutex;
+	// ids index sites and counts
+	std::unordered_map<site_key, std::uint16_t, site_key_hash> site_ids;
+	std::vector<allocation_site_t> sites;
+	std::vector<counts_t> counts;
+	// Of sites that were reclaimed and not reused yet
+	std::vector<std::uint16_t> free_ids;
+	// Bumped whenever ids are reclaimed
+	std::uint32_t generation = 0;
+	// New sites to go before the next reclaim, after one that found nothing
+	std::size_t reclaim_delay = 0;
+	bool warned = false;
+};
+
+// Set for the whole process, see above. Null while nothing is accounted.
+extern heap_profiler_t* heap_profiler;
+
+// How many rows of --heap-profile's report and (heap-report) there are unless asked for more
+extern const std::size_t default_heap_report_rows;
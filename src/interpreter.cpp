@@ -1,397 +1,370 @@
 #include "interpreter.h"
+#include "compiler.h"
+#include "parser.h"
+#include "vector.h"
+#include "module.h"
+#include "reader.h"
+#include "stats.h"
+#include "heap_profiler.h"
 #include <iostream>
+#include <cstdlib>
+#include <cstdint>
 #ifdef __MINGW32__
 #define __NO_INLINE__
 #endif
 #include <algorithm>
 
-static std::array<int, 2> find_next_token(const std::string& expr, size_t pos)
+object interpreter_t::expand_list(object obj)
 {
-	if (expr.empty())
-		return{ {-1, -1} };
-
-	if (expr[pos] == ')')
-		return{ {-1, -1} };
-
-	int start = 0;
-
-	if (expr[0] == '(')
+	if (optimize)
+		optimizer.optimize(obj);
+	if (dump_optimized)
 	{
-		start = static_cast<int>(pos + 1);
-		while (expr[start] == ' ')
-			++start;
+		print_tree(std::cerr, obj);
+		std::cerr << std::endl;
 	}
-
-	if (expr[start] == ')')
-		return{ {-1, -1} };
-
-	auto end = start + 1;
-
-	while (end < static_cast<int>(expr.length()) && expr[end] != ' ' && expr[end] != ')')
-		++end;
-
-	return{ {start, end} };
+	return obj;
 }
 
-static int find_sexpr_end(const std::string& expr, int start_pos)
+static const value_t& get_list_argument(const char* name, const value_t& value)
 {
-	auto parens = 1;
-	auto pos = start_pos + 1;
-
-	while (parens)
-	{
-		if (expr[pos] == '(')
-			++parens;
-		else if (expr[pos] == ')')
-			--parens;
-
-		pos++;
-	}
+	if (!value.is_list())
+		throw std::runtime_error{ std::string{ name } +" expects a list, got " + get_type_name(value.get_type()) };
+	return value;
+}
 
-	return pos;
+static const value_t& get_nonempty_list_argument(const char* name, const value_t& value)
+{
+	if (get_list_argument(name, value).is_empty_list())
+		throw std::runtime_error{ std::string{ name } +" of an empty list" };
+	return value;
 }
 
-list_t interpreter_t::get_string_list(const std::string& expr)
+static size_t get_index_argument(const char* name, const value_t& value, size_t max)
 {
-	list_t ret_list;
+	if (!value.is_int() || value.get_int() < 0 || static_cast<uint64_t>(value.get_int()) > max)
+		throw std::runtime_error{ std::string{ "Index out of range in " } +name };
+	return static_cast<size_t>(value.get_int());
+}
 
-	size_t cur_pos = 0;
+// (+ a b c ...) and (* a b c ...). Ints are accumulated unboxed, the first
+// operand that isn't one hands the rest over to the value_t operators.
+#define MAKE_VARIADIC_OP(op, name, identity, checked_op) \
+static value_t name(const value_t* args, size_t count) \
+{ \
+	check_argument_count(#op, count, 2, SIZE_MAX); \
+	int64_t result = identity; \
+	size_t i = 0; \
+	for (; i < count && args[i].is_int(); ++i) \
+		result = checked_op(result, args[i].get_int()); \
+	if (i == count) \
+		return result; \
+	auto value = i == 0 ? args[i++] : value_t{ result }; \
+	for (; i < count; ++i) \
+		value = value op args[i]; \
+	return value; \
+}
 
-	while (cur_pos < expr.length())
-	{
-		auto token = find_next_token(expr, cur_pos);
+MAKE_VARIADIC_OP(+, builtin_add, 0, checked_add)
+MAKE_VARIADIC_OP(*, builtin_multiply, 1, checked_multiply)
 
-		if (token[0] == -1 || token[1] == -1)
-			break;
+#undef MAKE_VARIADIC_OP
 
-		auto make_list = [&](bool is_code)
-		{
-			auto end = is_code ? find_sexpr_end(expr, token[0]) : token[0] + 1;
-			auto sexpr_string = slice(expr, token[0], end);
-			auto sexpr_list = get_string_list(sexpr_string);
-			sexpr_list.quoted = !is_code;
-			ret_list.emplace_back(std::move(sexpr_list));
-			cur_pos = end;
-		};
-
-		if (expr[token[0]] == '(')
-			make_list(true);
-		else if (expr[token[0]] == '\'' && expr[token[0] + 1] == '(')
-			make_list(false);
-		else
-		{
-			ret_list.emplace_back(slice(expr, token[0], token[1]));
-			cur_pos = token[1];
-		}
-	}
-
-	return ret_list;
+static value_t builtin_cons(const value_t* args, size_t count)
+{
+	check_argument_count("cons", count, 2, 2);
+	return cons(args[0], get_list_argument("cons", args[1]));
 }
 
-list_t interpreter_t::get_abstract_syntax_tree(const list_t& sst)
+static value_t builtin_head(const value_t* args, size_t count)
 {
-	list_t ret_list;
-
-	for (auto& item : sst)
-	{
-		if (item.is_type<list_t>())
-			ret_list.emplace_back(get_abstract_syntax_tree(item.get_ref<list_t>()));
-		else
-		{
-			assert(item.is_type<std::string>());
-			auto&& str = item.get_ref<std::string>();
-			auto int64_result = string_to_int64(str);
-			auto double_result = string_to_double(str);
-			if (int64_result.first)
-				ret_list.emplace_back(int64_result.second);
-			else if (double_result.first)
-				ret_list.emplace_back(double_result.second);
-			else if (str[0] == '\"' && str[str.length() - 1] == '\"')
-				ret_list.emplace_back(std::string{ slice(str, 1, -1) });
-			else
-			{
-				auto it = statements.find(str);
-				if (it == statements.end())
-					ret_list.emplace_back(variable_reference{ str });
-				else
-					ret_list.emplace_back(statement{ str });
-			}
-		}
-	}
-
-	return ret_list;
+	check_argument_count("head", count, 1, 1);
+	return get_nonempty_list_argument("head", args[0]).get_object<list_object>().head;
 }
 
-object interpreter_t::expand_list(const list_t & list)
+static value_t builtin_tail(const value_t* args, size_t count)
 {
-	return list;
+	check_argument_count("tail", count, 1, 1);
+	return get_nonempty_list_argument("tail", args[0]).get_object<list_object>().tail;
 }
 
-object context_t::evaluate_list(const object& obj)
+// (slice list start [end])
+static value_t builtin_slice(const value_t* args, size_t count)
 {
-	if (!obj.is_type<list_t>())
-	{
-		if (obj.is_type<variable_reference>())
-		{
-			auto&& var = obj.get_ref<variable_reference>();
-			auto it = variable_map.find(var);
-			if (it == variable_map.end())
-				throw std::runtime_error{ std::string{ "Undefined variable " } +var };
-			return *it->second;
-		}
-		return obj;
-	}
+	check_argument_count("slice", count, 2, 3);
+	auto length = list_length(get_list_argument("slice", args[0]));
+	auto end = count == 3 ? get_index_argument("slice", args[2], length) : length;
+	auto start = get_index_argument("slice", args[1], end);
+	return slice(args[0], start, end);
+}
 
-	auto&& list = obj.get_ref<list_t>();
+static value_t builtin_length(const value_t* args, size_t count)
+{
+	check_argument_count("length", count, 1, 1);
+	if (is_vector(args[0]))
+		return static_cast<int64_t>(vector_length(args[0]));
+	return static_cast<int64_t>(list_length(get_list_argument("length", args[0])));
+}
 
-	if (list.quoted)
-		return list;
+static value_t builtin_list(const value_t* args, size_t count)
+{
+	return make_list(args, args + count);
+}
 
-	if (list.empty())
-		return nil_t{};
+// Output is buffered until the program ends, see main
+static value_t builtin_flush(const value_t*, size_t count)
+{
+	check_argument_count("flush", count, 0, 0);
+	std::cout.flush();
+	return nil_t{};
+}
 
-	if (list[0].is_type<variable_reference>())
+// ((name count) ...) for each counter that isn't zero, see stats.h. Empty when they're compiled out.
+static value_t builtin_stats(const value_t*, size_t count)
+{
+	check_argument_count("stats", count, 0, 0);
+	std::vector<value_t> items;
+	for (auto&& stat : get_stats())
 	{
-		auto&& var = list[0].get_ref<variable_reference>();
-		list_t new_list;
-		new_list.emplace_back(*variable_map.at(var));
-		new_list.insert(new_list.end(), list.begin() + 1, list.end());
-		return evaluate_list(new_list);
+		value_t pair[] = { value_t::symbol(intern(stat.first)), static_cast<int64_t>(stat.second) };
+		items.push_back(make_list(std::begin(pair), std::end(pair)));
 	}
+	return make_list(items.data(), items.data() + items.size());
+}
 
-	if (list[0].is_type<statement>())
+// (heap-report [count]): ((site type objects bytes) ...) for the count sites
+// and types with the most live bytes, see heap_profiler.h
+static value_t builtin_heap_report(const value_t* args, size_t count)
+{
+	check_argument_count("heap-report", count, 0, 1);
+	if (!heap_profiler)
+		throw std::runtime_error{ "heap-report needs the heap profiler, see --heap-profile" };
+	if (count == 1 && (!args[0].is_int() || args[0].get_int() < 0))
+		throw std::runtime_error{ "heap-report expects a row count" };
+	auto rows = heap_profiler->get_rows(count == 1 ? static_cast<size_t>(args[0].get_int()) : default_heap_report_rows);
+	std::vector<value_t> items;
+	for (auto&& row : rows)
 	{
-		auto stmt = list[0].get_ref<statement>();
-		auto it = interpreter.statements.find(stmt);
-		if (it == interpreter.statements.end())
-			throw std::runtime_error{ std::string{ "Unknown statement " } +stmt };
-		return it->second(list, *this);
+		value_t fields[] = { make_value<string_object>(row.site), value_t::symbol(intern(row.type)),
+			static_cast<int64_t>(row.live.objects), static_cast<int64_t>(row.live.bytes) };
+		items.push_back(make_list(std::begin(fields), std::end(fields)));
 	}
+	return make_list(items.data(), items.data() + items.size());
+}
 
-	if (list[0].is_type<lambda_t>())
-	{
-		auto&& lambda = list[0].get_ref<lambda_t>();
-		auto new_context = context_t{interpreter, lambda.context};
-
-		int i = 1;
-		for (auto&& param : lambda.parameters)
-		{
-			new_context.add_variable(param, std::make_shared<object>(evaluate_list(list[i])));
-			++i;
-		}
-
-		return new_context.evaluate_list(lambda.body);
-	}
+// What every interpreter starts with, built the first time one is created and
+// never changed after. Interpreters copy the bindings, the builtin objects stay
+// in the table's heap, which nothing collects, and are shared by all of them.
+struct builtin_table_t
+{
+	builtin_table_t();
 
-	if (list[0].is_type<builtin_func_t>())
-	{
-		auto&& func = list[0].get_ref<builtin_func_t>();
+	vm_t vm;
+};
 
-		return evaluate_list(func(list, *this));
-	}
+builtin_table_t::builtin_table_t()
+{
+#define MAKE_OP_IMPL(op, name) \
+	auto name = [](const value_t* args, size_t count) -> value_t \
+	{ \
+		if (count != 2) \
+			throw std::runtime_error{ "Wrong number of arguments to " #op }; \
+		return args[0] op args[1]; \
+	}; \
+	vm.add_builtin(#op, name)
+#define MAKE_OP(op) MAKE_OP_IMPL(op, TOKENIZE(oper, __COUNTER__))
 
-	if (list.size() == 1)
-		return evaluate_list(list[0]);
+	vm.add_builtin("+", builtin_add);
+	MAKE_OP(-);
+	vm.add_builtin("*", builtin_multiply);
+	MAKE_OP(/);
+	MAKE_OP(<);
+	MAKE_OP(>);
+	MAKE_OP(<=);
+	MAKE_OP(>=);
 
-	list_t ret_list;
+#undef MAKE_OP
+#undef MAKE_OP_IMPL
 
-	for (auto&& item : list)
-		ret_list.emplace_back(evaluate_list(item));
+	vm.add_builtin("cons", builtin_cons);
+	vm.add_builtin("head", builtin_head);
+	vm.add_builtin("tail", builtin_tail);
+	vm.add_builtin("slice", builtin_slice);
+	vm.add_builtin("length", builtin_length);
+	vm.add_builtin("list", builtin_list);
+	vm.add_builtin("flush", builtin_flush);
+	vm.add_builtin("stats", builtin_stats);
+	vm.add_builtin("heap-report", builtin_heap_report);
+
+	add_vector_builtins(vm);
+
+	vm.add_variable("true", true);
+	vm.add_variable("false", false);
+	vm.add_variable("nil", nil_t{});
+
+	if (auto depth = std::getenv("CATLANG_MAX_CALL_DEPTH"))
+		vm.max_call_depth = std::strtoull(depth, nullptr, 10);
+	// CATLANG_JIT=0 keeps everything in the interpreter
+	if (auto jit = std::getenv("CATLANG_JIT"))
+		vm.jit_enabled = vm.jit_enabled && std::strcmp(jit, "0") != 0;
+	if (auto threshold = std::getenv("CATLANG_JIT_THRESHOLD"))
+		vm.jit_threshold = static_cast<std::uint32_t>(std::strtoul(threshold, nullptr, 10));
+}
 
-	return evaluate_list(ret_list);
+static const builtin_table_t& get_builtin_table()
+{
+	static const builtin_table_t table;
+	return table;
 }
 
-variable_map_t context_t::get_lambda_context(const std::vector<std::string>& params, const list_t& list) const
+interpreter_t::interpreter_t()
 {
-	variable_map_t ret;
+	auto&& builtins = get_builtin_table().vm;
+	vm.globals = builtins.globals;
+	vm.max_call_depth = builtins.max_call_depth;
+	vm.jit_enabled = builtins.jit_enabled;
+	vm.jit_threshold = builtins.jit_threshold;
+}
 
-	for (auto&& item : list)
+void interpreter_t::compile_forms(list_t& forms, const std::string& directory, const form_handler_t& handler,
+	symbol_t name, const std::vector<size_t>* lines)
+{
+	for (size_t i = 0; i < forms.size(); ++i)
 	{
-		if (item.is_type<list_t>())
+		auto&& form = forms[i];
+		std::uint32_t line = lines ? static_cast<std::uint32_t>((*lines)[i]) : 0;
+		// Constants are allocated by the form too
+		if (heap_profiler)
+			set_allocation_site(name, no_symbol, line);
+		auto import = form.is_type<list_t>() && !form.get_ref<list_t>().quoted && !form.get_ref<list_t>().empty()
+			&& form.get_ref<list_t>()[0].is_type<statement>() && form.get_ref<list_t>()[0].get_ref<statement>().symbol == symbol_import;
+		if (!import)
 		{
-			auto result = get_lambda_context(params, item.get_ref<list_t>());
-			ret.insert(result.begin(), result.end());
+			handler(::compile(expand_list(std::move(form)), name, line), false);
 			continue;
 		}
-		
-		if (item.is_type<variable_reference>())
+
+		auto&& list = form.get_ref<list_t>();
+		if (list.size() != 2 || !list[1].is_type<std::string>())
+			throw std::runtime_error{ "import expects a path" };
+		auto path = resolve_module_path(directory, list[1].get_ref<std::string>());
+		if (!imported.insert(path).second)
+			continue;
+		std::vector<size_t> module_lines;
+		auto module = load_module(path, module_lines);
+		compile_forms(module, get_directory(path), [&](const std::shared_ptr<const function_t>& form, bool)
 		{
-			auto&& variable_name = item.get_ref<variable_reference>();
-			if (std::binary_search(params.begin(), params.end(), variable_name))
-				continue;
-			auto it = variable_map.find(variable_name);
-            if (it != variable_map.end())
-            {
-                ret.emplace(*it);
-            }
-		}
+			handler(form, true);
+		}, intern(path), &module_lines);
 	}
-
-	return ret;
 }
 
-void context_t::add_variable(const std::string& name, std::shared_ptr<object> obj)
-{
-		auto it = variable_map.find(name);
-		if (it == variable_map.end())
-			variable_map.emplace(std::make_pair(name, obj));
-		else
-			it->second = obj;
-	}
-
-static bool is_truthy(context_t& context, const object& obj)
+void interpreter_t::interpret_line(const std::string & expr)
 {
-	if (obj.is_type<list_t>())
+	// The syntax tree only lives for this call, compile copies out what it keeps
+	arena_scope_t scope{ &arena };
+	// Constants are allocated while compiling
+	heap_scope_t heap{ vm.heap };
+	auto forms = parse(expr);
+	compile_forms(forms, directory, [&](const std::shared_ptr<const function_t>& form, bool imported)
 	{
-		auto&& list = obj.get_ref<list_t>();
-		if (list.quoted)
-			return true;
-		else
-			return is_truthy(context, context.evaluate_list(list));
-	}
-
-	if (obj.is_type<nil_t>())
-		return false;
-	if (obj.is_type<bool>())
-		return obj.get_ref<bool>();
-	if (obj.is_type<int64_t>())
-		return obj.get_ref<int64_t>() != 0;
-	if (obj.is_type<double>())
-		return obj.get_ref<double>() != 0;
-	if (obj.is_type<std::string>())
-		throw std::runtime_error("Can't convert string to bool");
-
-	throw std::runtime_error("Unknown type");
+		execute_form(form, imported);
+	});
 }
 
-interpreter_t::interpreter_t()
-	: global_context{ *this, variable_map_t{} }
+void interpreter_t::interpret(form_reader_t& reader)
 {
-	auto make_lambda = [&](const list_t& parameters, const list_t& body, const context_t& context)
+	auto name = intern(reader.name);
+	while (true)
 	{
-		std::vector<std::string> vec_params;
-		for (auto&& param : parameters)
-			vec_params.push_back(param.get_ref<std::string>());
-		return lambda_t{ vec_params, body, context.get_lambda_context(vec_params, body) };
-	};
-
-	auto lambda = [&](const list_t& list, context_t& context) -> object
-	{
-		auto&& parameters = list[1].get_ref<list_t>();
-		auto&& body = list[2].get_ref<list_t>();
-		return make_lambda(parameters, body, context);
-	};
-
-	statements["lambda"] = lambda;
-
-
-	auto def = [&](const list_t& list, context_t& context) -> object
-	{
-		if (list[1].is_type<list_t>())
-		{
-			auto&& list1 = list[1].get_ref<list_t>();
-			auto&& name = list1[0].get_ref<std::string>();
-			auto value = make_lambda(slice(list1, 1), list[2].get_ref<list_t>(), context);
-			context.add_variable(name, std::make_shared<object>(value));
-			return nil_t{};
-		}
-
-		auto&& name = list[1].get_ref<std::string>();
-		auto value = context.evaluate_list(list[2]);
-		context.add_variable(name, std::make_shared<object>(value));
-		return nil_t{};
-	};
-
-	statements["def"] = def;
-	statements["set"] = def;
-
-
-	auto cond = [&](const list_t& list, context_t&) -> object
-	{
-		auto conditions = slice(list, 1);
-
-		for (auto&& item : conditions)
+		// Each form's syntax tree is dropped once it has run
+		arena_scope_t scope{ &arena };
+		heap_scope_t heap{ vm.heap };
+		object form = nil_t{};
+		if (!reader.next(form))
+			break;
+		list_t forms;
+		forms.push_back(std::move(form));
+		std::vector<size_t> lines{ reader.line };
+		compile_forms(forms, directory, [&](const std::shared_ptr<const function_t>& form, bool imported)
 		{
-			auto&& list_item = item.get_ref<list_t>();
-			if (is_truthy(global_context, global_context.evaluate_list(list_item[0])))
-				return global_context.evaluate_list(list_item[1]);
-		}
-
-		return nil_t{};
-	};
-
-	statements["cond"] = cond;
-
-
-	auto while_ = [&](const list_t& list, context_t& context) -> object
-	{
-		auto condition = list[1];
-
-		while (is_truthy(context, context.evaluate_list(condition)))
-			context.evaluate_list(slice(list, 2));
-
-		return nil_t{};
-	};
-
-	statements["while"] = while_;
-
-
-	auto vars = [&](const list_t&, context_t& context) -> object
-	{
-		for (auto&& pair : context.variable_map)
-			std::cout << pair.first << " -> " << *pair.second << std::endl;
-
-		return nil_t{};
-	};
-
-	statements["vars"] = vars;
+			execute_form(form, imported);
+		}, name, &lines);
+		if (reader.interactive)
+			std::cout.flush();
+	}
+}
 
+void interpreter_t::execute_form(const std::shared_ptr<const function_t>& form, bool imported)
+{
+	auto val = vm.execute(form);
+	// A module's own values aren't echoed
+	if (!val.is_nil() && !imported)
+		std::cout << val << '\n';
+}
 
-	auto print = [&](const list_t& list, context_t& context) -> object
+script_t interpreter_t::compile(const std::string& source)
+{
+	arena_scope_t scope{ &arena };
+	heap_scope_t heap{ vm.heap };
+	script_t script;
+	auto forms = parse(source);
+	compile_forms(forms, directory, [&](const std::shared_ptr<const function_t>& form, bool)
 	{
-		std::cout << context.evaluate_list(list[1]) << std::endl;
-
-		return nil_t{};
-	};
-
-	statements["print"] = print;
+		script.forms.push_back(form);
+		vm.add_root(form);
+	});
+	return script;
+}
 
+value_t interpreter_t::run(const script_t& script)
+{
+	heap_scope_t heap{ vm.heap };
+	value_t result;
+	for (auto&& form : script.forms)
+		result = vm.execute(form);
+	return result;
+}
 
-	auto if_ = [&](const list_t& list, context_t& context) -> object
-	{
-		return is_truthy(context, context.evaluate_list(list[1])) ? context.evaluate_list(list[2]) : context.evaluate_list(list[3]);
-	};
+value_t interpreter_t::call(const value_t& callee, std::initializer_list<value_t> arguments)
+{
+	heap_scope_t heap{ vm.heap };
+	return vm.apply(callee, arguments);
+}
 
-	statements["if"] = if_;
+value_t interpreter_t::call(const std::string& name, std::initializer_list<value_t> arguments)
+{
+	return call(get(name), arguments);
+}
 
-#define MAKE_OP_IMPL(op, name) \
-	auto name = [&](const list_t& list, context_t& context) -> object \
-	{ \
-		return context.evaluate_list(list[1]) op context.evaluate_list(list[2]); \
-	}; \
-	global_context.add_variable(#op, std::make_shared<object>(builtin_func_t{ name }))
-#define MAKE_OP(op) MAKE_OP_IMPL(op, TOKENIZE(oper, __COUNTER__))
+void interpreter_t::check_assignable(const std::string& name)
+{
+	if (is_constant_global(intern(name)))
+		throw std::runtime_error{ "Can't assign constant " + name };
+}
 
-	MAKE_OP(+);
-	MAKE_OP(-);
-	MAKE_OP(*);
-	MAKE_OP(/);
-	MAKE_OP(<);
-	MAKE_OP(>);
-	MAKE_OP(<=);
-	MAKE_OP(>=);
+void interpreter_t::set(const std::string& name, value_t value)
+{
+	check_assignable(name);
+	vm.add_variable(name, value);
+}
 
-#undef MAKE_OP
-#undef MAKE_OP_IMPL
+void interpreter_t::set(const std::string& name, builtin_func_t function)
+{
+	check_assignable(name);
+	vm.add_builtin(name, function);
+}
 
-	global_context.add_variable("true", std::make_shared<object>(true));
-	global_context.add_variable("false", std::make_shared<object>(false));
-	global_context.add_variable("nil", std::make_shared<object>(nil_t{}));
+value_t interpreter_t::get(const std::string& name)
+{
+	auto it = vm.globals.find(intern(name));
+	if (it == vm.globals.end())
+		throw std::runtime_error{ "Undefined variable " + name };
+	return it->second.value;
 }
 
-void interpreter_t::interpret_line(const std::string & expr)
+value_t interpreter_t::make_string(std::string value)
 {
-	auto val = global_context.evaluate_list(expand_list(get_abstract_syntax_tree(get_string_list(expr))));
-	if (!val.is_type<nil_t>())
-		std::cout << val << std::endl;
+	heap_scope_t heap{ vm.heap };
+	return make_value<string_object>(std::move(value));
 }
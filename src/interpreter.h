@@ -3,32 +3,94 @@
 #include <string>
 #include <array>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
 #include <memory>
+#include <type_traits>
+#include <vector>
 #include "basic_types.h"
 #include "util.h"
+#include "vm.h"
+#include "arena.h"
+#include "optimizer.h"
 
-using variable_map_t = std::unordered_map<std::string, std::shared_ptr<object>>;
+struct form_reader_t;
 
-struct context_t
+// The top-level forms of a source, compiled once by an interpreter and run by
+// it as often as needed. Only valid with the interpreter that compiled it.
+struct script_t
 {
-	object evaluate_list(const object& obj);
-	variable_map_t get_lambda_context(const std::vector<std::string>& params, const list_t& list) const;
-	void add_variable(const std::string& name, std::shared_ptr<object> obj);
-
-	struct interpreter_t& interpreter;
-	variable_map_t variable_map;
+	std::vector<std::shared_ptr<const function_t>> forms;
 };
 
+// The embedding API, linked in from catlang_core. Creating one only copies the
+// builtin bindings, see builtin_table_t. Separate interpreters share no mutable
+// state and can run on different threads.
+//
+// Values belong to the interpreter that made them. The ones returned from run and
+// call are only kept alive until the next run or call, bind them with set to
+// keep them longer. Errors are thrown as
+// std::runtime_error, syntax errors as syntax_error.
 struct interpreter_t
 {
 	interpreter_t();
 
-	list_t get_string_list(const std::string& expr);
-	list_t get_abstract_syntax_tree(const list_t& sst);
-	object expand_list(const list_t& list);
+	object expand_list(object obj);
+	// Parses, compiles and runs expr, printing each result that isn't nil
 	void interpret_line(const std::string& expr);
+	// Does the same for every form reader gives, each is run as soon as it's complete
+	void interpret(form_reader_t& reader);
+
+	// Top-level (import "path") forms are loaded here and their module's forms
+	// become part of the script, see module.h
+	script_t compile(const std::string& source);
+	// Runs the forms of script in order and returns the last one's value, nil when there are none
+	value_t run(const script_t& script);
+	// Calls a lambda or builtin, like a global script defined, with arguments
+	value_t call(const value_t& callee, std::initializer_list<value_t> arguments);
+	value_t call(const std::string& name, std::initializer_list<value_t> arguments);
+	value_t call(const char* name, std::initializer_list<value_t> arguments) { return call(std::string{ name }, arguments); }
+	// Binds a global, code compiled earlier sees the new value. Throws for true,
+	// false and nil, see is_constant_global.
+	void set(const std::string& name, value_t value);
+	void set(const std::string& name, builtin_func_t function);
+	// Binds a callable that carries state, like a lambda capturing a request, a
+	// handle or the interpreter itself. It may call run and call on the same
+	// thread, which go on above the code that called it. Plain functions and
+	// lambdas that capture nothing take the overload above, calls to those are cheaper.
+	template <typename fn_t, typename = typename std::enable_if<!std::is_convertible<fn_t, builtin_func_t>::value
+		&& std::is_convertible<fn_t, host_func_t>::value>::type>
+	void set(const std::string& name, fn_t function)
+	{
+		check_assignable(name);
+		vm.add_host_builtin(name, host_func_t{ std::move(function) });
+	}
+	// Throws if there's no global name
+	value_t get(const std::string& name);
+	// A string value allocated in this interpreter
+	value_t make_string(std::string value);
+
+	vm_t vm;
+	arena_t arena;
+	optimizer_t optimizer{ vm.globals };
+	bool optimize = true;
+	// Print each form to stderr the way it looks after optimizing
+	bool dump_optimized = false;
+	// Where imports outside of modules are resolved from, the working directory when empty
+	std::string directory;
+
+private:
+	static void check_assignable(const std::string& name);
+
+	using form_handler_t = std::function<void(const std::shared_ptr<const function_t>& form, bool imported)>;
+
+	// Compiles forms in order and hands each to handler, named name and the line
+	// it starts on in lines if there are any. A top-level import is replaced by
+	// the forms of the module, unless it was imported before.
+	void compile_forms(list_t& forms, const std::string& directory, const form_handler_t& handler,
+		symbol_t name = symbol_lambda, const std::vector<size_t>* lines = nullptr);
+	void execute_form(const std::shared_ptr<const function_t>& form, bool imported);
 
-	std::unordered_map<std::string, builtin_func_t> statements;
-	context_t global_context;
+	// Resolved paths of every module imported so far, each is only loaded once
+	std::unordered_set<std::string> imported;
 };
@@ -0,0 +1,945 @@
+#include "jit.h"
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+#include <limits>
+#include <map>
+#include "compiler.h"
+#include "vector.h"
+#include "vm.h"
+
+#if CATLANG_JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+jit_code_t::~jit_code_t()
+{
+#if CATLANG_JIT_SUPPORTED
+	if (memory)
+		munmap(memory, memory_size);
+#endif
+}
+
+#if !CATLANG_JIT_SUPPORTED
+
+std::shared_ptr<jit_code_t> jit_compile(const function_t&, const std::vector<jit_type>&, const jit_environment_t&)
+{
+	return nullptr;
+}
+
+#else
+
+enum reg : std::uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+enum xmm : std::uint8_t { xmm0, xmm1 };
+
+enum condition : std::uint8_t
+{
+	cc_o = 0x0, cc_b = 0x2, cc_ae = 0x3, cc_e = 0x4, cc_ne = 0x5, cc_a = 0x7,
+	cc_np = 0xb, cc_l = 0xc, cc_ge = 0xd, cc_le = 0xe, cc_g = 0xf,
+};
+
+enum alu_op : std::uint8_t { alu_add = 0x01, alu_or = 0x09, alu_and = 0x21, alu_sub = 0x29, alu_cmp = 0x39 };
+enum shift_op : std::uint8_t { shift_left = 4, shift_right = 5, shift_arithmetic_right = 7 };
+enum sse_op : std::uint8_t { sse_add = 0x58, sse_multiply = 0x59, sse_subtract = 0x5c, sse_divide = 0x5e };
+
+// Just the x86-64 encodings the compiler below needs. Memory operands are always
+// [base + disp32], jumps always take a rel32 that's patched once the target is known.
+struct assembler_t
+{
+	std::vector<std::uint8_t> code;
+
+	size_t position() const { return code.size(); }
+	void byte(std::uint8_t value) { code.push_back(value); }
+	void u32(std::uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i)
+			byte(static_cast<std::uint8_t>(value >> i * 8));
+	}
+	void u64(std::uint64_t value)
+	{
+		for (int i = 0; i < 8; ++i)
+			byte(static_cast<std::uint8_t>(value >> i * 8));
+	}
+
+	void rex(bool wide, int reg, int rm)
+	{
+		auto prefix = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+		if (prefix != 0x40)
+			byte(static_cast<std::uint8_t>(prefix));
+	}
+	void registers(int reg, int rm) { byte(static_cast<std::uint8_t>(0xc0 | (reg & 7) << 3 | (rm & 7))); }
+	void memory(int reg, int base, std::int32_t disp)
+	{
+		byte(static_cast<std::uint8_t>(0x80 | (reg & 7) << 3 | (base & 7)));
+		if ((base & 7) == rsp)
+			byte(0x24);
+		u32(static_cast<std::uint32_t>(disp));
+	}
+
+	void load(int dst, int base, std::int32_t disp) { rex(true, dst, base); byte(0x8b); memory(dst, base, disp); }
+	void load_byte(int dst, int base, std::int32_t disp) { rex(false, dst, base); byte(0x0f); byte(0xb6); memory(dst, base, disp); }
+	void store(int base, std::int32_t disp, int src) { rex(true, src, base); byte(0x89); memory(src, base, disp); }
+	void compare_memory(int lhs, int base, std::int32_t disp) { rex(true, lhs, base); byte(0x3b); memory(lhs, base, disp); }
+	void move(int dst, int src) { rex(true, src, dst); byte(0x89); registers(src, dst); }
+	void move_immediate(int dst, std::uint64_t value)
+	{
+		if (value <= std::numeric_limits<std::uint32_t>::max())
+		{
+			// Writing the 32-bit register clears the upper half
+			rex(false, 0, dst);
+			byte(static_cast<std::uint8_t>(0xb8 | (dst & 7)));
+			u32(static_cast<std::uint32_t>(value));
+			return;
+		}
+		rex(true, 0, dst);
+		byte(static_cast<std::uint8_t>(0xb8 | (dst & 7)));
+		u64(value);
+	}
+	void alu(alu_op op, int dst, int src) { rex(true, src, dst); byte(op); registers(src, dst); }
+	void compare_immediate(int lhs, std::int32_t value) { rex(true, 0, lhs); byte(0x81); registers(7, lhs); u32(static_cast<std::uint32_t>(value)); }
+	void add_immediate(int dst, std::int8_t value) { rex(true, 0, dst); byte(0x83); registers(0, dst); byte(static_cast<std::uint8_t>(value)); }
+	void subtract_immediate(int dst, std::int8_t value) { rex(true, 0, dst); byte(0x83); registers(5, dst); byte(static_cast<std::uint8_t>(value)); }
+	void multiply(int dst, int src) { rex(true, dst, src); byte(0x0f); byte(0xaf); registers(dst, src); }
+	void shift(shift_op op, int dst, std::uint8_t count) { rex(true, 0, dst); byte(0xc1); registers(op, dst); byte(count); }
+	// dst = 1 if cc else 0, dst has to be rax, rcx, rdx or rbx
+	void set(condition cc, int dst)
+	{
+		byte(0x0f); byte(static_cast<std::uint8_t>(0x90 | cc)); registers(0, dst);
+		byte(0x0f); byte(0xb6); registers(dst, dst);
+	}
+	void test32(int lhs, int rhs) { rex(false, rhs, lhs); byte(0x85); registers(rhs, lhs); }
+
+	void move_to_xmm(int dst, int src) { byte(0x66); rex(true, dst, src); byte(0x0f); byte(0x6e); registers(dst, src); }
+	void move_from_xmm(int dst, int src) { byte(0x66); rex(true, src, dst); byte(0x0f); byte(0x7e); registers(src, dst); }
+	void sse(sse_op op, int dst, int src) { byte(0xf2); byte(0x0f); byte(op); registers(dst, src); }
+	void compare_doubles(int lhs, int rhs) { byte(0x66); byte(0x0f); byte(0x2e); registers(lhs, rhs); }
+
+	void push(int src) { rex(false, 0, src); byte(static_cast<std::uint8_t>(0x50 | (src & 7))); }
+	void pop(int dst) { rex(false, 0, dst); byte(static_cast<std::uint8_t>(0x58 | (dst & 7))); }
+	void call(int target) { rex(false, 0, target); byte(0xff); registers(2, target); }
+	void ret() { byte(0xc3); }
+
+	// Return where the rel32 goes, see patch
+	size_t jump()
+	{
+		byte(0xe9);
+		u32(0);
+		return position() - 4;
+	}
+	size_t jump(condition cc)
+	{
+		byte(0x0f);
+		byte(static_cast<std::uint8_t>(0x80 | cc));
+		u32(0);
+		return position() - 4;
+	}
+	void patch(size_t at, size_t target)
+	{
+		auto offset = static_cast<std::int32_t>(static_cast<std::int64_t>(target) - static_cast<std::int64_t>(at + 4));
+		std::memcpy(&code[at], &offset, sizeof(offset));
+	}
+	void patch_here(size_t at) { patch(at, position()); }
+};
+
+static std::uint64_t get_bits(value_t value)
+{
+	std::uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+// Encoding of value_t that the generated code relies on
+static const std::uint64_t boxed_prefix = 0xfff8000000000000ull;
+static const std::uint64_t int_bits = get_bits(int64_t{ 0 });
+static const std::uint64_t false_bits = get_bits(false);
+static const std::uint64_t nil_bits = get_bits(nil_t{});
+static const std::uint64_t nan_bits = get_bits(std::numeric_limits<double>::quiet_NaN());
+static const std::int32_t int_tag = static_cast<std::int32_t>(int_bits >> 48);
+static const std::int32_t bool_tag = static_cast<std::int32_t>(false_bits >> 48);
+
+static jit_type get_constant_type(const value_t& value)
+{
+	if (value.is_small_int())
+		return jit_type::int_;
+	if (value.is_double())
+		return jit_type::double_;
+	if (value.is_bool())
+		return jit_type::bool_;
+	return jit_type::unknown;
+}
+
+static bool is_comparison(arithmetic_op op)
+{
+	return op == arithmetic_op::less || op == arithmetic_op::greater
+		|| op == arithmetic_op::less_equal || op == arithmetic_op::greater_equal;
+}
+
+// Types of the locals and the operand stack before an instruction
+struct jit_frame_state_t
+{
+	bool reached = false;
+	std::vector<jit_type> locals;
+	std::vector<jit_type> stack;
+};
+
+struct jit_compiler_t
+{
+	jit_compiler_t(const function_t& function, const std::vector<jit_type>& parameter_types,
+		const jit_environment_t& environment)
+		: function(function), parameter_types(parameter_types), environment(environment) {}
+
+	std::shared_ptr<jit_code_t> compile();
+
+private:
+	struct callee_t
+	{
+		global_t* global = nullptr;
+		std::uint64_t version = 0;
+		bool is_builtin = false;
+		bool is_self = false;
+		bool is_arithmetic = false;
+		arithmetic_op op = arithmetic_op::add;
+	};
+
+	bool analyze();
+	bool merge(size_t pc, const jit_frame_state_t& state);
+	void emit(size_t pc);
+
+	std::int32_t local(size_t index) const { return static_cast<std::int32_t>(8 * (1 + index)); }
+	std::int32_t slot(size_t depth) const { return local(function.locals.size() + depth); }
+	std::size_t top(size_t depth) const { return 1 + function.locals.size() + depth; }
+
+	global_t* find_global(std::int32_t name) const;
+	callee_t get_callee(const instruction& ins) const;
+
+	void deopt(size_t pc) { deopt(assembler.jump(), pc); }
+	void deopt(size_t patch, size_t pc) { exits[pc << 2 | jit_exit_deopt].push_back(patch); }
+	void jump_to(size_t target) { jumps.emplace_back(assembler.jump(), target); }
+	void jump_to(condition cc, size_t target) { jumps.emplace_back(assembler.jump(cc), target); }
+	size_t jump_unless(jit_type type, std::int32_t disp);
+	void guard_version(const callee_t& callee, size_t pc);
+	void emit_arithmetic(size_t pc, arithmetic_op op, const jit_frame_state_t& state);
+	void emit_int_op(arithmetic_op op, std::int32_t lhs, std::int32_t rhs, std::int32_t result, size_t pc);
+	void emit_double_op(arithmetic_op op, std::int32_t lhs, std::int32_t rhs, std::int32_t result);
+	void emit_branch_if_false(size_t pc, jit_type type, std::int32_t disp, size_t target);
+	void emit_call(size_t pc, size_t depth, size_t argument_count);
+	void emit_safe_point(size_t depth);
+	void emit_self_tail_call(size_t pc, const callee_t& callee);
+	void emit_return(std::int32_t disp);
+
+	const function_t& function;
+	const std::vector<jit_type>& parameter_types;
+	const jit_environment_t& environment;
+
+	std::vector<jit_frame_state_t> states;
+	size_t frame_size = 0;
+	// Whether the last merge added anything
+	bool changed = false;
+	size_t max_depth = 0;
+
+	assembler_t assembler;
+	size_t body = 0;
+	std::vector<size_t> labels;
+	// Patch positions and the pc they go to
+	std::vector<std::pair<size_t, size_t>> jumps;
+	std::vector<size_t> returns;
+	// Patch positions by the status their exit returns
+	std::map<std::uint64_t, std::vector<size_t>> exits;
+	// Patch positions by the pc of a call whose helper didn't return 0
+	std::map<size_t, std::vector<size_t>> call_exits;
+};
+
+global_t* jit_compiler_t::find_global(std::int32_t name) const
+{
+	if (auto global = function.resolved_globals[name])
+		return global;
+	auto&& globals = environment.vm->globals;
+	auto it = globals.find(function.names[name]);
+	return it == globals.end() ? nullptr : &it->second;
+}
+
+// What a call_global or tail_call_global calls right now. The code is only
+// right while the global keeps that version, see guard_version.
+jit_compiler_t::callee_t jit_compiler_t::get_callee(const instruction& ins) const
+{
+	callee_t callee;
+	callee.global = find_global(function.call_caches[ins.depth].name);
+	if (!callee.global)
+		return callee;
+	callee.version = callee.global->version;
+
+	auto&& value = callee.global->value;
+	if (value.is_object(value_type::lambda))
+	{
+		auto&& lambda = value.get_object<lambda_object>();
+		callee.is_self = lambda.function.get() == &function && !function.captures_environment
+			&& static_cast<size_t>(ins.operand) == function.parameters.size();
+	}
+	else if (value.is_object(value_type::builtin))
+	{
+		callee.is_builtin = true;
+		if (ins.operand != 2)
+			return callee;
+		static const std::pair<const char*, arithmetic_op> operators[] = {
+			{ "+", arithmetic_op::add },
+			{ "-", arithmetic_op::subtract },
+			{ "*", arithmetic_op::multiply },
+			{ "/", arithmetic_op::divide },
+			{ "<", arithmetic_op::less },
+			{ ">", arithmetic_op::greater },
+			{ "<=", arithmetic_op::less_equal },
+			{ ">=", arithmetic_op::greater_equal },
+		};
+		auto name = value.get_object<builtin_object>().name;
+		for (auto&& op : operators)
+		{
+			if (intern(op.first) == name)
+			{
+				callee.is_arithmetic = true;
+				callee.op = op.second;
+			}
+		}
+	}
+	return callee;
+}
+
+// Joins state into what's known before pc, false when the stack depths disagree
+bool jit_compiler_t::merge(size_t pc, const jit_frame_state_t& state)
+{
+	auto&& existing = states[pc];
+	if (!existing.reached)
+	{
+		existing = state;
+		changed = true;
+		return true;
+	}
+	changed = false;
+	if (existing.stack.size() != state.stack.size())
+		return false;
+	auto join = [&](std::vector<jit_type>& into, const std::vector<jit_type>& from)
+	{
+		for (size_t i = 0; i < into.size(); ++i)
+		{
+			if (into[i] != from[i] && into[i] != jit_type::unknown)
+			{
+				into[i] = jit_type::unknown;
+				changed = true;
+			}
+		}
+	};
+	join(existing.locals, state.locals);
+	join(existing.stack, state.stack);
+	return true;
+}
+
+// Finds the types of the locals and the operand stack before every instruction.
+// Values are only known to be an int or a double where every path agrees.
+bool jit_compiler_t::analyze()
+{
+	states.resize(function.code.size());
+	jit_frame_state_t entry;
+	entry.reached = true;
+	entry.locals.resize(function.locals.size(), jit_type::unknown);
+	std::copy(parameter_types.begin(), parameter_types.end(), entry.locals.begin());
+	states[0] = entry;
+
+	std::vector<size_t> work{ 0 };
+	while (!work.empty())
+	{
+		auto pc = work.back();
+		work.pop_back();
+		auto state = states[pc];
+		auto&& ins = function.code[pc];
+		auto&& stack = state.stack;
+		max_depth = std::max(max_depth, stack.size());
+		auto valid = true;
+		auto pop = [&](size_t count)
+		{
+			valid = valid && stack.size() >= count;
+			stack.resize(valid ? stack.size() - count : 0);
+		};
+		auto next = pc + 1;
+		auto branch = function.code.size();
+
+		switch (ins.op)
+		{
+		case opcode::push_constant: stack.push_back(get_constant_type(function.constants[ins.operand])); break;
+		case opcode::load_local: stack.push_back(state.locals[ins.operand]); break;
+		case opcode::load_enclosing: stack.push_back(jit_type::unknown); break;
+		case opcode::load_global: stack.push_back(jit_type::unknown); break;
+		case opcode::store_local:
+		{
+			auto type = stack.empty() ? jit_type::unknown : stack.back();
+			pop(1);
+			state.locals[ins.operand] = type;
+			break;
+		}
+		case opcode::store_enclosing: pop(1); break;
+		case opcode::store_global: pop(1); break;
+		case opcode::pop: pop(1); break;
+		case opcode::jump: next = ins.operand; break;
+		case opcode::jump_if_false: pop(1); branch = ins.operand; break;
+		case opcode::jump_if_rebound: branch = ins.operand; break;
+		case opcode::make_lambda: stack.push_back(jit_type::unknown); break;
+		case opcode::print: pop(1); stack.push_back(jit_type::unknown); break;
+		case opcode::vars: stack.push_back(jit_type::unknown); break;
+		case opcode::parallel: pop(ins.depth); stack.push_back(jit_type::unknown); break;
+		case opcode::profile: pop(1 + ins.operand); stack.push_back(jit_type::unknown); break;
+		case opcode::profile_enter: break;
+		case opcode::profile_exit: break;
+
+		case opcode::call:
+		case opcode::call_global:
+		{
+			auto result = jit_type::unknown;
+			if (ins.op == opcode::call_global)
+			{
+				auto callee = get_callee(ins);
+				auto lhs = stack.size() >= 2 ? stack[stack.size() - 2] : jit_type::unknown;
+				auto rhs = stack.empty() ? jit_type::unknown : stack.back();
+				if (callee.is_arithmetic && is_comparison(callee.op))
+					result = jit_type::bool_;
+				// Ints are never divided natively
+				else if (callee.is_arithmetic && lhs == rhs
+					&& (lhs == jit_type::double_ || (lhs == jit_type::int_ && callee.op != arithmetic_op::divide)))
+					result = lhs;
+			}
+			pop(ins.operand + 1);
+			stack.push_back(result);
+			break;
+		}
+
+		case opcode::tail_call:
+		case opcode::tail_call_global:
+		case opcode::return_:
+			next = function.code.size();
+			break;
+		}
+
+		if (!valid)
+			return false;
+		for (auto successor : { next, branch })
+		{
+			if (successor >= function.code.size())
+				continue;
+			if (!merge(successor, state))
+				return false;
+			if (changed)
+				work.push_back(successor);
+		}
+	}
+	return true;
+}
+
+// Jumps when the value at [rbx + disp] isn't of type, returns the jump to patch
+size_t jit_compiler_t::jump_unless(jit_type type, std::int32_t disp)
+{
+	auto&& a = assembler;
+	a.load(rax, rbx, disp);
+	if (type == jit_type::double_)
+	{
+		a.move_immediate(rcx, boxed_prefix);
+		a.alu(alu_and, rax, rcx);
+		a.alu(alu_cmp, rax, rcx);
+		return a.jump(cc_e);
+	}
+	a.shift(shift_right, rax, 48);
+	a.compare_immediate(rax, type == jit_type::int_ ? int_tag : bool_tag);
+	return a.jump(cc_ne);
+}
+
+// Leaves the call at pc to the interpreter once the callee's global was rebound
+void jit_compiler_t::guard_version(const callee_t& callee, size_t pc)
+{
+	auto&& a = assembler;
+	a.move_immediate(rcx, reinterpret_cast<std::uintptr_t>(&callee.global->version));
+	a.load(rax, rcx, 0);
+	a.move_immediate(rcx, callee.version);
+	a.alu(alu_cmp, rax, rcx);
+	deopt(a.jump(cc_ne), pc);
+}
+
+// The two operands are on top of the stack and the result replaces the callee below them.
+// Both are checked for ints and then for doubles unless the analysis already
+// knows which they are, anything else goes back to the interpreter.
+void jit_compiler_t::emit_arithmetic(size_t pc, arithmetic_op op, const jit_frame_state_t& state)
+{
+	auto&& a = assembler;
+	auto depth = state.stack.size();
+	jit_type types[] = { state.stack[depth - 2], state.stack[depth - 1] };
+	std::int32_t operands[] = { slot(depth - 2), slot(depth - 1) };
+	auto result = slot(depth - 3);
+	auto could_be = [&](jit_type type)
+	{
+		return (types[0] == type || types[0] == jit_type::unknown) && (types[1] == type || types[1] == jit_type::unknown);
+	};
+
+	std::vector<size_t> done;
+	std::vector<size_t> not_int;
+	if (op != arithmetic_op::divide && could_be(jit_type::int_))
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			if (types[i] != jit_type::int_)
+				not_int.push_back(jump_unless(jit_type::int_, operands[i]));
+		}
+		emit_int_op(op, operands[0], operands[1], result, pc);
+		done.push_back(a.jump());
+	}
+	for (auto patch : not_int)
+		a.patch_here(patch);
+
+	if (could_be(jit_type::double_))
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			if (types[i] != jit_type::double_)
+				deopt(jump_unless(jit_type::double_, operands[i]), pc);
+		}
+		emit_double_op(op, operands[0], operands[1], result);
+	}
+	else
+	{
+		deopt(pc);
+	}
+	for (auto patch : done)
+		a.patch_here(patch);
+}
+
+// Shifting out the tag leaves the 48-bit int in the top of the register, where
+// the overflow flag tells whether the result still fits in a small int
+void jit_compiler_t::emit_int_op(arithmetic_op op, std::int32_t lhs, std::int32_t rhs, std::int32_t result, size_t pc)
+{
+	auto&& a = assembler;
+	a.load(rax, rbx, lhs);
+	a.shift(shift_left, rax, 16);
+	a.load(rcx, rbx, rhs);
+	a.shift(shift_left, rcx, 16);
+
+	if (is_comparison(op))
+	{
+		static const condition conditions[] = { cc_l, cc_g, cc_le, cc_ge };
+		a.alu(alu_cmp, rax, rcx);
+		a.set(conditions[static_cast<int>(op) - static_cast<int>(arithmetic_op::less)], rax);
+		a.move_immediate(rcx, false_bits);
+		a.alu(alu_or, rax, rcx);
+		a.store(rbx, result, rax);
+		return;
+	}
+
+	switch (op)
+	{
+	case arithmetic_op::add: a.alu(alu_add, rax, rcx); break;
+	case arithmetic_op::subtract: a.alu(alu_sub, rax, rcx); break;
+	default:
+		a.shift(shift_arithmetic_right, rcx, 16);
+		a.multiply(rax, rcx);
+		break;
+	}
+	// Let the interpreter box it
+	deopt(a.jump(cc_o), pc);
+	a.shift(shift_right, rax, 16);
+	a.move_immediate(rcx, int_bits);
+	a.alu(alu_or, rax, rcx);
+	a.store(rbx, result, rax);
+}
+
+void jit_compiler_t::emit_double_op(arithmetic_op op, std::int32_t lhs, std::int32_t rhs, std::int32_t result)
+{
+	auto&& a = assembler;
+	a.load(rax, rbx, lhs);
+	a.move_to_xmm(xmm0, rax);
+	a.load(rax, rbx, rhs);
+	a.move_to_xmm(xmm1, rax);
+
+	switch (op)
+	{
+	// Compared so that NaN makes every comparison false
+	case arithmetic_op::less: a.compare_doubles(xmm1, xmm0); a.set(cc_a, rax); break;
+	case arithmetic_op::greater: a.compare_doubles(xmm0, xmm1); a.set(cc_a, rax); break;
+	case arithmetic_op::less_equal: a.compare_doubles(xmm1, xmm0); a.set(cc_ae, rax); break;
+	case arithmetic_op::greater_equal: a.compare_doubles(xmm0, xmm1); a.set(cc_ae, rax); break;
+
+	default:
+	{
+		static const sse_op ops[] = { sse_add, sse_subtract, sse_multiply, sse_divide };
+		a.sse(ops[static_cast<int>(op)], xmm0, xmm1);
+		a.move_from_xmm(rax, xmm0);
+		// NaNs have to be the one value_t uses
+		a.compare_doubles(xmm0, xmm0);
+		auto ordered = a.jump(cc_np);
+		a.move_immediate(rax, nan_bits);
+		a.patch_here(ordered);
+		a.store(rbx, result, rax);
+		return;
+	}
+	}
+	a.move_immediate(rcx, false_bits);
+	a.alu(alu_or, rax, rcx);
+	a.store(rbx, result, rax);
+}
+
+void jit_compiler_t::emit_branch_if_false(size_t pc, jit_type type, std::int32_t disp, size_t target)
+{
+	auto&& a = assembler;
+	a.load(rax, rbx, disp);
+	switch (type)
+	{
+	case jit_type::bool_:
+		a.move_immediate(rcx, false_bits);
+		a.alu(alu_cmp, rax, rcx);
+		jump_to(cc_e, target);
+		return;
+
+	case jit_type::int_:
+		a.move_immediate(rcx, int_bits);
+		a.alu(alu_cmp, rax, rcx);
+		jump_to(cc_e, target);
+		return;
+
+	case jit_type::double_:
+		// Zero of either sign
+		a.shift(shift_left, rax, 1);
+		jump_to(cc_e, target);
+		return;
+
+	case jit_type::unknown:
+		break;
+	}
+
+	for (auto bits : { false_bits, nil_bits, int_bits })
+	{
+		a.move_immediate(rcx, bits);
+		a.alu(alu_cmp, rax, rcx);
+		jump_to(cc_e, target);
+	}
+	a.move(rcx, rax);
+	a.shift(shift_left, rcx, 1);
+	jump_to(cc_e, target);
+
+	std::vector<size_t> truthy;
+	a.move_immediate(rcx, boxed_prefix);
+	a.move(rdx, rax);
+	a.alu(alu_and, rdx, rcx);
+	a.alu(alu_cmp, rdx, rcx);
+	truthy.push_back(a.jump(cc_ne));
+	a.shift(shift_right, rax, 48);
+	a.compare_immediate(rax, bool_tag);
+	truthy.push_back(a.jump(cc_e));
+	a.compare_immediate(rax, int_tag);
+	truthy.push_back(a.jump(cc_e));
+	// Objects, let the interpreter decide
+	deopt(pc);
+	for (auto patch : truthy)
+		a.patch_here(patch);
+}
+
+// Calls go through the VM, which runs the callee's native code if it has any.
+// When the callee is left to the interpreter this code can't wait for it, so it
+// returns and the interpreter finishes this call once the callee returns.
+void jit_compiler_t::emit_call(size_t pc, size_t depth, size_t argument_count)
+{
+	auto&& a = assembler;
+	a.store(rsp, 0, rbx);
+	a.move(rdi, r12);
+	a.move(rsi, rsp);
+	a.move_immediate(rdx, top(depth));
+	a.move_immediate(rcx, argument_count);
+	a.move_immediate(r8, frame_size);
+	a.move_immediate(rax, reinterpret_cast<std::uintptr_t>(environment.call));
+	a.call(rax);
+	a.load(rbx, rsp, 0);
+	a.test32(rax, rax);
+	call_exits[pc].push_back(a.jump(cc_ne));
+}
+
+// Loops have to let the collector run like the interpreter's jumps do
+void jit_compiler_t::emit_safe_point(size_t depth)
+{
+	auto&& a = assembler;
+	a.move_immediate(rcx, reinterpret_cast<std::uintptr_t>(&environment.heap->allocated));
+	a.load(rax, rcx, 0);
+	a.move_immediate(rcx, reinterpret_cast<std::uintptr_t>(&environment.heap->get_threshold()));
+	a.compare_memory(rax, rcx, 0);
+	auto skip = a.jump(cc_b);
+	a.store(rsp, 0, rbx);
+	a.move(rdi, r12);
+	a.move(rsi, rsp);
+	a.move_immediate(rdx, top(depth));
+	a.move_immediate(rcx, frame_size);
+	a.move_immediate(rax, reinterpret_cast<std::uintptr_t>(environment.safe_point));
+	a.call(rax);
+	a.load(rbx, rsp, 0);
+	a.patch_here(skip);
+}
+
+// A call to the function itself in tail position becomes a loop. The arguments
+// are checked against the types the code was specialized to, like on entry.
+void jit_compiler_t::emit_self_tail_call(size_t pc, const callee_t& callee)
+{
+	auto&& a = assembler;
+	auto&& state = states[pc];
+	auto count = function.parameters.size();
+	auto first = state.stack.size() - count;
+	guard_version(callee, pc);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (parameter_types[i] != jit_type::unknown && state.stack[first + i] != parameter_types[i])
+			deopt(jump_unless(parameter_types[i], slot(first + i)), pc);
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		a.load(rax, rbx, slot(first + i));
+		a.store(rbx, local(i), rax);
+	}
+	a.move_immediate(rax, nil_bits);
+	for (auto i = count; i < function.locals.size(); ++i)
+		a.store(rbx, local(i), rax);
+	emit_safe_point(0);
+	a.patch(a.jump(), body);
+}
+
+void jit_compiler_t::emit_return(std::int32_t disp)
+{
+	auto&& a = assembler;
+	a.load(rax, rbx, disp);
+	a.store(rbx, 0, rax);
+	a.move_immediate(rax, 0);
+	returns.push_back(a.jump());
+}
+
+void jit_compiler_t::emit(size_t pc)
+{
+	auto&& a = assembler;
+	auto&& state = states[pc];
+	auto&& ins = function.code[pc];
+	auto depth = state.stack.size();
+
+	switch (ins.op)
+	{
+	case opcode::push_constant:
+		a.move_immediate(rax, get_bits(function.constants[ins.operand]));
+		a.store(rbx, slot(depth), rax);
+		break;
+
+	case opcode::load_local:
+		a.load(rax, rbx, local(ins.operand));
+		a.store(rbx, slot(depth), rax);
+		break;
+
+	case opcode::store_local:
+		a.load(rax, rbx, slot(depth - 1));
+		a.store(rbx, local(ins.operand), rax);
+		break;
+
+	case opcode::load_global:
+	case opcode::store_global:
+	{
+		// One that doesn't exist yet is left to the interpreter to create or report
+		auto global = find_global(ins.operand);
+		if (!global)
+		{
+			deopt(pc);
+			break;
+		}
+		a.move_immediate(rcx, reinterpret_cast<std::uintptr_t>(global));
+		if (ins.op == opcode::load_global)
+		{
+			a.load(rax, rcx, offsetof(global_t, value));
+			a.store(rbx, slot(depth), rax);
+			break;
+		}
+		// Parallel tasks aren't allowed to, let the interpreter report it
+		a.move_immediate(rax, reinterpret_cast<std::uintptr_t>(environment.running_parallel));
+		a.load_byte(rax, rax, 0);
+		a.test32(rax, rax);
+		deopt(a.jump(cc_ne), pc);
+		a.load(rax, rbx, slot(depth - 1));
+		a.store(rcx, offsetof(global_t, value), rax);
+		a.load(rax, rcx, offsetof(global_t, version));
+		a.add_immediate(rax, 1);
+		a.store(rcx, offsetof(global_t, version), rax);
+		break;
+	}
+
+	case opcode::pop:
+		break;
+
+	// Native code never runs while a profiler is set
+	case opcode::profile_enter:
+	case opcode::profile_exit:
+		break;
+
+	case opcode::jump:
+		if (static_cast<size_t>(ins.operand) <= pc)
+			emit_safe_point(depth);
+		jump_to(ins.operand);
+		break;
+
+	case opcode::jump_if_false:
+		emit_branch_if_false(pc, state.stack.back(), slot(depth - 1), ins.operand);
+		break;
+
+	case opcode::jump_if_rebound:
+	{
+		auto&& guard = function.guards[ins.depth];
+		auto global = find_global(guard.name);
+		if (!global)
+		{
+			deopt(pc);
+			break;
+		}
+		a.move_immediate(rcx, reinterpret_cast<std::uintptr_t>(&global->version));
+		a.load(rax, rcx, 0);
+		a.move_immediate(rcx, guard.version);
+		a.alu(alu_cmp, rax, rcx);
+		jump_to(cc_ne, ins.operand);
+		break;
+	}
+
+	case opcode::call:
+		emit_call(pc, depth, ins.operand);
+		break;
+
+	case opcode::call_global:
+	{
+		auto callee = get_callee(ins);
+		if (callee.is_arithmetic)
+		{
+			guard_version(callee, pc);
+			emit_arithmetic(pc, callee.op, state);
+		}
+		else
+		{
+			emit_call(pc, depth, ins.operand);
+		}
+		break;
+	}
+
+	case opcode::tail_call_global:
+	{
+		auto callee = get_callee(ins);
+		if (callee.is_self)
+		{
+			emit_self_tail_call(pc, callee);
+			break;
+		}
+		// Any other lambda has to replace this frame, which only the interpreter does
+		if (!callee.is_builtin)
+		{
+			deopt(pc);
+			break;
+		}
+		guard_version(callee, pc);
+		if (callee.is_arithmetic)
+			emit_arithmetic(pc, callee.op, state);
+		else
+			emit_call(pc, depth, ins.operand);
+		emit_return(slot(depth - ins.operand - 1));
+		break;
+	}
+
+	case opcode::return_:
+		emit_return(slot(depth - 1));
+		break;
+
+	// Closures, environment frames, printing, calls that replace this frame,
+	// parallel forms and profiling are left to the interpreter
+	case opcode::load_enclosing:
+	case opcode::store_enclosing:
+	case opcode::make_lambda:
+	case opcode::tail_call:
+	case opcode::print:
+	case opcode::vars:
+	case opcode::parallel:
+	case opcode::profile:
+		deopt(pc);
+		break;
+	}
+}
+
+std::shared_ptr<jit_code_t> jit_compiler_t::compile()
+{
+	if (function.code.empty() || !analyze())
+		return nullptr;
+	frame_size = top(max_depth);
+
+	// rbx holds the frame and r12 the VM, [rsp] is where calls leave the frame
+	// pointer for the helpers to update. Three pushes keep rsp 16-byte aligned.
+	auto&& a = assembler;
+	a.push(rbx);
+	a.push(r12);
+	a.subtract_immediate(rsp, 8);
+	a.move(rbx, rsi);
+	a.move(r12, rdi);
+	body = a.position();
+
+	labels.resize(function.code.size());
+	for (size_t pc = 0; pc < function.code.size(); ++pc)
+	{
+		if (!states[pc].reached)
+			continue;
+		labels[pc] = a.position();
+		emit(pc);
+	}
+	for (auto&& jump : jumps)
+		a.patch(jump.first, labels[jump.second]);
+
+	auto epilogue = a.position();
+	for (auto patch : returns)
+		a.patch(patch, epilogue);
+	a.add_immediate(rsp, 8);
+	a.pop(r12);
+	a.pop(rbx);
+	a.ret();
+
+	for (auto&& exit : exits)
+	{
+		for (auto patch : exit.second)
+			a.patch_here(patch);
+		a.move_immediate(rax, exit.first);
+		a.patch(a.jump(), epilogue);
+	}
+	for (auto&& exit : call_exits)
+	{
+		for (auto patch : exit.second)
+			a.patch_here(patch);
+		// An exception is passed on as it is
+		a.compare_immediate(rax, jit_exit_call);
+		a.patch(a.jump(cc_ne), epilogue);
+		a.move_immediate(rax, (exit.first + 1) << 2 | jit_exit_call);
+		a.patch(a.jump(), epilogue);
+	}
+
+	auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	auto size = (a.code.size() + page_size - 1) / page_size * page_size;
+	auto memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+		return nullptr;
+	std::memcpy(memory, a.code.data(), a.code.size());
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, size);
+		return nullptr;
+	}
+
+	auto code = std::make_shared<jit_code_t>();
+	code->memory = memory;
+	code->memory_size = size;
+	code->entry = reinterpret_cast<jit_entry_t>(memory);
+	code->parameter_types = parameter_types;
+	code->frame_size = frame_size;
+	code->depths.reserve(states.size());
+	for (auto&& state : states)
+		code->depths.push_back(static_cast<std::uint32_t>(state.stack.size()));
+	return code;
+}
+
+std::shared_ptr<jit_code_t> jit_compile(const function_t& function,
+	const std::vector<jit_type>& parameter_types, const jit_environment_t& environment)
+{
+	return jit_compiler_t{ function, parameter_types, environment }.compile();
+}
+
+#endif
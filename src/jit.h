@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Native x86-64 code for hot lambdas. A lambda without an environment frame is
+// compiled after enough calls, specialized to the argument types seen so far.
+//
+// The native code works on the VM's own stack with the same layout the
+// interpreter uses, so it can hand a call back to the interpreter at any
+// instruction: when a type guard fails, an int leaves the small int range or it
+// reaches something it doesn't compile, it returns the pc to continue at and
+// the interpreter picks the frame up from there.
+#if defined(__x86_64__) && defined(__linux__)
+#define CATLANG_JIT_SUPPORTED 1
+#else
+#define CATLANG_JIT_SUPPORTED 0
+#endif
+
+struct function_t;
+struct value_t;
+struct vm_t;
+struct heap_t;
+
+enum class jit_type : std::uint8_t
+{
+	unknown,
+	int_,
+	double_,
+	bool_,
+};
+
+// What native code returns: 0 once the result is in the frame's callee slot,
+// otherwise (pc << 2) | a jit_exit
+enum jit_exit : std::uint64_t
+{
+	// Continue interpreting at pc, the stack holds what it would at that point
+	jit_exit_deopt = 1,
+	// A call left a frame for the interpreter. Continue at pc once it returns,
+	// the stack above this frame belongs to that call.
+	jit_exit_call = 2,
+	// An exception is waiting in the VM to be rethrown
+	jit_exit_exception = 3,
+};
+
+// frame points at the callee slot of the frame, locals follow it
+using jit_entry_t = std::uint64_t (*)(vm_t* vm, value_t* frame);
+// Called by native code for calls it doesn't inline. frame points at the
+// caller's frame pointer, which is updated since the stack can move. top is the
+// stack size above the frame including the callee and its arguments,
+// frame_size what the native code needs. Returns 0 or a jit_exit.
+using jit_call_helper_t = std::uint64_t (*)(vm_t* vm, value_t** frame, std::size_t top,
+	std::size_t argument_count, std::size_t frame_size);
+// Collects garbage at a loop's back edge, everything below top is live
+using jit_safe_point_helper_t = void (*)(vm_t* vm, value_t** frame, std::size_t top, std::size_t frame_size);
+
+struct jit_code_t
+{
+	jit_code_t() = default;
+	jit_code_t(const jit_code_t&) = delete;
+	jit_code_t& operator =(const jit_code_t&) = delete;
+	~jit_code_t();
+
+	jit_entry_t entry = nullptr;
+	// Types the arguments were specialized to, checked before entering
+	std::vector<jit_type> parameter_types;
+	// Operand stack depth before each instruction, to size the stack when deoptimizing
+	std::vector<std::uint32_t> depths;
+	// Stack slots the native code uses above the frame's callee slot
+	std::size_t frame_size = 0;
+
+	void* memory = nullptr;
+	std::size_t memory_size = 0;
+};
+
+// What the VM learns about a function while running it
+struct jit_state_t
+{
+	std::uint32_t calls = 0;
+	// Calls where the arguments didn't match what the code was specialized to
+	std::uint32_t guard_failures = 0;
+	std::uint32_t compilations = 0;
+	// Bits of jit_profile_bits seen for each parameter
+	std::vector<std::uint8_t> argument_types;
+	std::shared_ptr<jit_code_t> code;
+	// Code that was replaced, native frames further up may still be running it
+	std::vector<std::shared_ptr<jit_code_t>> retired;
+};
+
+enum jit_profile_bits : std::uint8_t
+{
+	jit_profile_int = 1,
+	jit_profile_double = 2,
+	jit_profile_other = 4,
+};
+
+struct jit_environment_t
+{
+	vm_t* vm;
+	heap_t* heap;
+	// While it's set globals are only assigned by the interpreter
+	const bool* running_parallel;
+	jit_call_helper_t call;
+	jit_safe_point_helper_t safe_point;
+};
+
+// Null when the function can't be compiled or the platform has no JIT
+std::shared_ptr<jit_code_t> jit_compile(const function_t& function,
+	const std::vector<jit_type>& parameter_types, const jit_environment_t& environment);
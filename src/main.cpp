@@ -7,24 +7,58 @@
 #include <memory>
 #include "basic_types.h"
 #include "interpreter.h"
+#include "module.h"
+#include "profiler.h"
+#include "heap_profiler.h"
+#include "reader.h"
+#include "stats.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#if CATLANG_POSIX
+#include <unistd.h>
+#endif
 
-static auto interpret_lines(interpreter_t& interpreter, std::istream& stream)
+// Set by --profile, reported when the program ends however it ends
+static std::unique_ptr<profiler_t> profiler;
+static std::string profile_path = default_profile_path;
+// Set by --heap-profile
+static std::unique_ptr<heap_profiler_t> heap_profile;
+
+// Reports the profile of --profile, what's live with --heap-profile and, when
+// CATLANG_DUMP_STATS is set, the counters of stats.h
+static void report_at_exit()
 {
-	std::string line;
-	while (std::getline(stream, line))
-		interpreter.interpret_line(line);
+	if (profiler)
+	{
+		profiler->stop();
+		try
+		{
+			profiler->report(profile_path);
+		}
+		catch (std::runtime_error& e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
+	}
+	if (heap_profile)
+	{
+		heap_profile->write_report(std::cerr, default_heap_report_rows);
+		// Whatever is freed from here on may outlive it
+		heap_profiler = nullptr;
+	}
+	auto dump = std::getenv("CATLANG_DUMP_STATS");
+	if (dump && std::strcmp(dump, "0") != 0)
+		write_stats(std::cerr);
 }
 
 static auto interpret_file(interpreter_t& interpreter, const char* filename)
 {
-	std::ifstream file{ filename };
-	if (file.fail())
-	{
-		std::cout << "Failed to open file " << filename << "!\n";
-		std::cin.get();
-		return -1;
-	}
-	interpret_lines(interpreter, file);
+	form_reader_t reader{ filename };
+	// Imports are relative to the script
+	interpreter.directory = get_directory(filename);
+	interpreter.interpret(reader);
+	report_at_exit();
 	std::cin.get();
 	return 0;
 }
@@ -32,18 +66,53 @@ static auto interpret_file(interpreter_t& interpreter, const char* filename)
 int main(int argc, char** argv)
 try
 {
+#if CATLANG_POSIX
+	// Written out when the buffer fills, at exit and on (flush), a terminal still gets each line
+	static char output_buffer[1 << 16];
+	if (!isatty(STDOUT_FILENO))
+		std::setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+#endif
 	interpreter_t interpreter;
+	const char* filename = nullptr;
+
+	for (auto i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "--dump-optimized")
+			interpreter.dump_optimized = true;
+		else if (arg == "--no-optimize")
+			interpreter.optimize = false;
+		// --profile[=path], see profiler.h
+		else if (arg == "--profile" || arg.compare(0, 10, "--profile=") == 0)
+		{
+			if (arg.size() > 10)
+				profile_path = arg.substr(10);
+			profiler.reset(new profiler_t{ intern("main") });
+			interpreter.vm.profiler = profiler.get();
+		}
+		// See heap_profiler.h
+		else if (arg == "--heap-profile")
+		{
+			heap_profile.reset(new heap_profiler_t);
+			heap_profiler = heap_profile.get();
+		}
+		else
+			filename = argv[i];
+	}
 
-	if (argc > 1)
-		return interpret_file(interpreter, argv[1]);
+	if (filename)
+		return interpret_file(interpreter, filename);
 
 	// REPL mode
-	interpret_lines(interpreter, std::cin);
+	form_reader_t reader;
+	interpreter.interpret(reader);
+	report_at_exit();
 	return 0;
 }
 catch (std::runtime_error& e)
 {
 	std::cout << "e.what() = " << e.what() << std::endl;
+	report_at_exit();
 	std::cin.get();
 	return -1;
 }
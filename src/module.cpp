@@ -0,0 +1,393 @@
+#include "module.h"
+#include "parser.h"
+#include "reader.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+#if CATLANG_POSIX
+#include <climits>
+#include <cstdlib>
+#include <unistd.h>
+#endif
+
+// Cache layout, the header and doubles in host byte order, every other number
+// a LEB128 varint, ints zigzag encoded first:
+//   header
+//   name count, then the length and the bytes of each name
+//   string count, then the same for each string literal
+//   form count, then the line each form starts on and the form
+// A node is a node_tag byte followed by its payload: the int, the 8 bytes of a
+// double, the index of a symbol or string, or the count of a list followed by
+// that many nodes.
+static const char cache_magic[4] = { 'C', 'A', 'T', 'C' };
+// Bump whenever the layout changes
+static const std::uint32_t cache_version = 2;
+
+struct cache_header_t
+{
+	char magic[4];
+	std::uint32_t version;
+	std::uint64_t source_hash;
+	// Of the whole file, a cache cut short by a crash doesn't match
+	std::uint64_t size;
+	// Of everything after the header
+	std::uint64_t payload_hash;
+};
+
+enum class node_tag : std::uint8_t
+{
+	nil,
+	false_,
+	true_,
+	int_,
+	double_,
+	string,
+	symbol,
+	list,
+	quoted_list,
+};
+
+// FNV-1a over 8 bytes at a time, it only has to notice edits and corruption
+static std::uint64_t hash_bytes(const char* data, size_t size)
+{
+	std::uint64_t hash = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+	return hash ^ size;
+}
+
+std::string get_directory(const std::string& path)
+{
+	auto slash = path.find_last_of("/\\");
+	if (slash == std::string::npos)
+		return ".";
+	return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+std::string resolve_module_path(const std::string& directory, const std::string& path)
+{
+	auto absolute = !path.empty() && (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'));
+	auto resolved = absolute || directory.empty() ? path : directory + "/" + path;
+#if CATLANG_POSIX
+	char buffer[PATH_MAX];
+	if (realpath(resolved.c_str(), buffer))
+		resolved = buffer;
+#endif
+	return resolved;
+}
+
+// Reads a cache back into a tree. Everything is bounds checked, a reader that
+// runs out of data or finds something unexpected just stops being ok.
+struct cache_reader_t
+{
+	cache_reader_t(const char* data, size_t size)
+		: pos(data), end(data + size) {}
+
+	template <typename T>
+	T read()
+	{
+		T value{};
+		if (static_cast<size_t>(end - pos) < sizeof(T))
+			ok = false;
+		else
+		{
+			std::memcpy(&value, pos, sizeof(T));
+			pos += sizeof(T);
+		}
+		return value;
+	}
+
+	std::uint64_t read_varint()
+	{
+		std::uint64_t value = 0;
+		for (unsigned shift = 0; shift < 64; shift += 7)
+		{
+			auto byte = read<std::uint8_t>();
+			value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return value;
+		}
+		ok = false;
+		return 0;
+	}
+
+	// Counts and indices, bounded by the remaining size so they can't overflow what they're compared to
+	size_t read_size()
+	{
+		auto value = read_varint();
+		if (value > static_cast<size_t>(end - pos))
+		{
+			ok = false;
+			return 0;
+		}
+		return static_cast<size_t>(value);
+	}
+
+	string_ref read_string()
+	{
+		auto size = read_size();
+		string_ref str{ pos, size };
+		pos += size;
+		return str;
+	}
+
+	object read_node(size_t depth)
+	{
+		// Deeper than any tree the parser builds, keeps a corrupt file from exhausting the stack
+		if (depth > 10000)
+			ok = false;
+		if (!ok)
+			return nil_t{};
+
+		auto tag = static_cast<node_tag>(read<std::uint8_t>());
+		switch (tag)
+		{
+		case node_tag::nil: return nil_t{};
+		case node_tag::false_: return false;
+		case node_tag::true_: return true;
+		case node_tag::int_:
+		{
+			auto zigzag = read_varint();
+			return static_cast<std::int64_t>((zigzag >> 1) ^ (0 - (zigzag & 1)));
+		}
+		case node_tag::double_: return read<double>();
+		case node_tag::string:
+		{
+			auto index = read_varint();
+			if (index >= strings.size())
+				break;
+			return strings[index].to_string();
+		}
+		case node_tag::symbol:
+		{
+			auto index = read_varint();
+			if (index >= symbols.size())
+				break;
+			auto symbol = symbols[index];
+			if (symbol < statement_count)
+				return statement{ symbol };
+			return variable_reference{ symbol };
+		}
+		case node_tag::list:
+		case node_tag::quoted_list:
+		{
+			// Every node takes at least a byte, so read_size catches a count that's corrupt
+			auto count = read_size();
+			list_t list;
+			list.reserve(count);
+			for (size_t i = 0; i < count && ok; ++i)
+				list.push_back(read_node(depth + 1));
+			list.quoted = tag == node_tag::quoted_list;
+			return list;
+		}
+		}
+		ok = false;
+		return nil_t{};
+	}
+
+	bool read_forms(list_t& forms, std::vector<size_t>& lines)
+	{
+		auto name_count = read_size();
+		for (size_t i = 0; i < name_count && ok; ++i)
+		{
+			auto name = read_string();
+			symbols.push_back(intern(name.data, name.size));
+		}
+		auto string_count = read_size();
+		for (size_t i = 0; i < string_count && ok; ++i)
+			strings.push_back(read_string());
+
+		auto form_count = read_size();
+		forms.reserve(form_count);
+		for (size_t i = 0; i < form_count && ok; ++i)
+		{
+			lines.push_back(static_cast<size_t>(read_varint()));
+			forms.push_back(read_node(0));
+		}
+		return ok && pos == end;
+	}
+
+	const char* pos;
+	const char* end;
+	bool ok = true;
+	std::vector<symbol_t> symbols;
+	// Point into the file
+	std::vector<string_ref> strings;
+};
+
+static bool read_cache(const std::string& path, std::uint64_t source_hash, list_t& forms, std::vector<size_t>& lines)
+{
+	mapped_file_t file{ path };
+	cache_header_t header;
+	if (!file.data || file.size < sizeof(header))
+		return false;
+	std::memcpy(&header, file.data, sizeof(header));
+	if (std::memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0 || header.version != cache_version
+		|| header.source_hash != source_hash || header.size != file.size
+		|| header.payload_hash != hash_bytes(file.data + sizeof(header), file.size - sizeof(header)))
+		return false;
+
+	cache_reader_t reader{ file.data + sizeof(header), file.size - sizeof(header) };
+	return reader.read_forms(forms, lines);
+}
+
+static void write_varint(std::string& out, std::uint64_t value)
+{
+	for (; value >= 0x80; value >>= 7)
+		out.push_back(static_cast<char>(value | 0x80));
+	out.push_back(static_cast<char>(value));
+}
+
+struct cache_writer_t
+{
+	void write_tag(node_tag tag)
+	{
+		nodes.push_back(static_cast<char>(tag));
+	}
+
+	// Index of str in table, adding it the first time
+	template <typename K>
+	std::uint32_t add(std::unordered_map<K, std::uint32_t>& indices, std::vector<std::string>& table,
+		const K& key, const std::string& str)
+	{
+		auto inserted = indices.emplace(key, static_cast<std::uint32_t>(table.size()));
+		if (inserted.second)
+			table.push_back(str);
+		return inserted.first->second;
+	}
+
+	void write_node(const object& obj)
+	{
+		if (obj.is_type<nil_t>())
+			write_tag(node_tag::nil);
+		else if (obj.is_type<bool>())
+			write_tag(obj.get_ref<bool>() ? node_tag::true_ : node_tag::false_);
+		else if (obj.is_type<int64_t>())
+		{
+			auto value = static_cast<std::uint64_t>(obj.get_ref<int64_t>());
+			write_tag(node_tag::int_);
+			write_varint(nodes, (value << 1) ^ (0 - (value >> 63)));
+		}
+		else if (obj.is_type<double>())
+		{
+			auto value = obj.get_ref<double>();
+			write_tag(node_tag::double_);
+			nodes.append(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+		else if (obj.is_type<std::string>())
+		{
+			auto&& str = obj.get_ref<std::string>();
+			write_tag(node_tag::string);
+			write_varint(nodes, add(string_indices, strings, str, str));
+		}
+		else if (obj.is_type<statement>() || obj.is_type<variable_reference>())
+		{
+			auto symbol = obj.is_type<statement>() ? obj.get_ref<statement>().symbol : obj.get_ref<variable_reference>().symbol;
+			write_tag(node_tag::symbol);
+			write_varint(nodes, add(name_indices, names, symbol, get_symbol_name(symbol)));
+		}
+		else
+		{
+			auto&& list = obj.get_ref<list_t>();
+			write_tag(list.quoted ? node_tag::quoted_list : node_tag::list);
+			write_varint(nodes, list.size());
+			for (auto&& item : list)
+				write_node(item);
+		}
+	}
+
+	static void write_table(std::string& out, const std::vector<std::string>& table)
+	{
+		write_varint(out, table.size());
+		for (auto&& str : table)
+		{
+			write_varint(out, str.size());
+			out.append(str);
+		}
+	}
+
+	std::string finish(std::uint64_t source_hash, const list_t& forms, const std::vector<size_t>& lines)
+	{
+		write_varint(nodes, forms.size());
+		for (size_t i = 0; i < forms.size(); ++i)
+		{
+			write_varint(nodes, lines[i]);
+			write_node(forms[i]);
+		}
+
+		std::string out(sizeof(cache_header_t), '\0');
+		write_table(out, names);
+		write_table(out, strings);
+		out.append(nodes);
+
+		cache_header_t header;
+		std::memcpy(header.magic, cache_magic, sizeof(cache_magic));
+		header.version = cache_version;
+		header.source_hash = source_hash;
+		header.size = out.size();
+		header.payload_hash = hash_bytes(out.data() + sizeof(header), out.size() - sizeof(header));
+		std::memcpy(&out[0], &header, sizeof(header));
+		return out;
+	}
+
+	std::string nodes;
+	std::vector<std::string> names;
+	std::vector<std::string> strings;
+	std::unordered_map<symbol_t, std::uint32_t> name_indices;
+	std::unordered_map<std::string, std::uint32_t> string_indices;
+};
+
+static void write_cache(const std::string& path, std::uint64_t source_hash, const list_t& forms, const std::vector<size_t>& lines)
+{
+	auto contents = cache_writer_t{}.finish(source_hash, forms, lines);
+	// Written aside and renamed over the old one, so a reader never sees half a file
+	auto temporary = path + ".tmp";
+#if CATLANG_POSIX
+	temporary += std::to_string(getpid());
+#endif
+	{
+		std::ofstream file{ temporary, std::ios::binary | std::ios::trunc };
+		if (!file.write(contents.data(), contents.size()))
+		{
+			file.close();
+			std::remove(temporary.c_str());
+			return;
+		}
+	}
+	if (std::rename(temporary.c_str(), path.c_str()) != 0)
+		std::remove(temporary.c_str());
+}
+
+list_t load_module(const std::string& path, std::vector<size_t>& lines)
+{
+	mapped_file_t source{ path };
+	if (!source.data)
+		throw std::runtime_error{ "Can't open module " + path };
+	auto source_hash = hash_bytes(source.data, source.size);
+	auto cache_path = path + ".catc";
+
+	list_t forms;
+	if (read_cache(cache_path, source_hash, forms, lines))
+		return forms;
+
+	lines.clear();
+	try
+	{
+		forms = parse({ source.data, source.size }, &lines);
+	}
+	catch (syntax_error& e)
+	{
+		throw std::runtime_error{ path + ": " + e.what() };
+	}
+	write_cache(cache_path, source_hash, forms, lines);
+	return forms;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "basic_types.h"
+
+// Source files loaded by (import "path").
+//
+// Parsing a module leaves a binary copy of its syntax tree next to it, at the
+// source path with .catc appended, stamped with a hash of the source. While the
+// source hashes the same the tree is read back from that file instead, which
+// is mapped into memory and read in a single pass without tokenizing anything.
+// A cache that is stale, corrupt or can't be written is silently replaced or
+// skipped.
+
+// path relative to directory unless it's absolute, with symlinks and .. resolved
+// when the file exists, so a module imported under two names is seen as one
+std::string resolve_module_path(const std::string& directory, const std::string& path);
+
+// Directory part of path, "." when it has none
+std::string get_directory(const std::string& path);
+
+// Top-level forms of the module at path, lists come from the current arena.
+// The line each form starts on goes in lines.
+list_t load_module(const std::string& path, std::vector<size_t>& lines);
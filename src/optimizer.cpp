@@ -0,0 +1,671 @@
+#include "optimizer.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include "value.h"
+
+static constexpr symbol_t no_symbol = static_cast<symbol_t>(-1);
+
+struct inline_function_t
+{
+	symbol_t name;
+	std::vector<symbol_t> parameters;
+	object body;
+};
+
+struct optimizer_t::scope_t
+{
+	explicit scope_t(scope_t* parent)
+		: parent(parent) {}
+
+	scope_t* parent;
+	// Parameters and everything def binds in the body outside nested lambdas
+	std::vector<symbol_t> bound;
+	// Names set anywhere in the body, nested lambdas included
+	std::vector<symbol_t> assigned;
+	// Local functions defined so far that calls can be replaced with
+	std::vector<inline_function_t> functions;
+};
+
+static bool contains(const std::vector<symbol_t>& names, symbol_t name)
+{
+	return std::find(names.begin(), names.end(), name) != names.end();
+}
+
+static symbol_t get_symbol(const object& obj)
+{
+	return obj.is_type<variable_reference>() ? obj.get_ref<variable_reference>().symbol : no_symbol;
+}
+
+static bool is_form(const list_t& list, symbol_t statement_symbol)
+{
+	return !list.quoted && !list.empty() && list[0].is_type<statement>()
+		&& list[0].get_ref<statement>().symbol == statement_symbol;
+}
+
+static bool is_form(const object& obj, symbol_t statement_symbol)
+{
+	return obj.is_type<list_t>() && is_form(obj.get_ref<list_t>(), statement_symbol);
+}
+
+static bool is_quoted(const object& obj)
+{
+	return obj.is_type<list_t>() && obj.get_ref<list_t>().quoted;
+}
+
+static bool is_literal(const object& obj)
+{
+	return obj.is_type<nil_t>() || obj.is_type<bool>() || obj.is_type<int64_t>()
+		|| obj.is_type<double>() || obj.is_type<std::string>() || is_quoted(obj);
+}
+
+static bool is_number(const object& obj)
+{
+	return obj.is_type<int64_t>() || obj.is_type<double>();
+}
+
+// A number, or one a call was folded to
+static const object* get_folded_number(const object& obj)
+{
+	if (is_number(obj))
+		return &obj;
+	if (is_form(obj, symbol_guard) && obj.get_ref<list_t>().size() == 4 && is_number(obj.get_ref<list_t>()[2]))
+		return &obj.get_ref<list_t>()[2];
+	return nullptr;
+}
+
+// Same rules as the VM's is_truthy, false when it can't tell without running the code
+static bool get_literal_truth(const object& obj, bool& truth)
+{
+	if (obj.is_type<nil_t>())
+		truth = false;
+	else if (obj.is_type<bool>())
+		truth = obj.get_ref<bool>();
+	else if (obj.is_type<int64_t>())
+		truth = obj.get_ref<int64_t>() != 0;
+	else if (obj.is_type<double>())
+		truth = obj.get_ref<double>() != 0;
+	else if (is_quoted(obj))
+		truth = true;
+	else
+		return false;
+	return true;
+}
+
+// The name a def binds, no_symbol if it's malformed
+static symbol_t get_def_name(const list_t& def)
+{
+	if (def.size() < 3)
+		return no_symbol;
+	if (def[1].is_type<list_t>())
+	{
+		auto&& signature = def[1].get_ref<list_t>();
+		return signature.empty() ? no_symbol : get_symbol(signature[0]);
+	}
+	return get_symbol(def[1]);
+}
+
+// Calls fn on every unquoted list in obj. Nested lambdas are skipped unless
+// enter_lambdas is set.
+template <typename fn_t>
+static void walk_lists(const object& obj, bool enter_lambdas, fn_t&& fn)
+{
+	if (!obj.is_type<list_t>() || is_quoted(obj))
+		return;
+	auto&& list = obj.get_ref<list_t>();
+	fn(list);
+
+	auto start = 0u;
+	if (is_form(obj, symbol_lambda) || (is_form(obj, symbol_def) && list.size() >= 3 && list[1].is_type<list_t>()))
+	{
+		if (!enter_lambdas)
+			return;
+		start = 2;
+	}
+	for (auto i = start; i < list.size(); ++i)
+		walk_lists(list[i], enter_lambdas, fn);
+}
+
+// Names def binds at this level
+static void collect_defs(const object& obj, std::vector<symbol_t>& names)
+{
+	walk_lists(obj, false, [&](const list_t& list) {
+		if (is_form(list, symbol_def) && get_def_name(list) != no_symbol)
+			names.push_back(get_def_name(list));
+	});
+}
+
+static void collect_sets(const object& obj, std::vector<symbol_t>& names)
+{
+	walk_lists(obj, true, [&](const list_t& list) {
+		if (is_form(list, symbol_set) && list.size() == 3 && get_symbol(list[1]) != no_symbol)
+			names.push_back(get_symbol(list[1]));
+	});
+}
+
+// Whether pruning obj would take a local's def with it
+static bool contains_def(const object& obj)
+{
+	std::vector<symbol_t> names;
+	collect_defs(obj, names);
+	return !names.empty();
+}
+
+static bool contains_vars(const object& obj)
+{
+	auto found = false;
+	walk_lists(obj, false, [&](const list_t& list) { found = found || is_form(list, symbol_vars); });
+	return found;
+}
+
+static size_t count_references(const object& obj, symbol_t name)
+{
+	if (get_symbol(obj) == name)
+		return 1;
+	size_t count = 0;
+	if (obj.is_type<list_t>() && !is_quoted(obj))
+	{
+		for (auto&& item : obj.get_ref<list_t>())
+			count += count_references(item, name);
+	}
+	return count;
+}
+
+static void substitute_arguments(object& obj, const std::vector<symbol_t>& parameters, const list_t& arguments)
+{
+	auto symbol = get_symbol(obj);
+	if (symbol != no_symbol)
+	{
+		auto it = std::find(parameters.begin(), parameters.end(), symbol);
+		if (it != parameters.end())
+			obj = arguments[1 + (it - parameters.begin())];
+		return;
+	}
+	if (obj.is_type<list_t>() && !is_quoted(obj))
+	{
+		for (auto&& item : obj.get_ref<list_t>())
+			substitute_arguments(item, parameters, arguments);
+	}
+}
+
+template <typename scope_t>
+static bool is_bound(symbol_t name, const scope_t* scope)
+{
+	for (; scope; scope = scope->parent)
+	{
+		if (contains(scope->bound, name))
+			return true;
+	}
+	return false;
+}
+
+template <typename scope_t>
+static const inline_function_t* find_inline_function(symbol_t name, const scope_t* scope)
+{
+	for (; scope; scope = scope->parent)
+	{
+		if (!contains(scope->bound, name))
+			continue;
+		for (auto&& function : scope->functions)
+		{
+			if (function.name == name)
+				return &function;
+		}
+		return nullptr;
+	}
+	return nullptr;
+}
+
+// Folds with the same operators the VM uses, nothing is folded if they'd throw
+static bool fold(const std::string& op, const object& lhs_obj, const object& rhs_obj, object& result)
+{
+	auto to_number = [](const object& obj) {
+		return obj.is_type<int64_t>() ? value_t{ obj.get_ref<int64_t>() } : value_t{ obj.get_ref<double>() };
+	};
+	auto lhs = to_number(lhs_obj);
+	auto rhs = to_number(rhs_obj);
+
+	value_t value;
+	try
+	{
+		if (op == "+") value = lhs + rhs;
+		else if (op == "-") value = lhs - rhs;
+		else if (op == "*") value = lhs * rhs;
+		else if (op == "/") value = lhs / rhs;
+		else if (op == "<") value = lhs < rhs;
+		else if (op == ">") value = lhs > rhs;
+		else if (op == "<=") value = lhs <= rhs;
+		else if (op == ">=") value = lhs >= rhs;
+		else return false;
+	}
+	catch (std::runtime_error&)
+	{
+		return false;
+	}
+
+	if (value.is_int())
+		result = object{ value.get_int() };
+	else if (value.is_double())
+		result = object{ value.get_double() };
+	else if (value.is_bool())
+		result = object{ value.get_bool() };
+	else
+		return false;
+	return true;
+}
+
+void optimizer_t::optimize(object& form)
+{
+	optimize(form, nullptr);
+}
+
+// Like get_literal_truth, but also knows true, false and nil
+bool optimizer_t::get_truth(const object& obj, const scope_t* scope, bool& truth) const
+{
+	if (get_literal_truth(obj, truth))
+		return true;
+
+	auto name = get_symbol(obj);
+	if (name == no_symbol || is_bound(name, scope) || !is_constant_global(name))
+		return false;
+	auto it = globals.find(name);
+	if (it == globals.end())
+		return false;
+	if (it->second.value.is_bool())
+		truth = it->second.value.get_bool();
+	else if (it->second.value.is_nil())
+		truth = false;
+	else
+		return false;
+	return true;
+}
+
+// The builtin obj names if it's a foldable operator, no_symbol otherwise
+symbol_t optimizer_t::get_operator(const object& obj, const scope_t* scope) const
+{
+	auto name = get_symbol(obj);
+	if (name == no_symbol || is_bound(name, scope))
+		return no_symbol;
+
+	auto it = globals.find(name);
+	if (it == globals.end() || !it->second.value.is_object(value_type::builtin))
+		return no_symbol;
+	auto builtin = it->second.value.get_object<builtin_object>().name;
+	static const char* const operators[] = { "+", "-", "*", "/", "<", ">", "<=", ">=" };
+	for (auto op : operators)
+	{
+		if (get_symbol_name(builtin) == op)
+			return builtin;
+	}
+	return no_symbol;
+}
+
+void optimizer_t::optimize(object& obj, scope_t* scope)
+{
+	if (!obj.is_type<list_t>())
+		return;
+	auto&& list = obj.get_ref<list_t>();
+	if (list.quoted || list.empty())
+		return;
+
+	if (!list[0].is_type<statement>())
+		return optimize_call(obj, scope);
+
+	switch (list[0].get_ref<statement>().symbol)
+	{
+	case symbol_lambda:
+		if (list.size() >= 2 && list[1].is_type<list_t>())
+			return optimize_lambda(list, 0, scope);
+		break;
+	case symbol_def:
+		if (list.size() >= 3 && list[1].is_type<list_t>())
+			return optimize_lambda(list, 1, scope);
+		break;
+	case symbol_if:
+		return optimize_if(obj, scope);
+	case symbol_cond:
+		return optimize_cond(obj, scope);
+	case symbol_while:
+		return optimize_while(obj, scope);
+	// Already optimized
+	case symbol_guard:
+		return;
+	}
+
+	// def, set, print, vars and the parallel forms only have names and expressions after the statement
+	for (auto i = 1u; i < list.size(); ++i)
+		optimize(list[i], scope);
+}
+
+void optimizer_t::optimize_lambda(list_t& list, size_t first_parameter, scope_t* scope)
+{
+	scope_t inner{ scope };
+	auto&& parameters = list[1].get_ref<list_t>();
+	for (auto i = first_parameter; i < parameters.size(); ++i)
+	{
+		if (get_symbol(parameters[i]) != no_symbol)
+			inner.bound.push_back(get_symbol(parameters[i]));
+	}
+	for (auto i = 2u; i < list.size(); ++i)
+	{
+		collect_defs(list[i], inner.bound);
+		collect_sets(list[i], inner.assigned);
+	}
+
+	// In order, a local function can only be inlined into code compiled after its def
+	for (auto i = 2u; i < list.size(); ++i)
+	{
+		optimize(list[i], &inner);
+		if (is_form(list[i], symbol_def))
+			add_inline_function(list[i].get_ref<list_t>(), inner);
+	}
+
+	// Drop unused defs of values that can't have side effects. The last expression is the
+	// return value so it stays, and so does everything if (vars) could print the locals.
+	auto has_vars = std::any_of(list.begin() + 2, list.end(), [](const object& item) { return contains_vars(item); });
+	for (auto changed = !has_vars; changed; )
+	{
+		changed = false;
+		for (auto i = 2u; i + 1 < list.size(); ++i)
+		{
+			if (!is_form(list[i], symbol_def))
+				continue;
+			auto&& def = list[i].get_ref<list_t>();
+			auto name = get_def_name(def);
+			if (name == no_symbol)
+				continue;
+			auto pure = def[1].is_type<list_t>() || (def.size() == 3 && (is_literal(def[2]) || is_form(def[2], symbol_lambda)));
+			if (!pure)
+				continue;
+
+			size_t references = 0;
+			for (auto j = 2u; j < list.size(); ++j)
+			{
+				if (j != i)
+					references += count_references(list[j], name);
+			}
+			if (references == 0)
+			{
+				list.erase(list.begin() + i);
+				changed = true;
+				break;
+			}
+		}
+	}
+}
+
+// Records (def (name params...) body) if calls to it can be replaced with its body: the
+// body is one small expression of literals, parameters, ifs and operator calls, and
+// nothing else in the lambda binds or assigns the name
+void optimizer_t::add_inline_function(const list_t& def, scope_t& scope)
+{
+	if (def.size() != 3 || !def[1].is_type<list_t>())
+		return;
+	auto name = get_def_name(def);
+	if (name == no_symbol || contains(scope.assigned, name)
+		|| std::count(scope.bound.begin(), scope.bound.end(), name) != 1)
+		return;
+
+	auto&& signature = def[1].get_ref<list_t>();
+	std::vector<symbol_t> parameters;
+	for (auto i = 1u; i < signature.size(); ++i)
+	{
+		auto parameter = get_symbol(signature[i]);
+		if (parameter == no_symbol || parameter == name || contains(parameters, parameter))
+			return;
+		parameters.push_back(parameter);
+	}
+
+	size_t budget = 32;
+	if (!is_simple(def[2], parameters, &scope, budget))
+		return;
+	scope.functions.push_back({ name, std::move(parameters), def[2] });
+}
+
+bool optimizer_t::is_simple(const object& obj, const std::vector<symbol_t>& parameters,
+	const scope_t* scope, size_t& budget) const
+{
+	if (budget == 0)
+		return false;
+	--budget;
+
+	if (is_literal(obj))
+		return true;
+	if (obj.is_type<variable_reference>())
+		return contains(parameters, get_symbol(obj));
+	if (!obj.is_type<list_t>())
+		return false;
+
+	auto&& list = obj.get_ref<list_t>();
+	if (list.empty())
+		return false;
+	// Parameters are substituted in both versions of a fold, its guard only names operators
+	if (is_form(list, symbol_guard))
+		return list.size() == 4 && is_simple(list[2], parameters, scope, budget) && is_simple(list[3], parameters, scope, budget);
+	if (is_form(list, symbol_if))
+	{
+		if (list.size() < 3 || list.size() > 4)
+			return false;
+	}
+	else if (contains(parameters, get_symbol(list[0])) || get_operator(list[0], scope) == no_symbol)
+		return false;
+
+	for (auto i = 1u; i < list.size(); ++i)
+	{
+		if (!is_simple(list[i], parameters, scope, budget))
+			return false;
+	}
+	return true;
+}
+
+void optimizer_t::optimize_call(object& obj, scope_t* scope)
+{
+	auto&& list = obj.get_ref<list_t>();
+	for (auto&& item : list)
+		optimize(item, scope);
+
+	auto name = get_symbol(list[0]);
+	if (name == no_symbol)
+		return;
+
+	// Arguments are copied into the body, so they have to be free of side effects and
+	// bound to something: a literal or a local
+	auto function = find_inline_function(name, scope);
+	if (function && function->parameters.size() == list.size() - 1
+		&& std::all_of(list.begin() + 1, list.end(), [&](const object& arg) {
+			return is_literal(arg) || (arg.is_type<variable_reference>() && is_bound(get_symbol(arg), scope));
+		}))
+	{
+		object body = function->body;
+		substitute_arguments(body, function->parameters, list);
+		optimize(body, scope);
+		obj = std::move(body);
+		return;
+	}
+
+	auto op = get_operator(list[0], scope);
+	if (op == no_symbol || list.size() < 3 || !std::all_of(list.begin() + 1, list.end(), get_folded_number))
+		return;
+	auto&& op_name = get_symbol_name(op);
+	if (list.size() > 3 && op_name != "+" && op_name != "*")
+		return;
+
+	// Left to right like the builtins, so overflow and the switch to doubles happen at the same operand
+	object result = *get_folded_number(list[1]);
+	for (auto i = 2u; i < list.size(); ++i)
+	{
+		if (!fold(op_name, result, *get_folded_number(list[i]), result))
+			return;
+	}
+
+	// (guard (name version ...) result call), the call is what's left of it without
+	// folding: operands folded before go back to their own calls and guard with it
+	list_t versions;
+	auto add_version = [&](const object& name, const object& version)
+	{
+		for (size_t i = 0; i < versions.size(); i += 2)
+		{
+			if (get_symbol(versions[i]) == get_symbol(name))
+				return;
+		}
+		versions.push_back(name);
+		versions.push_back(version);
+	};
+	add_version(list[0], object{ static_cast<int64_t>(globals.find(get_symbol(list[0]))->second.version) });
+	list_t call;
+	call.push_back(list[0]);
+	for (auto i = 1u; i < list.size(); ++i)
+	{
+		if (is_number(list[i]))
+		{
+			call.push_back(list[i]);
+			continue;
+		}
+		auto&& guard = list[i].get_ref<list_t>();
+		auto&& operand_versions = guard[1].get_ref<list_t>();
+		for (size_t j = 0; j + 1 < operand_versions.size(); j += 2)
+			add_version(operand_versions[j], operand_versions[j + 1]);
+		call.push_back(guard[3]);
+	}
+
+	list_t guard;
+	guard.push_back(object{ statement{ symbol_guard } });
+	guard.push_back(object{ std::move(versions) });
+	guard.push_back(std::move(result));
+	guard.push_back(object{ std::move(call) });
+	obj = object{ std::move(guard) };
+}
+
+void optimizer_t::optimize_if(object& obj, scope_t* scope)
+{
+	auto&& list = obj.get_ref<list_t>();
+	for (auto i = 1u; i < list.size(); ++i)
+		optimize(list[i], scope);
+	if (list.size() < 3 || list.size() > 4)
+		return;
+
+	auto truth = false;
+	if (!get_truth(list[1], scope, truth))
+		return;
+	auto taken = truth ? 2u : 3u;
+	auto dropped = truth ? 3u : 2u;
+	if (dropped < list.size() && contains_def(list[dropped]))
+		return;
+
+	object result = taken < list.size() ? std::move(list[taken]) : object{ nil_t{} };
+	obj = std::move(result);
+}
+
+void optimizer_t::optimize_cond(object& obj, scope_t* scope)
+{
+	auto&& list = obj.get_ref<list_t>();
+	for (auto i = 1u; i < list.size(); ++i)
+	{
+		if (!list[i].is_type<list_t>() || list[i].get_ref<list_t>().empty())
+			return;
+		for (auto&& item : list[i].get_ref<list_t>())
+			optimize(item, scope);
+	}
+
+	for (auto i = 1u; i < list.size(); )
+	{
+		auto&& clause = list[i].get_ref<list_t>();
+		auto truth = false;
+		if (!get_truth(clause[0], scope, truth))
+		{
+			++i;
+			continue;
+		}
+
+		if (!truth)
+		{
+			if (contains_def(list[i]))
+				++i;
+			else
+				list.erase(list.begin() + i);
+			continue;
+		}
+
+		// Clauses after one that always matches never run
+		if (std::none_of(list.begin() + i + 1, list.end(), [](const object& item) { return contains_def(item); }))
+			list.erase(list.begin() + i + 1, list.end());
+		break;
+	}
+
+	if (list.size() == 1)
+	{
+		obj = object{ nil_t{} };
+		return;
+	}
+
+	auto&& first = list[1].get_ref<list_t>();
+	auto truth = false;
+	if (list.size() == 2 && first.size() <= 2 && get_truth(first[0], scope, truth) && truth)
+	{
+		object result = first.size() == 2 ? std::move(first[1]) : object{ nil_t{} };
+		obj = std::move(result);
+	}
+}
+
+void optimizer_t::optimize_while(object& obj, scope_t* scope)
+{
+	auto&& list = obj.get_ref<list_t>();
+	for (auto i = 1u; i < list.size(); ++i)
+		optimize(list[i], scope);
+
+	auto truth = false;
+	if (list.size() >= 2 && get_truth(list[1], scope, truth) && !truth && !contains_def(obj))
+		obj = object{ nil_t{} };
+}
+
+static void print_string(std::ostream& stream, const std::string& str)
+{
+	stream << '"';
+	for (auto c : str)
+	{
+		switch (c)
+		{
+		case '\n': stream << "\\n"; break;
+		case '\t': stream << "\\t"; break;
+		case '\\': stream << "\\\\"; break;
+		case '"': stream << "\\\""; break;
+		default: stream << c;
+		}
+	}
+	stream << '"';
+}
+
+void print_tree(std::ostream& stream, const object& obj)
+{
+	if (obj.is_type<list_t>())
+	{
+		auto&& list = obj.get_ref<list_t>();
+		stream << (list.quoted ? "'(" : "(");
+		for (size_t i = 0; i < list.size(); ++i)
+		{
+			if (i)
+				stream << ' ';
+			print_tree(stream, list[i]);
+		}
+		stream << ')';
+	}
+	else if (obj.is_type<std::string>())
+		print_string(stream, obj.get_ref<std::string>());
+	else if (obj.is_type<double>())
+	{
+		// Keep doubles recognizable as doubles, inf and nan already are
+		std::ostringstream str;
+		str << obj.get_ref<double>();
+		auto text = str.str();
+		if (text.find_first_of(".en") == std::string::npos)
+			text += ".0";
+		stream << text;
+	}
+	else if (obj.is_type<bool>())
+		stream << (obj.get_ref<bool>() ? "true" : "false");
+	else if (obj.is_type<nil_t>())
+		stream << "nil";
+	else
+		obj.visit([&](auto&& item) { stream << item; });
+}
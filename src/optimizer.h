@@ -0,0 +1,45 @@
+#pragma once
+
+#include <iosfwd>
+#include <vector>
+#include "basic_types.h"
+#include "vm.h"
+
+// Rewrites top-level forms in place before they're compiled:
+// - arithmetic and comparisons on literals are folded
+// - if, cond and while branches behind literal conditions are pruned
+// - calls to small local functions defined in a lambda body are inlined
+// - defs in lambda bodies that nothing refers to are dropped
+//
+// A folded operator call keeps the original call in a guard form, which runs
+// it instead once the operator's global is rebound, see compiler_t::guard. So
+// the result is the same as without the optimizer. Branches are only pruned on
+// true, false and nil, which can't be assigned.
+struct optimizer_t
+{
+	explicit optimizer_t(const variable_map_t& globals)
+		: globals(globals) {}
+
+	void optimize(object& form);
+
+private:
+	struct scope_t;
+
+	void optimize(object& obj, scope_t* scope);
+	void optimize_lambda(list_t& list, size_t first_parameter, scope_t* scope);
+	void optimize_call(object& obj, scope_t* scope);
+	void optimize_if(object& obj, scope_t* scope);
+	void optimize_cond(object& obj, scope_t* scope);
+	void optimize_while(object& obj, scope_t* scope);
+	void add_inline_function(const list_t& def, scope_t& scope);
+
+	bool get_truth(const object& obj, const scope_t* scope, bool& truth) const;
+	symbol_t get_operator(const object& obj, const scope_t* scope) const;
+	bool is_simple(const object& obj, const std::vector<symbol_t>& parameters,
+		const scope_t* scope, size_t& budget) const;
+
+	const variable_map_t& globals;
+};
+
+// Prints the tree back as source, used to dump what the optimizer produced
+void print_tree(std::ostream& stream, const object& obj);
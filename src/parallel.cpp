@@ -0,0 +1,192 @@
+#include "vm.h"
+#include "vector.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+
+// pmap, pfor and preduce split their items into chunks that are spread over the
+// thread pool. Each pool thread runs its chunks on a VM of its own, with its
+// own stack and heap, that reads the globals of the VM the form runs in. Once
+// every chunk is done that VM's heap adopts theirs.
+//
+// Chunks only depend on the item count, so preduce combines the same partial
+// results in the same order however many threads there are, and an error is
+// always the one of the first item that failed.
+
+static constexpr size_t max_chunks = 256;
+
+vm_t::vm_t(vm_t& parent)
+	: max_call_depth(parent.max_call_depth), jit_enabled(parent.jit_enabled),
+	jit_threshold(parent.jit_threshold), parent(&parent) {}
+
+// What a parallel form goes over. Vector elements and ints of a range are only
+// made into values when they're used.
+struct parallel_items_t
+{
+	size_t size() const
+	{
+		return ints ? ints->items.size() : doubles ? doubles->items.size() : is_range ? count : values.size();
+	}
+
+	value_t operator [](size_t i) const
+	{
+		return ints ? value_t{ ints->items[i] } : doubles ? value_t{ doubles->items[i] }
+			: is_range ? value_t{ start + static_cast<int64_t>(i) } : values[i];
+	}
+
+	// The items of a list
+	std::vector<value_t> values;
+	const int_vector_object* ints = nullptr;
+	const double_vector_object* doubles = nullptr;
+	bool is_range = false;
+	int64_t start = 0;
+	size_t count = 0;
+};
+
+static parallel_items_t get_items(const char* name, const value_t& value)
+{
+	parallel_items_t items;
+	if (value.is_list())
+	{
+		items.values.reserve(list_length(value));
+		for_each_item(value, [&](const value_t& item) { items.values.push_back(item); });
+	}
+	else if (value.is_object(value_type::int_vector))
+		items.ints = &value.get_object<int_vector_object>();
+	else if (value.is_object(value_type::double_vector))
+		items.doubles = &value.get_object<double_vector_object>();
+	else
+		throw std::runtime_error{ std::string{ name } +" expects a list or a vector, got " + get_type_name(value.get_type()) };
+	return items;
+}
+
+static parallel_items_t get_range(const value_t& start, const value_t& end)
+{
+	for (auto&& bound : { start, end })
+	{
+		if (!bound.is_int())
+			throw std::runtime_error{ std::string{ "pfor expects ints, got " } +get_type_name(bound.get_type()) };
+	}
+	parallel_items_t items;
+	items.is_range = true;
+	items.start = start.get_int();
+	if (end.get_int() > items.start)
+		items.count = static_cast<size_t>(end.get_int() - items.start);
+	return items;
+}
+
+void vm_t::run_parallel(parallel_op op)
+{
+	auto argument_count = op == parallel_op::map ? size_t{ 2 } : size_t{ 3 };
+	// The arguments stay on the stack until the result replaces them, which keeps the items alive
+	auto base = stack.size() - argument_count;
+	auto arguments = stack.data() + base;
+	auto callee = op == parallel_op::for_ ? arguments[2] : arguments[0];
+	auto initial = op == parallel_op::reduce ? arguments[1] : value_t{};
+	auto items = op == parallel_op::map ? get_items("pmap", arguments[1])
+		: op == parallel_op::for_ ? get_range(arguments[0], arguments[1])
+		: get_items("preduce", arguments[2]);
+
+	auto count = items.size();
+	auto chunk_size = std::max<size_t>(1, (count + max_chunks - 1) / max_chunks);
+	auto chunk_count = (count + chunk_size - 1) / chunk_size;
+
+	// pmap's results, or preduce's result for each chunk
+	std::vector<value_t> results(op == parallel_op::map ? count : op == parallel_op::reduce ? chunk_count : 0);
+	std::vector<std::exception_ptr> errors(count);
+	// Items after the first that failed are skipped, their results don't matter
+	std::atomic<size_t> failed{ count };
+
+	auto run_item = [&](vm_t& vm, size_t i, value_t& accumulator)
+	{
+		if (i > failed)
+			return;
+		try
+		{
+			if (op == parallel_op::reduce)
+				accumulator = i % chunk_size == 0 ? items[i] : vm.apply(callee, { accumulator, items[i] });
+			else if (op == parallel_op::map)
+				accumulator = vm.apply(callee, { items[i] });
+			else
+				vm.apply(callee, { items[i] });
+		}
+		catch (...)
+		{
+			errors[i] = std::current_exception();
+			auto first = failed.load();
+			while (i < first && !failed.compare_exchange_weak(first, i)) {}
+		}
+	};
+	auto run_chunk = [&](vm_t& vm, size_t chunk)
+	{
+		heap_scope_t scope{ vm.heap };
+		auto end = std::min(count, (chunk + 1) * chunk_size);
+		value_t accumulator;
+		for (auto i = chunk * chunk_size; i < end; ++i)
+		{
+			run_item(vm, i, accumulator);
+			if (op == parallel_op::map)
+			{
+				results[i] = accumulator;
+				// Keeps it alive through the VM's collections
+				vm.stack.push_back(accumulator);
+			}
+		}
+		if (op == parallel_op::reduce)
+		{
+			results[chunk] = accumulator;
+			vm.stack.push_back(accumulator);
+		}
+	};
+
+	if (parent)
+	{
+		// A task's own parallel forms run on its thread
+		for (size_t chunk = 0; chunk < chunk_count; ++chunk)
+			run_chunk(*this, chunk);
+	}
+	else if (chunk_count > 0)
+	{
+		std::vector<std::unique_ptr<vm_t>> children;
+		for (size_t i = 0; i < thread_pool_size(); ++i)
+			children.emplace_back(new vm_t(*this));
+
+		running_parallel = true;
+		// The first chunk runs alone so the functions get their caches filled and
+		// native code compiled before the other threads only read them
+		run_chunk(*children[0], 0);
+		for (auto&& child : children)
+			child->shared = true;
+		if (chunk_count > 1)
+		{
+			thread_pool_run(chunk_count - 1, [&](size_t thread, size_t begin, size_t end)
+			{
+				for (auto chunk = begin; chunk < end; ++chunk)
+					run_chunk(*children[thread], chunk + 1);
+			});
+		}
+		running_parallel = false;
+
+		// Partial results may refer to any of the heaps until they're all adopted
+		for (auto&& child : children)
+			heap.adopt(child->heap);
+	}
+
+	if (failed < count)
+		std::rethrow_exception(errors[failed]);
+
+	value_t result;
+	if (op == parallel_op::map)
+		result = make_list(results.data(), results.data() + results.size());
+	else if (op == parallel_op::reduce)
+	{
+		// Nothing else refers to the partial results now
+		stack.insert(stack.end(), results.begin(), results.end());
+		result = initial;
+		for (auto&& partial : results)
+			result = apply(callee, { result, partial });
+	}
+	stack.resize(base);
+	stack.push_back(result);
+}
@@ -0,0 +1,299 @@
+#include "parser.h"
+#include <algorithm>
+#include <vector>
+#include <iterator>
+
+syntax_error::syntax_error(const std::string& message, size_t line, size_t column)
+	: std::runtime_error{ "Syntax error at line " + std::to_string(line) + ", column "
+		+ std::to_string(column) + ": " + message },
+	line(line), column(column) {}
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_delimiter(char c)
+{
+	return is_space(c) || c == '(' || c == ')' || c == '"' || c == ';';
+}
+
+static bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static bool looks_numeric(string_ref token)
+{
+	auto pos = 0u;
+	if (token.data[pos] == '-' || token.data[pos] == '+')
+		++pos;
+	if (pos < token.size && token.data[pos] == '.')
+		++pos;
+	return pos < token.size && is_digit(token.data[pos]);
+}
+
+struct parser_t
+{
+	parser_t(string_ref source, size_t pos, bool at_end, text_position_t start)
+		: source(source), pos(pos), at_end(at_end), start(start) {}
+
+	parse_status parse_form(object& form);
+
+	[[noreturn]] void error(const std::string& message, size_t at) const;
+	// Both return false when the input ran out and more may follow
+	bool skip_comment();
+	bool parse_string();
+	bool parse_atom();
+	void add(object value);
+
+	void close_list();
+
+	struct open_list_t
+	{
+		// Index in items of the list's first element
+		size_t first_item;
+		// Source position of the (, for errors
+		size_t start;
+		bool quoted;
+	};
+
+	string_ref source;
+	size_t pos;
+	bool at_end;
+	text_position_t start;
+	// Elements of every list that is still open. A list is built at its final
+	// size once its ) is seen, so nothing in the tree is ever regrown.
+	std::vector<object> items;
+	std::vector<open_list_t> open_lists;
+};
+
+void parser_t::error(const std::string& message, size_t at) const
+{
+	auto line = start.line;
+	auto column = start.column;
+	for (size_t i = 0; i < at && i < source.size; ++i)
+	{
+		if (source.data[i] == '\n')
+		{
+			++line;
+			column = 1;
+		}
+		else
+			++column;
+	}
+	throw syntax_error{ message, line, column };
+}
+
+void parser_t::add(object value)
+{
+	items.emplace_back(std::move(value));
+}
+
+void parser_t::close_list()
+{
+	auto open = open_lists.back();
+	open_lists.pop_back();
+
+	auto first = items.begin() + open.first_item;
+	list_t list{ std::make_move_iterator(first), std::make_move_iterator(items.end()) };
+	list.quoted = open.quoted;
+	items.erase(first, items.end());
+	add(std::move(list));
+}
+
+bool parser_t::skip_comment()
+{
+	while (pos < source.size && source.data[pos] != '\n')
+		++pos;
+	// The rest of the line may still be coming
+	return pos < source.size || at_end;
+}
+
+bool parser_t::parse_string()
+{
+	auto start = pos++;
+	std::string str;
+
+	while (true)
+	{
+		if (pos >= source.size)
+		{
+			if (!at_end)
+				return false;
+			error("Unterminated string", start);
+		}
+
+		auto c = source.data[pos++];
+		if (c == '"')
+			break;
+
+		if (c == '\\')
+		{
+			if (pos >= source.size)
+			{
+				if (!at_end)
+					return false;
+				error("Unterminated string", start);
+			}
+			switch (source.data[pos++])
+			{
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case '\\': c = '\\'; break;
+			case '"': c = '"'; break;
+			default: error("Unknown escape sequence", pos - 2);
+			}
+		}
+
+		str.push_back(c);
+	}
+
+	add(std::move(str));
+	return true;
+}
+
+bool parser_t::parse_atom()
+{
+	auto start = pos;
+	while (pos < source.size && !is_delimiter(source.data[pos]))
+		++pos;
+	// The token may go on in the input that follows
+	if (pos == source.size && !at_end)
+		return false;
+	string_ref token{ source.data + start, pos - start };
+
+	if (looks_numeric(token))
+	{
+		auto int64_result = string_to_int64(token);
+		if (int64_result.first)
+		{
+			add(int64_result.second);
+			return true;
+		}
+		auto double_result = string_to_double(token);
+		if (double_result.first)
+		{
+			add(double_result.second);
+			return true;
+		}
+		error("Malformed number " + token.to_string(), start);
+	}
+
+	auto symbol = intern(token.data, token.size);
+	if (symbol < statement_count && symbol != symbol_guard)
+		add(statement{ symbol });
+	else
+		add(variable_reference{ symbol });
+	return true;
+}
+
+parse_status parser_t::parse_form(object& form)
+{
+	// Where the form starts, pos goes back here when it's incomplete
+	auto form_start = pos;
+	auto ran_out = false;
+	while (pos < source.size && !ran_out)
+	{
+		auto c = source.data[pos];
+
+		if (is_space(c))
+		{
+			++pos;
+			if (open_lists.empty())
+				form_start = pos;
+			continue;
+		}
+
+		if (c == ';')
+		{
+			ran_out = !skip_comment();
+			if (open_lists.empty() && !ran_out)
+				form_start = pos;
+			continue;
+		}
+
+		if (c == '(' || c == '\'')
+		{
+			auto start = pos++;
+			auto quoted = c == '\'';
+			if (quoted && pos >= source.size && !at_end)
+			{
+				ran_out = true;
+				continue;
+			}
+			if (quoted && (pos >= source.size || source.data[pos++] != '('))
+				error("Expected ( after '", start);
+
+			open_lists.push_back({ items.size(), start, quoted });
+			continue;
+		}
+
+		if (c == ')')
+		{
+			if (open_lists.empty())
+				error("Unexpected )", pos);
+			close_list();
+			++pos;
+		}
+		else
+			ran_out = c == '"' ? !parse_string() : !parse_atom();
+
+		if (open_lists.empty() && !ran_out)
+		{
+			form = std::move(items.back());
+			items.clear();
+			return parse_status::form;
+		}
+	}
+
+	if (!ran_out && open_lists.empty())
+		return parse_status::end;
+	if (at_end)
+		error("Unclosed (", open_lists.back().start);
+
+	pos = form_start;
+	open_lists.clear();
+	items.clear();
+	return parse_status::incomplete;
+}
+
+parse_status parse_form(string_ref source, size_t& pos, bool at_end, object& form, text_position_t start)
+{
+	parser_t parser{ source, pos, at_end, start };
+	auto status = parser.parse_form(form);
+	pos = parser.pos;
+	return status;
+}
+
+size_t count_form_lines(const char* first, const char* last, size_t& line)
+{
+	// The form starts after the whitespace and comments in front of it
+	while (first != last && (is_space(*first) || *first == ';'))
+	{
+		if (*first == ';')
+			first = std::find(first, last, '\n');
+		else if (*first++ == '\n')
+			++line;
+	}
+	auto form_line = line;
+	line += static_cast<size_t>(std::count(first, last, '\n'));
+	return form_line;
+}
+
+list_t parse(string_ref source, std::vector<size_t>* lines)
+{
+	parser_t parser{ source, 0, true, {} };
+	std::vector<object> forms;
+	object form = nil_t{};
+	size_t line = 1;
+	auto pos = parser.pos;
+	while (parser.parse_form(form) == parse_status::form)
+	{
+		forms.push_back(std::move(form));
+		if (lines)
+			lines->push_back(count_form_lines(source.data + pos, source.data + parser.pos, line));
+		pos = parser.pos;
+	}
+	return{ std::make_move_iterator(forms.begin()), std::make_move_iterator(forms.end()) };
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include "basic_types.h"
+#include "util.h"
+
+struct syntax_error : std::runtime_error
+{
+	syntax_error(const std::string& message, size_t line, size_t column);
+
+	size_t line;
+	size_t column;
+};
+
+// Line and column of a character, both counted from 1
+struct text_position_t
+{
+	size_t line = 1;
+	size_t column = 1;
+};
+
+enum class parse_status
+{
+	form,       // a form was parsed and pos moved past it
+	end,        // nothing but whitespace and comments is left, pos moved past them
+	incomplete, // source stops in the middle of a form, more input may finish it
+};
+
+// Parses the next top-level form of source starting at pos. When at_end is false
+// more input may follow source, so running out of it halfway through a form
+// returns incomplete instead of throwing, leaving pos at the start of the form.
+// start is where source begins in the input, for the positions in errors.
+parse_status parse_form(string_ref source, size_t& pos, bool at_end, object& form, text_position_t start = {});
+
+// parse_form went over the whitespace, comments and form in [first, last).
+// Adds the lines in it to line and returns the line the form starts on.
+size_t count_form_lines(const char* first, const char* last, size_t& line);
+
+// Parses every top-level form in source in a single pass, and the line each
+// starts on into lines if it's given
+list_t parse(string_ref source, std::vector<size_t>* lines = nullptr);
@@ -0,0 +1,171 @@
+#include "profiler.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+// Deeper call paths than this are folded into one node, a collapsed stack line
+// is as long as its path and there is about a line per node
+static const size_t max_profile_depth = 128;
+
+const char* const default_profile_path = "profile.folded";
+
+profiler_t::profiler_t(symbol_t root)
+	: start(clock::now()), truncated(intern("..."))
+{
+	nodes.emplace_back(root, 0, 0);
+	nodes[0].calls = 1;
+}
+
+void profiler_t::enter(symbol_t name, size_t depth, bool form)
+{
+	auto parent = entries.empty() ? 0 : entries.back().node;
+	if (nodes[parent].depth >= max_profile_depth)
+		name = truncated;
+	if (nodes[parent].name == name)
+	{
+		// The lambda of (profile expr) is the root itself
+		if (!entries.empty())
+			++nodes[parent].calls;
+		entries.push_back({ parent, depth, form, true, {} });
+		return;
+	}
+
+	auto key = static_cast<std::uint64_t>(parent) << 32 | name;
+	auto it = children.find(key);
+	if (it == children.end())
+	{
+		it = children.emplace(key, nodes.size()).first;
+		nodes[parent].children.push_back(nodes.size());
+		nodes.emplace_back(name, parent, nodes[parent].depth + 1);
+	}
+	++nodes[it->second].calls;
+	entries.push_back({ it->second, depth, form, false, clock::now() });
+}
+
+void profiler_t::pop_entry(clock::time_point now)
+{
+	auto&& entry = entries.back();
+	if (!entry.folded)
+		nodes[entry.node].inclusive_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(now - entry.start).count();
+	entries.pop_back();
+}
+
+void profiler_t::leave(size_t depth)
+{
+	if (entries.empty() || entries.back().depth < depth)
+		return;
+	auto now = clock::now();
+	while (!entries.empty() && entries.back().depth >= depth)
+		pop_entry(now);
+}
+
+void profiler_t::leave_form(size_t depth)
+{
+	// Forms are never left by a tail call, so whatever was entered after this one has returned
+	if (!entries.empty() && entries.back().form && entries.back().depth == depth)
+		pop_entry(clock::now());
+}
+
+void profiler_t::stop()
+{
+	if (stopped)
+		return;
+	stopped = true;
+	auto now = clock::now();
+	while (!entries.empty())
+		pop_entry(now);
+	nodes[0].inclusive_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+}
+
+// Children are always created after their parent, so one pass backwards subtracts them all
+std::vector<std::int64_t> profiler_t::get_exclusive_ns() const
+{
+	std::vector<std::int64_t> exclusive;
+	for (auto&& node : nodes)
+		exclusive.push_back(node.inclusive_ns);
+	for (auto i = nodes.size() - 1; i > 0; --i)
+		exclusive[nodes[i].parent] -= nodes[i].inclusive_ns;
+	return exclusive;
+}
+
+void profiler_t::write_summary(std::ostream& out) const
+{
+	struct total_t
+	{
+		symbol_t name;
+		std::uint64_t calls;
+		std::int64_t inclusive_ns;
+		std::int64_t exclusive_ns;
+	};
+	auto exclusive = get_exclusive_ns();
+	std::unordered_map<symbol_t, total_t> totals;
+	// How many of a node's ancestors have each name, a node below one with the
+	// same name is already part of its inclusive time
+	std::unordered_map<symbol_t, size_t> open;
+	std::vector<std::pair<size_t, bool>> pending{ { 0, true } };
+	while (!pending.empty())
+	{
+		auto item = pending.back();
+		pending.pop_back();
+		auto&& node = nodes[item.first];
+		if (!item.second)
+		{
+			--open[node.name];
+			continue;
+		}
+
+		auto&& total = totals.emplace(node.name, total_t{ node.name, 0, 0, 0 }).first->second;
+		total.calls += node.calls;
+		total.exclusive_ns += exclusive[item.first];
+		if (open[node.name]++ == 0)
+			total.inclusive_ns += node.inclusive_ns;
+		pending.push_back({ item.first, false });
+		for (auto child : node.children)
+			pending.push_back({ child, true });
+	}
+
+	std::vector<total_t> sorted;
+	for (auto&& pair : totals)
+		sorted.push_back(pair.second);
+	std::sort(sorted.begin(), sorted.end(), [](const total_t& lhs, const total_t& rhs)
+	{
+		return lhs.exclusive_ns > rhs.exclusive_ns;
+	});
+
+	char line[256];
+	std::snprintf(line, sizeof(line), "%12s %14s %14s  %s\n", "calls", "inclusive ms", "exclusive ms", "name");
+	out << line;
+	for (auto&& total : sorted)
+	{
+		std::snprintf(line, sizeof(line), "%12llu %14.3f %14.3f  ", static_cast<unsigned long long>(total.calls),
+			total.inclusive_ns / 1e6, total.exclusive_ns / 1e6);
+		out << line << get_symbol_name(total.name) << '\n';
+	}
+}
+
+void profiler_t::write_collapsed(std::ostream& out) const
+{
+	auto exclusive = get_exclusive_ns();
+	// Path of each node, built from its parent's as they're visited
+	std::vector<std::pair<size_t, std::string>> pending{ { 0, get_symbol_name(nodes[0].name) } };
+	while (!pending.empty())
+	{
+		auto item = std::move(pending.back());
+		pending.pop_back();
+		if (exclusive[item.first] > 0)
+			out << item.second << ' ' << exclusive[item.first] << '\n';
+		for (auto child : nodes[item.first].children)
+			pending.push_back({ child, item.second + ';' + get_symbol_name(nodes[child].name) });
+	}
+}
+
+void profiler_t::report(const std::string& path) const
+{
+	write_summary(std::cerr);
+	std::ofstream file{ path };
+	write_collapsed(file);
+	if (!file)
+		throw std::runtime_error{ "Failed to write profile to " + path };
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "symbol.h"
+
+// Instrumenting profiler behind (profile expr [path]) and --profile. While one
+// is set on a VM, every lambda call, builtin call and timed special form (while,
+// print, vars and the parallel forms) enters a node of a call tree and leaves
+// it when it returns. Lambdas are named by the def that bound them, anonymous
+// ones by the lambda they're written in. Native code isn't used while
+// profiling, so calls it would inline are still seen. Lambdas the optimizer
+// inlined aren't, --no-optimize shows them.
+//
+// Calls of a name directly below the same name are folded into one node, so
+// recursion doesn't grow the tree, and nodes past max_profile_depth are folded
+// into one "..." node. A VM with no profiler only pays for a null check per call.
+struct profile_node_t
+{
+	profile_node_t(symbol_t name, size_t parent, size_t depth)
+		: name(name), parent(parent), depth(depth) {}
+
+	symbol_t name;
+	size_t parent;
+	// Number of nodes above it
+	size_t depth;
+	std::uint64_t calls = 0;
+	// Time spent in calls that weren't folded into a caller
+	std::int64_t inclusive_ns = 0;
+	std::vector<size_t> children;
+};
+
+struct profiler_t
+{
+	using clock = std::chrono::steady_clock;
+
+	// The clock starts now, root names the node everything is entered below
+	explicit profiler_t(symbol_t root);
+
+	// depth is the VM's frame count once a lambda's frame is pushed, a form or a
+	// builtin entered at the same depth is one that runs inside that frame
+	void enter(symbol_t name, size_t depth, bool form);
+	// Leaves everything entered at depth or deeper, for a frame that returns
+	void leave(size_t depth);
+	// Leaves the form entered last at depth, if it's still entered
+	void leave_form(size_t depth);
+	// Stops the clock of the root and of everything still entered
+	void stop();
+
+	// Inclusive and exclusive time and calls per name, slowest first
+	void write_summary(std::ostream& out) const;
+	// One line per call path with the time spent in its last name itself, in
+	// nanoseconds, in the collapsed stack format flame graph tools read
+	void write_collapsed(std::ostream& out) const;
+	// Both, the summary to stderr and the stacks to the file at path. Throws if it can't be written.
+	void report(const std::string& path) const;
+
+	std::vector<profile_node_t> nodes;
+
+private:
+	struct entry_t
+	{
+		size_t node;
+		size_t depth;
+		bool form;
+		// Folded into the node of its caller, whose time already covers it
+		bool folded;
+		clock::time_point start;
+	};
+
+	void pop_entry(clock::time_point now);
+	std::vector<std::int64_t> get_exclusive_ns() const;
+
+	// Child of a node by (parent << 32 | name)
+	std::unordered_map<std::uint64_t, size_t> children;
+	std::vector<entry_t> entries;
+	clock::time_point start;
+	symbol_t truncated;
+	bool stopped = false;
+};
+
+// Where the profile of --profile and of (profile expr) goes when no path is given
+extern const char* const default_profile_path;
@@ -0,0 +1,164 @@
+#include "reader.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#if CATLANG_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Blocks of input read at a time, the buffer grows past this for longer forms
+static const std::size_t block_size = 256 * 1024;
+
+mapped_file_t::mapped_file_t(const std::string& path)
+{
+#if CATLANG_POSIX
+	auto fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat status;
+	if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode))
+	{
+		size = static_cast<std::size_t>(status.st_size);
+		// Nothing to map, but the file is there
+		static const char empty = 0;
+		auto memory = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : const_cast<char*>(&empty);
+		if (memory != MAP_FAILED)
+			data = static_cast<const char*>(memory);
+		else
+			size = 0;
+	}
+	close(fd);
+#else
+	std::ifstream file{ path, std::ios::binary };
+	if (file.fail())
+		return;
+	buffer.assign(std::istreambuf_iterator<char>{ file }, std::istreambuf_iterator<char>{});
+	// Non-null even when the file is empty
+	buffer.push_back('\0');
+	data = buffer.data();
+	size = buffer.size() - 1;
+#endif
+}
+
+mapped_file_t::~mapped_file_t()
+{
+#if CATLANG_POSIX
+	if (data && size)
+		munmap(const_cast<char*>(data), size);
+#endif
+}
+
+form_reader_t::form_reader_t(const std::string& path)
+	: name(path), file(new mapped_file_t{ path })
+{
+	if (file->data)
+	{
+		data = file->data;
+		end = file->size;
+		at_end = true;
+		return;
+	}
+	file.reset();
+
+#if CATLANG_POSIX
+	// Pipes and devices can't be mapped, they're read like the standard input
+	fd = open(path.c_str(), O_RDONLY);
+	owns_fd = true;
+	if (fd < 0)
+#endif
+		throw std::runtime_error{ "Failed to open file " + path };
+}
+
+form_reader_t::form_reader_t()
+	: name("stdin")
+{
+#if CATLANG_POSIX
+	fd = STDIN_FILENO;
+	interactive = isatty(fd) != 0;
+#endif
+}
+
+form_reader_t::~form_reader_t()
+{
+#if CATLANG_POSIX
+	if (owns_fd)
+		close(fd);
+#endif
+}
+
+void form_reader_t::fill()
+{
+	// Drop what was parsed, keeping track of where the rest starts in the input
+	for (auto it = buffer.data(); it != buffer.data() + begin; ++it)
+	{
+		if (*it == '\n')
+		{
+			++position.line;
+			position.column = 1;
+		}
+		else
+			++position.column;
+	}
+	buffer.erase(buffer.begin(), buffer.begin() + begin);
+	end -= begin;
+	begin = 0;
+
+	// A form that doesn't fit gets twice the room
+	buffer.resize(std::max(block_size, end * 2));
+	if (interactive)
+		std::cout.flush();
+
+	// The form is parsed again from its start once more arrives. One that's
+	// outgrown a block isn't until the room is full, else a big form coming
+	// down a pipe a read at a time would take quadratic time.
+	auto wanted = end >= block_size ? buffer.size() : end + 1;
+	while (end < wanted && !at_end)
+	{
+#if CATLANG_POSIX
+		auto count = read(fd, buffer.data() + end, buffer.size() - end);
+		while (count < 0 && errno == EINTR)
+			count = read(fd, buffer.data() + end, buffer.size() - end);
+		if (count <= 0)
+			at_end = true;
+		else
+			end += static_cast<std::size_t>(count);
+#else
+		// A line at a time, so a terminal gets an answer after each one
+		if (std::fgets(buffer.data() + end, static_cast<int>(buffer.size() - end), stdin))
+			end += std::strlen(buffer.data() + end);
+		else
+			at_end = true;
+#endif
+	}
+	data = buffer.data();
+}
+
+bool form_reader_t::next(object& form)
+{
+	while (true)
+	{
+		auto status = parse_status::incomplete;
+		// Nothing was read yet, so there's nothing to parse
+		if (data)
+		{
+			auto pos = begin;
+			status = parse_form({ data, end }, pos, at_end, form, position);
+			auto form_line = count_form_lines(data + begin, data + pos, begin_line);
+			if (status == parse_status::form)
+				line = form_line;
+			begin = pos;
+		}
+		if (status == parse_status::form)
+			return true;
+		if (at_end)
+			return false;
+		fill();
+	}
+}
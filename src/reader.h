@@ -0,0 +1,75 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "basic_types.h"
+#include "parser.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CATLANG_POSIX 1
+#else
+#define CATLANG_POSIX 0
+#endif
+
+// A whole file mapped into memory, or read into a buffer where there's no mmap.
+// data is null when the file couldn't be opened or mapped.
+struct mapped_file_t
+{
+	explicit mapped_file_t(const std::string& path);
+	~mapped_file_t();
+	mapped_file_t(const mapped_file_t&) = delete;
+	mapped_file_t& operator =(const mapped_file_t&) = delete;
+
+	const char* data = nullptr;
+	std::size_t size = 0;
+
+private:
+#if !CATLANG_POSIX
+	std::vector<char> buffer;
+#endif
+};
+
+// Hands out the top-level forms of a script one at a time, however many lines
+// each takes. A regular file is mapped and parsed in place, anything else,
+// like the standard input, is read in large blocks and parsed as they arrive.
+struct form_reader_t
+{
+	// Throws if path can't be opened
+	explicit form_reader_t(const std::string& path);
+	// Reads the standard input
+	form_reader_t();
+	~form_reader_t();
+	form_reader_t(const form_reader_t&) = delete;
+	form_reader_t& operator =(const form_reader_t&) = delete;
+
+	// Parses the next form into form, its lists come from the current arena.
+	// False once only whitespace and comments are left.
+	bool next(object& form);
+
+	// Set when the input is a terminal, the REPL's output is flushed after each form then
+	bool interactive = false;
+	// Of the input the form next gave starts on
+	std::size_t line = 1;
+	// The path, or "stdin"
+	std::string name;
+
+private:
+	// Reads more into buffer, sets at_end when there's nothing left
+	void fill();
+
+	std::unique_ptr<mapped_file_t> file;
+	// Descriptor blocks are read from, -1 for a mapped file
+	int fd = -1;
+	bool owns_fd = false;
+
+	std::vector<char> buffer;
+	// What's left to parse is [begin, end) of either the file or buffer
+	const char* data = nullptr;
+	std::size_t begin = 0;
+	std::size_t end = 0;
+	bool at_end = false;
+	// Of data[0] in the input
+	text_position_t position;
+	// Of data[begin] in the input
+	std::size_t begin_line = 1;
+};
@@ -0,0 +1,128 @@
+#include "stats.h"
+#include "compiler.h"
+#include <algorithm>
+#include <iterator>
+#include <mutex>
+
+static const char* const opcode_names[] = {
+	"push_constant", "load_local", "load_enclosing", "load_global", "store_local", "store_enclosing",
+	"store_global", "pop", "jump", "jump_if_false", "jump_if_rebound", "make_lambda", "call", "tail_call", "call_global",
+	"tail_call_global", "return", "print", "vars", "parallel", "profile", "profile_enter", "profile_exit",
+};
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == static_cast<size_t>(opcode::profile_exit) + 1,
+	"every opcode needs a name");
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) <= stat_statement - stat_dispatch,
+	"stat_t needs room for every opcode");
+
+static const char* const stat_names[] = {
+	"globals.lookups",
+	"globals.misses",
+	"call_cache.hits",
+	"call_cache.misses",
+	"variant.copies",
+	"variant.moves",
+	"syntax_list.allocations",
+	"syntax_list.bytes",
+	"heap.objects",
+	"heap.bytes",
+	"list.cells",
+};
+static_assert(sizeof(stat_names) / sizeof(stat_names[0]) == stat_count - stat_global_lookups,
+	"every counter needs a name");
+
+struct stat_registry_t
+{
+	std::mutex mutex;
+	std::vector<stat_block_t*> blocks;
+	// Counted by threads that have exited
+	std::uint64_t retired[stat_count] = {};
+};
+
+static stat_registry_t& get_stat_registry()
+{
+	static stat_registry_t registry;
+	return registry;
+}
+
+// Owns a thread's block, its counts are kept once the thread exits. Nothing
+// is counted while a thread's thread_locals are destroyed, they're only
+// destroyed, so the block can go with it.
+struct stat_block_owner_t
+{
+	stat_block_owner_t()
+	{
+		for (auto&& value : block->values)
+			value.store(0, std::memory_order_relaxed);
+		auto&& registry = get_stat_registry();
+		std::lock_guard<std::mutex> lock{ registry.mutex };
+		registry.blocks.push_back(block);
+	}
+
+	~stat_block_owner_t()
+	{
+		auto&& registry = get_stat_registry();
+		std::lock_guard<std::mutex> lock{ registry.mutex };
+		for (size_t i = 0; i < stat_count; ++i)
+			registry.retired[i] += block->values[i].load(std::memory_order_relaxed);
+		registry.blocks.erase(std::find(registry.blocks.begin(), registry.blocks.end(), block));
+		delete block;
+	}
+
+	stat_block_t* block = new stat_block_t;
+};
+
+stat_block_t* add_stat_block()
+{
+	// The registry has to outlive every owner
+	get_stat_registry();
+	thread_local stat_block_owner_t owner;
+	return owner.block;
+}
+
+dispatch_counts_t::~dispatch_counts_t()
+{
+	auto&& block = get_stat_block();
+	for (size_t i = 0; i < stat_statement - stat_dispatch; ++i)
+	{
+		if (values[i])
+			count_stat(block, stat_dispatch + i, values[i]);
+	}
+}
+
+static std::string get_stat_name(size_t stat)
+{
+	if (stat < stat_statement)
+		return std::string{ "dispatch." } +opcode_names[stat - stat_dispatch];
+	if (stat < stat_global_lookups)
+		return "compile." + get_symbol_name(static_cast<symbol_t>(stat - stat_statement));
+	return stat_names[stat - stat_global_lookups];
+}
+
+std::vector<std::pair<std::string, std::uint64_t>> get_stats()
+{
+	std::uint64_t totals[stat_count];
+	{
+		auto&& registry = get_stat_registry();
+		std::lock_guard<std::mutex> lock{ registry.mutex };
+		std::copy(std::begin(registry.retired), std::end(registry.retired), totals);
+		for (auto&& block : registry.blocks)
+		{
+			for (size_t i = 0; i < stat_count; ++i)
+				totals[i] += block->values[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	std::vector<std::pair<std::string, std::uint64_t>> stats;
+	for (size_t i = 0; i < stat_count; ++i)
+	{
+		if (totals[i])
+			stats.emplace_back(get_stat_name(i), totals[i]);
+	}
+	return stats;
+}
+
+void write_stats(std::ostream& out)
+{
+	for (auto&& stat : get_stats())
+		out << stat.first << ' ' << stat.second << '\n';
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "symbol.h"
+
+// Counters of what the interpreter does, read with (stats) and written to stderr
+// at exit when CATLANG_DUMP_STATS is set. They're compiled in unless the build
+// sets CATLANG_STATS to 0, the CMake option of the same name does.
+//
+// Each thread counts into a block of its own with plain loads and stores, so
+// counting never contends. Reading sums the blocks of every thread, including
+// the ones that have exited.
+#ifndef CATLANG_STATS
+#define CATLANG_STATS 1
+#endif
+
+enum stat_t : std::size_t
+{
+	// Plus an opcode, instructions the interpreter dispatched. Native code isn't counted.
+	stat_dispatch,
+	// Plus a statement's symbol, forms of it the compiler dispatched
+	stat_statement = stat_dispatch + 32,
+	// Looking a global up by name, and not finding it
+	stat_global_lookups = stat_statement + statement_count,
+	stat_global_misses,
+	// Builtin calls through a call_global's inline cache, and refills of it
+	stat_call_cache_hits,
+	stat_call_cache_misses,
+	// Of syntax tree objects
+	stat_variant_copies,
+	stat_variant_moves,
+	// Storage of syntax tree lists, which the arena hands out
+	stat_syntax_list_allocations,
+	stat_syntax_list_bytes,
+	// Objects the collector's heaps allocated, their size without what they own
+	// like string contents, and the cons cells among them
+	stat_heap_objects,
+	stat_heap_bytes,
+	stat_list_cells,
+	stat_count
+};
+
+struct stat_block_t
+{
+	std::atomic<std::uint64_t> values[stat_count];
+};
+
+// Registers a block for this thread the first time it counts
+stat_block_t* add_stat_block();
+
+inline stat_block_t& get_stat_block()
+{
+	// A plain pointer so using it needs no guard
+	thread_local stat_block_t* block = nullptr;
+	if (!block)
+		block = add_stat_block();
+	return *block;
+}
+
+// Only this thread writes block, other threads just read it
+inline void count_stat(stat_block_t& block, std::size_t stat, std::uint64_t amount = 1)
+{
+	auto&& value = block.values[stat];
+	value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Dispatches of one run of the interpreter loop, added to this thread's block
+// when it's destroyed. The loop is too hot to write the block itself, a local
+// array costs it a lot less.
+struct dispatch_counts_t
+{
+	~dispatch_counts_t();
+
+	std::uint64_t values[stat_statement - stat_dispatch] = {};
+};
+
+#if CATLANG_STATS
+#define CATLANG_COUNT(stat) count_stat(get_stat_block(), stat)
+#define CATLANG_COUNT_BY(stat, amount) count_stat(get_stat_block(), stat, amount)
+#else
+#define CATLANG_COUNT(stat) ((void)0)
+#define CATLANG_COUNT_BY(stat, amount) ((void)0)
+#endif
+
+// Name and total of every counter that isn't zero, in stat_t order
+std::vector<std::pair<std::string, std::uint64_t>> get_stats();
+void write_stats(std::ostream& out);
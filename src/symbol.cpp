@@ -0,0 +1,83 @@
+#include "symbol.h"
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <cstring>
+
+// Points into symbol_table_t::names so lookups don't need to build a std::string
+struct name_key
+{
+	const char* data;
+	std::size_t size;
+
+	bool operator ==(const name_key& rhs) const
+	{
+		return size == rhs.size && std::memcmp(data, rhs.data, size) == 0;
+	}
+};
+
+struct name_key_hash
+{
+	std::size_t operator ()(const name_key& key) const
+	{
+		// FNV-1a
+		std::uint64_t hash = 14695981039346656037ull;
+		for (std::size_t i = 0; i < key.size; ++i)
+		{
+			hash ^= static_cast<unsigned char>(key.data[i]);
+			hash *= 1099511628211ull;
+		}
+		return static_cast<std::size_t>(hash);
+	}
+};
+
+struct symbol_table_t
+{
+	symbol_table_t()
+	{
+		const char* fixed_names[] = { "lambda", "def", "set", "cond", "while", "vars", "print", "if",
+			"pmap", "pfor", "preduce", "import", "profile", "guard" };
+		static_assert(sizeof(fixed_names) / sizeof(fixed_names[0]) == statement_count,
+			"every fixed symbol needs a name");
+		for (auto&& name : fixed_names)
+			add(name, std::strlen(name));
+	}
+
+	symbol_t add(const char* data, std::size_t size)
+	{
+		names.emplace_back(data, size);
+		auto&& name = names.back();
+		auto symbol = static_cast<symbol_t>(names.size() - 1);
+		ids.emplace(name_key{ name.data(), name.size() }, symbol);
+		return symbol;
+	}
+
+	std::mutex mutex;
+	// A deque so the strings (and the keys pointing into them) never move
+	std::deque<std::string> names;
+	std::unordered_map<name_key, symbol_t, name_key_hash> ids;
+};
+
+static symbol_table_t& get_symbol_table()
+{
+	static symbol_table_t table;
+	return table;
+}
+
+symbol_t intern(const char* data, std::size_t size)
+{
+	auto&& table = get_symbol_table();
+	std::lock_guard<std::mutex> lock{ table.mutex };
+
+	auto it = table.ids.find(name_key{ data, size });
+	if (it != table.ids.end())
+		return it->second;
+	return table.add(data, size);
+}
+
+const std::string& get_symbol_name(symbol_t symbol)
+{
+	auto&& table = get_symbol_table();
+	std::lock_guard<std::mutex> lock{ table.mutex };
+	return table.names[symbol];
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+using symbol_t = std::uint32_t;
+
+// Symbols interned up front with fixed ids, the statements come first so
+// that any symbol below statement_count names a statement
+enum : symbol_t
+{
+	symbol_lambda,
+	symbol_def,
+	symbol_set,
+	symbol_cond,
+	symbol_while,
+	symbol_vars,
+	symbol_print,
+	symbol_if,
+	symbol_pmap,
+	symbol_pfor,
+	symbol_preduce,
+	symbol_import,
+	symbol_profile,
+	// Only made by the optimizer, the parser reads "guard" as an ordinary name
+	symbol_guard,
+	statement_count
+};
+
+// Returns the id of name, adding it to the process-wide table on first use
+symbol_t intern(const char* data, std::size_t size);
+inline symbol_t intern(const std::string& name) { return intern(name.data(), name.size()); }
+
+const std::string& get_symbol_name(symbol_t symbol);
@@ -0,0 +1,212 @@
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct range_t
+{
+	std::size_t begin;
+	std::size_t end;
+};
+
+// The owner pushes and pops at the back, thieves take from the front where
+// the biggest ranges are
+struct work_queue_t
+{
+	void push(range_t range)
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		ranges.push_back(range);
+	}
+
+	bool pop(range_t& range)
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		if (ranges.empty())
+			return false;
+		range = ranges.back();
+		ranges.pop_back();
+		return true;
+	}
+
+	bool steal(range_t& range)
+	{
+		std::lock_guard<std::mutex> lock{ mutex };
+		if (ranges.empty())
+			return false;
+		range = ranges.front();
+		ranges.pop_front();
+		return true;
+	}
+
+	std::mutex mutex;
+	std::deque<range_t> ranges;
+};
+
+struct thread_pool_t
+{
+	explicit thread_pool_t(std::size_t size)
+		: queues(size)
+	{
+		for (std::size_t i = 1; i < size; ++i)
+			threads.emplace_back([this, i] { wait_for_work(i); });
+	}
+
+	~thread_pool_t()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto&& thread : threads)
+			thread.join();
+	}
+
+	void run(std::size_t count, const thread_pool_body_t& body)
+	{
+		std::unique_lock<std::mutex> busy{ run_mutex, std::try_to_lock };
+		if (!busy || queues.size() == 1)
+		{
+			body(0, 0, count);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			job = &body;
+			remaining = count;
+			++generation;
+		}
+		push(0, { 0, count });
+		wake.notify_all();
+		work(0);
+
+		// Threads that woke up late may still be looking for work
+		std::unique_lock<std::mutex> lock{ mutex };
+		done.wait(lock, [&] { return active == 0; });
+		job = nullptr;
+	}
+
+private:
+	void wait_for_work(std::size_t index)
+	{
+		std::uint64_t seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock{ mutex };
+				wake.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				++active;
+			}
+			work(index);
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				--active;
+			}
+			done.notify_all();
+		}
+	}
+
+	// Runs ranges until every index of the current job is done
+	void work(std::size_t index)
+	{
+		range_t range;
+		while (remaining > 0)
+		{
+			if (!queues[index].pop(range) && !steal(index, range))
+			{
+				// What's left is being run elsewhere, sleep until some of it is
+				// split off or it's all done
+				std::unique_lock<std::mutex> lock{ mutex };
+				++idle;
+				more.wait(lock, [&] { return queued > 0 || remaining == 0; });
+				--idle;
+				continue;
+			}
+			--queued;
+			while (range.end - range.begin > 1)
+			{
+				auto middle = range.begin + (range.end - range.begin) / 2;
+				push(index, { middle, range.end });
+				range.end = middle;
+			}
+			(*job)(index, range.begin, range.end);
+			if ((remaining -= range.end - range.begin) == 0)
+			{
+				std::lock_guard<std::mutex> lock{ mutex };
+				more.notify_all();
+			}
+		}
+	}
+
+	void push(std::size_t index, range_t range)
+	{
+		queues[index].push(range);
+		// Counted before idle is read, a thread going idle meanwhile sees it
+		++queued;
+		if (idle > 0)
+		{
+			std::lock_guard<std::mutex> lock{ mutex };
+			more.notify_one();
+		}
+	}
+
+	bool steal(std::size_t index, range_t& range)
+	{
+		for (std::size_t i = 1; i < queues.size(); ++i)
+		{
+			if (queues[(index + i) % queues.size()].steal(range))
+				return true;
+		}
+		return false;
+	}
+
+	std::vector<work_queue_t> queues;
+	std::vector<std::thread> threads;
+
+	// Held by whoever is running a job
+	std::mutex run_mutex;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	// Signalled when a range is queued or the job is done, for threads in work() with nothing to run
+	std::condition_variable more;
+	bool stopping = false;
+	// Bumped for every job, threads compare it to tell a new one from the last
+	std::uint64_t generation = 0;
+	// Threads other than the caller inside work()
+	std::size_t active = 0;
+	const thread_pool_body_t* job = nullptr;
+	// Indices not done yet
+	std::atomic<std::size_t> remaining{ 0 };
+	// Ranges in the queues, and threads in work() waiting for one
+	std::atomic<std::size_t> queued{ 0 };
+	std::atomic<std::size_t> idle{ 0 };
+};
+
+std::size_t thread_pool_size()
+{
+	static const std::size_t size = []
+	{
+		if (auto threads = std::getenv("CATLANG_THREADS"))
+			return std::max<std::size_t>(1, std::strtoull(threads, nullptr, 10));
+		return std::max<std::size_t>(1, std::thread::hardware_concurrency());
+	}();
+	return size;
+}
+
+void thread_pool_run(std::size_t count, const thread_pool_body_t& body)
+{
+	static thread_pool_t pool{ thread_pool_size() };
+	pool.run(count, body);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// A process-wide pool with a thread per core, started the first time it's used.
+// Work is split lazily: a thread that takes a range keeps halving it and leaves
+// the other halves in its own queue, idle threads steal from the far end of
+// the others' queues.
+
+// Threads that run work, counting the one that calls thread_pool_run.
+// CATLANG_THREADS overrides the core count.
+std::size_t thread_pool_size();
+
+using thread_pool_body_t = std::function<void(std::size_t thread, std::size_t begin, std::size_t end)>;
+
+// Calls body for disjoint ranges covering [0, count) and returns once they're all
+// done. thread tells the threads apart, it's below thread_pool_size() and 0 for
+// the caller. body mustn't throw. The pool runs one call at a time, a call made
+// while it's busy runs everything on the calling thread.
+void thread_pool_run(std::size_t count, const thread_pool_body_t& body);
@@ -1,4 +1,6 @@
 #include "util.h"
+#include <cstdlib>
+#include <limits>
 
 std::string slice(const std::string& expr, int start, int end)
 {
@@ -15,22 +17,60 @@ list_t slice(const list_t& list, int start, int end)
 	return list_t{ list.begin() + start, list.end() - (list.size() - end) };
 }
 
-std::pair<bool, int64_t> string_to_int64(const std::string& str)
+std::pair<bool, int64_t> string_to_int64(string_ref str)
 {
-	char* endptr = nullptr;
-	auto ret = strtoll(str.data(), &endptr, 10);
-	if (endptr != str.data() + str.length())
+	auto pos = str.data;
+	auto end = str.data + str.size;
+	auto negative = false;
+
+	if (pos != end && (*pos == '-' || *pos == '+'))
+		negative = *pos++ == '-';
+	if (pos == end)
 		return{ false, 0 };
 
+	// Accumulate as a negative number so INT64_MIN is representable
+	int64_t ret = 0;
+	for (; pos != end; ++pos)
+	{
+		if (*pos < '0' || *pos > '9')
+			return{ false, 0 };
+		auto digit = *pos - '0';
+		if (ret < (std::numeric_limits<int64_t>::min() + digit) / 10)
+			return{ false, 0 };
+		ret = ret * 10 - digit;
+	}
+
+	if (!negative)
+	{
+		if (ret == std::numeric_limits<int64_t>::min())
+			return{ false, 0 };
+		ret = -ret;
+	}
+
 	return{ true, ret };
 }
 
-std::pair<bool, double> string_to_double(const std::string& str)
+std::pair<bool, double> string_to_double(string_ref str)
 {
+	// strtod needs a terminated string, tokens are views into the source
+	char buffer[64];
+	std::string long_token;
+	const char* terminated = buffer;
+	if (str.size < sizeof(buffer))
+	{
+		std::copy(str.data, str.data + str.size, buffer);
+		buffer[str.size] = '\0';
+	}
+	else
+	{
+		long_token = str.to_string();
+		terminated = long_token.c_str();
+	}
+
 	char* endptr = nullptr;
-	auto ret = strtod(str.data(), &endptr);
-	if (endptr != str.data() + str.length())
+	auto ret = strtod(terminated, &endptr);
+	if (str.size == 0 || endptr != terminated + str.size)
 		return{ false, 0 };
 
 	return{ true, ret };
-}
\ No newline at end of file
+}
@@ -2,8 +2,23 @@
 
 #include <string>
 #include <cstdint>
+#include <cstddef>
 #include "basic_types.h"
 
+// Non-owning view of a character range, the source buffer has to outlive it
+struct string_ref
+{
+	string_ref(const char* data, std::size_t size)
+		: data(data), size(size) {}
+	string_ref(const std::string& str)
+		: data(str.data()), size(str.size()) {}
+
+	std::string to_string() const { return{ data, size }; }
+
+	const char* data;
+	std::size_t size;
+};
+
 std::string slice(const std::string& expr, int start, int end);
 list_t slice(const list_t& list, int start, int end);
 template <typename T>
@@ -11,5 +26,5 @@ auto slice(T&& expr, int start) {
 	return slice(expr, start, static_cast<int>(expr.size()));
 }
 
-std::pair<bool, int64_t> string_to_int64(const std::string& str);
-std::pair<bool, double> string_to_double(const std::string& str);
\ No newline at end of file
+std::pair<bool, int64_t> string_to_int64(string_ref str);
+std::pair<bool, double> string_to_double(string_ref str);
@@ -0,0 +1,261 @@
+#include "value.h"
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include "compiler.h"
+#include "vector.h"
+#include "heap_profiler.h"
+
+const char* get_type_name(value_type type)
+{
+	switch (type)
+	{
+	case value_type::nil: return "nil";
+	case value_type::boolean: return "bool";
+	case value_type::int64: return "int";
+	case value_type::double_: return "double";
+	case value_type::symbol: return "symbol";
+	case value_type::string: return "string";
+	case value_type::list: return "list";
+	case value_type::lambda: return "lambda";
+	case value_type::builtin: return "builtin";
+	case value_type::int_vector: return "int vector";
+	case value_type::double_vector: return "double vector";
+	case value_type::frame: return "frame";
+	}
+	return "unknown";
+}
+
+void destroy_object(heap_object_t* object)
+{
+	if (object->site && heap_profiler)
+		heap_profiler->remove(*object);
+	switch (object->type)
+	{
+	case value_type::int64: delete static_cast<int64_object*>(object); break;
+	case value_type::string: delete static_cast<string_object*>(object); break;
+	case value_type::list: delete static_cast<list_object*>(object); break;
+	case value_type::lambda: delete static_cast<lambda_object*>(object); break;
+	case value_type::builtin: delete static_cast<builtin_object*>(object); break;
+	case value_type::int_vector: delete static_cast<int_vector_object*>(object); break;
+	case value_type::double_vector: delete static_cast<double_vector_object*>(object); break;
+	case value_type::frame: delete static_cast<frame_t*>(object); break;
+	default: assert(false);
+	}
+}
+
+std::uint64_t value_t::box_int(int64_t value)
+{
+	return make_bits(tag_object, reinterpret_cast<std::uintptr_t>(make_object<int64_object>(value)));
+}
+
+value_t::value_t(heap_object_t* object)
+	: bits(make_bits(tag_object, reinterpret_cast<std::uintptr_t>(object)))
+{
+	assert(reinterpret_cast<std::uintptr_t>(object) <= payload_mask);
+}
+
+value_type value_t::get_type() const
+{
+	if (is_double())
+		return value_type::double_;
+
+	switch (get_tag())
+	{
+	case tag_nil: return value_type::nil;
+	case tag_bool: return value_type::boolean;
+	case tag_int: return value_type::int64;
+	case tag_symbol: return value_type::symbol;
+	case tag_empty_list: return value_type::list;
+	default: return get_object()->type;
+	}
+}
+
+value_t to_value(const object& obj)
+{
+	if (obj.is_type<nil_t>())
+		return nil_t{};
+	if (obj.is_type<bool>())
+		return obj.get_ref<bool>();
+	if (obj.is_type<int64_t>())
+		return obj.get_ref<int64_t>();
+	if (obj.is_type<double>())
+		return obj.get_ref<double>();
+	if (obj.is_type<std::string>())
+		return make_value<string_object>(obj.get_ref<std::string>());
+	if (obj.is_type<statement>())
+		return value_t::symbol(obj.get_ref<statement>().symbol);
+	if (obj.is_type<variable_reference>())
+		return value_t::symbol(obj.get_ref<variable_reference>().symbol);
+
+	auto&& list = obj.get_ref<list_t>();
+	auto ret = value_t::empty_list();
+	for (auto it = list.rbegin(); it != list.rend(); ++it)
+		ret = cons(to_value(*it), ret);
+	return ret;
+}
+
+list_object::list_object(value_t head, value_t tail)
+	: heap_object_t(value_type::list), head(head), tail(tail), length(list_length(tail) + 1) {}
+
+std::size_t list_length(const value_t& list)
+{
+	return list.is_empty_list() ? 0 : list.get_object<list_object>().length;
+}
+
+value_t cons(value_t head, value_t tail)
+{
+	return make_value<list_object>(head, tail);
+}
+
+value_t make_list(const value_t* first, const value_t* last)
+{
+	auto ret = value_t::empty_list();
+	while (last != first)
+		ret = cons(*--last, ret);
+	return ret;
+}
+
+value_t slice(const value_t& list, std::size_t start, std::size_t end)
+{
+	auto it = &list;
+	for (auto i = 0u; i < start; ++i)
+		it = &it->get_object<list_object>().tail;
+	if (end == list_length(list))
+		return *it;
+
+	std::vector<value_t> items;
+	items.reserve(end - start);
+	for (auto i = start; i < end; ++i)
+	{
+		items.push_back(it->get_object<list_object>().head);
+		it = &it->get_object<list_object>().tail;
+	}
+	return make_list(items.data(), items.data() + items.size());
+}
+
+template <typename T>
+static void print_items(std::ostream& lhs, const std::vector<T>& items)
+{
+	lhs << "[ ";
+	for (auto&& item : items)
+		lhs << item << " ";
+	lhs << "]";
+}
+
+// Prints without the trailing space, operator << adds it to match how objects print
+static void print_value(std::ostream& lhs, const value_t& rhs)
+{
+	switch (rhs.get_type())
+	{
+	case value_type::nil:
+		lhs << "(nil)";
+		break;
+	case value_type::boolean:
+		lhs << rhs.get_bool();
+		break;
+	case value_type::int64:
+		lhs << rhs.get_int();
+		break;
+	case value_type::double_:
+		lhs << rhs.get_double();
+		break;
+	case value_type::symbol:
+		lhs << get_symbol_name(rhs.get_symbol());
+		break;
+	case value_type::string:
+		lhs << rhs.get_object<string_object>().value;
+		break;
+	case value_type::list:
+		lhs << "{ ";
+		for_each_item(rhs, [&](const value_t& item) {
+			print_value(lhs, item);
+			lhs << " ";
+		});
+		lhs << "}";
+		break;
+	case value_type::lambda:
+	{
+		auto&& function = *rhs.get_object<lambda_object>().function;
+		lhs << "lambda: {parameters:";
+		for (auto&& item : function.parameters)
+			lhs << " " << get_symbol_name(item);
+		lhs << '\n';
+		lhs << ", body: " << function.body << "}\n";
+		break;
+	}
+	case value_type::builtin:
+		lhs << "(builtin func)";
+		break;
+	case value_type::int_vector:
+		print_items(lhs, rhs.get_object<int_vector_object>().items);
+		break;
+	case value_type::double_vector:
+		print_items(lhs, rhs.get_object<double_vector_object>().items);
+		break;
+	case value_type::frame:
+		lhs << "(frame)";
+		break;
+	}
+}
+
+std::ostream& operator <<(std::ostream& lhs, const value_t& rhs)
+{
+	print_value(lhs, rhs);
+	lhs << " ";
+	return lhs;
+}
+
+void throw_type_error(const char* op, const value_t& lhs, const value_t& rhs)
+{
+	throw std::runtime_error{ std::string{ "Can't " } +op + " types " + get_type_name(lhs.get_type())
+		+ " and " + get_type_name(rhs.get_type()) };
+}
+
+void throw_overflow_error(const char* op)
+{
+	throw std::runtime_error{ std::string{ "Integer overflow in " } +op };
+}
+
+#define MAKE_MIXED_OP(op, name, int_result) \
+value_t name##_mixed(const value_t& lhs, const value_t& rhs) \
+{ \
+	if (is_vector(lhs) || is_vector(rhs)) \
+		return apply_vector_op(arithmetic_op::name, lhs, rhs); \
+	if (!lhs.is_number() || !rhs.is_number()) \
+		throw_type_error(#op, lhs, rhs); \
+	if (lhs.is_double() || rhs.is_double()) \
+		return value_t{ lhs.get_number() op rhs.get_number() }; \
+	auto a = lhs.get_int(); \
+	auto b = rhs.get_int(); \
+	return value_t{ int_result }; \
+}
+
+MAKE_MIXED_OP(+, add, checked_add(a, b))
+MAKE_MIXED_OP(-, subtract, checked_subtract(a, b))
+MAKE_MIXED_OP(*, multiply, checked_multiply(a, b))
+MAKE_MIXED_OP(<, less, a < b)
+MAKE_MIXED_OP(>, greater, a > b)
+MAKE_MIXED_OP(<=, less_equal, a <= b)
+MAKE_MIXED_OP(>=, greater_equal, a >= b)
+
+#undef MAKE_MIXED_OP
+
+value_t operator /(const value_t& lhs, const value_t& rhs)
+{
+	if (lhs.is_double() && rhs.is_double())
+		return lhs.get_double() / rhs.get_double();
+	if (is_vector(lhs) || is_vector(rhs))
+		return apply_vector_op(arithmetic_op::divide, lhs, rhs);
+	if (!lhs.is_number() || !rhs.is_number())
+		throw_type_error("/", lhs, rhs);
+	if (lhs.is_double() || rhs.is_double())
+		return lhs.get_number() / rhs.get_number();
+	auto a = lhs.get_int();
+	auto b = rhs.get_int();
+	if (b == 0)
+		throw std::runtime_error{ "Division by zero" };
+	if (a == INT64_MIN && b == -1)
+		throw_overflow_error("/");
+	return a / b;
+}
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <iosfwd>
+#include <type_traits>
+#include "basic_types.h"
+#include "symbol.h"
+
+enum class value_type : std::uint8_t
+{
+	nil,
+	boolean,
+	int64,
+	double_,
+	symbol,
+	string,
+	list,
+	lambda,
+	builtin,
+	int_vector,
+	double_vector,
+	// Never held by a value_t, only by lambdas and the VM
+	frame,
+};
+
+const char* get_type_name(value_type type);
+
+// Header shared by everything a value_t can point to. Only type is needed to
+// find the real type, see destroy_object.
+struct heap_object_t
+{
+	explicit heap_object_t(value_type type)
+		: type(type) {}
+
+	value_type type;
+	bool marked = false;
+	// Of the heap profiler's site that made it, 0 when it wasn't accounted
+	std::uint16_t site = 0;
+	// id of the heap_t that owns it
+	std::uint32_t heap = 0;
+	// Next object in the heap it was allocated in
+	heap_object_t* next = nullptr;
+};
+
+void destroy_object(heap_object_t* object);
+
+struct value_t;
+struct function_t;
+
+// Owns every heap object allocated while it's current. Nothing is freed until a
+// collection: the owner marks everything it can reach from its roots, then sweep
+// frees whatever wasn't marked. Marking is precise since value_t knows which
+// of its bits are pointers.
+//
+// Objects of other heaps are never marked or traced. The threads of a parallel
+// form each allocate in their own heap and point into the VM's, which adopts
+// theirs once they're done.
+struct heap_t
+{
+	heap_t();
+	heap_t(const heap_t&) = delete;
+	heap_t& operator =(const heap_t&) = delete;
+	~heap_t();
+
+	void add(heap_object_t* object, std::size_t size);
+
+	// Whether enough was allocated since the last collection to make one worth it
+	bool should_collect() const { return allocated >= threshold; }
+	// For native code that checks should_collect itself
+	const std::size_t& get_threshold() const { return threshold; }
+	void mark(const value_t& value);
+	void mark(heap_object_t* object);
+	// Constants are allocated in the heap like anything else, so they're only kept
+	// alive by the functions that use them
+	void mark(const function_t& function);
+	// Traces everything reachable from what was marked and frees the rest
+	void sweep();
+	bool owns(const heap_object_t* object) const { return object->heap == id; }
+	// Takes over every object of other, which is left empty
+	void adopt(heap_t& other);
+
+	std::size_t object_count = 0;
+	std::size_t allocated = 0;
+
+	// Heap new objects go to on this thread. Threads that never install one get a
+	// private heap that's never collected and only freed when the thread exits.
+	static heap_t& current();
+
+private:
+	friend struct heap_scope_t;
+
+	const std::uint32_t id;
+	heap_object_t* objects = nullptr;
+	std::size_t threshold = 1 << 20;
+	// Marked objects whose children haven't been marked yet
+	std::vector<heap_object_t*> gray;
+};
+
+// Makes heap the current one until the scope ends
+struct heap_scope_t
+{
+	explicit heap_scope_t(heap_t& heap);
+	~heap_scope_t();
+	heap_scope_t(const heap_scope_t&) = delete;
+	heap_scope_t& operator =(const heap_scope_t&) = delete;
+
+	heap_t* previous;
+};
+
+// A runtime value in 8 bytes. Doubles are stored as they are, everything else
+// lives in the negative quiet NaN space: nil, bools, symbols, the empty list and
+// ints that fit in 48 bits are stored inline, anything bigger is a pointer to a
+// heap_object_t owned by a heap_t. Copying one is copying 8 bytes.
+struct value_t
+{
+	value_t() : bits(make_bits(tag_nil, 0)) {}
+	value_t(nil_t) : value_t() {}
+	value_t(bool value) : bits(make_bits(tag_bool, value ? 1 : 0)) {}
+	// Would otherwise convert to bool, strings are made with make_value<string_object>
+	value_t(const char*) = delete;
+	value_t(int value) : value_t(int64_t{ value }) {}
+	value_t(int64_t value)
+		: bits(value >= min_small_int && value <= max_small_int ? make_bits(tag_int, static_cast<std::uint64_t>(value)) : box_int(value)) {}
+	value_t(double value)
+	{
+		// Every NaN is stored as the positive quiet NaN so none of them collide with the
+		// boxed values. Checked on the bits since -ffast-math lets std::isnan fold to false.
+		std::memcpy(&bits, &value, sizeof(bits));
+		if ((bits & 0x7ff0000000000000ull) == 0x7ff0000000000000ull && (bits & 0x000fffffffffffffull) != 0)
+			bits = 0x7ff8000000000000ull;
+	}
+	explicit value_t(heap_object_t* object);
+
+	static value_t symbol(symbol_t symbol) { return value_t{ make_bits(tag_symbol, symbol), raw_tag{} }; }
+	static value_t empty_list() { return value_t{ make_bits(tag_empty_list, 0), raw_tag{} }; }
+
+	value_type get_type() const;
+
+	bool is_double() const { return (bits & boxed_prefix) != boxed_prefix; }
+	bool is_nil() const { return bits == make_bits(tag_nil, 0); }
+	bool is_bool() const { return get_tag() == tag_bool; }
+	bool is_small_int() const { return get_tag() == tag_int; }
+	bool is_int() const { return is_small_int() || is_object(value_type::int64); }
+	bool is_number() const { return is_double() || is_int(); }
+	bool is_symbol() const { return get_tag() == tag_symbol; }
+	bool is_empty_list() const { return bits == make_bits(tag_empty_list, 0); }
+	bool is_list() const { return is_empty_list() || is_object(value_type::list); }
+	bool is_object() const { return get_tag() == tag_object; }
+	bool is_object(value_type type) const { return is_object() && get_object()->type == type; }
+
+	bool get_bool() const { return (bits & payload_mask) != 0; }
+	int64_t get_int() const;
+	// Only for is_small_int() values, skips the check for a boxed one
+	int64_t get_small_int() const { return static_cast<int64_t>(bits << 16) >> 16; }
+	double get_double() const
+	{
+		double ret;
+		std::memcpy(&ret, &bits, sizeof(ret));
+		return ret;
+	}
+	// Either kind of number as a double
+	double get_number() const { return is_double() ? get_double() : static_cast<double>(get_int()); }
+	symbol_t get_symbol() const { return static_cast<symbol_t>(bits & payload_mask); }
+	heap_object_t* get_object() const { return reinterpret_cast<heap_object_t*>(bits & payload_mask); }
+	template <typename T>
+	T& get_object() const { return *static_cast<T*>(get_object()); }
+
+	static constexpr int64_t min_small_int = -(int64_t{ 1 } << 47);
+	static constexpr int64_t max_small_int = (int64_t{ 1 } << 47) - 1;
+
+private:
+	struct raw_tag {};
+	value_t(std::uint64_t bits, raw_tag) : bits(bits) {}
+
+	static constexpr std::uint64_t boxed_prefix = 0xfff8000000000000ull;
+	static constexpr std::uint64_t payload_mask = 0x0000ffffffffffffull;
+	static constexpr std::uint64_t tag_nil = 1;
+	static constexpr std::uint64_t tag_bool = 2;
+	static constexpr std::uint64_t tag_int = 3;
+	static constexpr std::uint64_t tag_symbol = 4;
+	static constexpr std::uint64_t tag_object = 5;
+	static constexpr std::uint64_t tag_empty_list = 6;
+
+	static constexpr std::uint64_t make_bits(std::uint64_t tag, std::uint64_t payload)
+	{
+		return boxed_prefix | (tag << 48) | (payload & payload_mask);
+	}
+	// Allocates the int64_object for ints that don't fit in 48 bits
+	static std::uint64_t box_int(int64_t value);
+	// Only meaningful when !is_double()
+	std::uint64_t get_tag() const { return is_double() ? 0 : (bits >> 48) & 7; }
+
+	std::uint64_t bits;
+};
+
+static_assert(sizeof(value_t) == 8, "value_t has to stay 8 bytes");
+static_assert(std::is_trivially_copyable<value_t>::value, "the collector relies on value_t being plain bits");
+
+// Local variables of one lambda invocation that a closure captured, addressed by slot
+struct frame_t : heap_object_t
+{
+	frame_t(std::size_t slot_count, frame_t* parent)
+		: heap_object_t(value_type::frame), slots(slot_count), parent(parent) {}
+
+	std::vector<value_t> slots;
+	frame_t* parent;
+};
+
+using builtin_func_t = value_t (*)(const value_t* args, std::size_t count);
+// A builtin bound by the host that carries state, see interpreter_t::set
+using host_func_t = std::function<value_t(const value_t* args, std::size_t count)>;
+
+struct int64_object : heap_object_t
+{
+	explicit int64_object(int64_t value)
+		: heap_object_t(value_type::int64), value(value) {}
+
+	int64_t value;
+};
+
+inline int64_t value_t::get_int() const
+{
+	return is_small_int() ? get_small_int() : get_object<int64_object>().value;
+}
+
+struct string_object : heap_object_t
+{
+	explicit string_object(std::string value)
+		: heap_object_t(value_type::string), value(std::move(value)) {}
+
+	std::string value;
+};
+
+// A cons cell. Lists are persistent: cons, tail and slicing off the front share
+// the cells they didn't change.
+struct list_object : heap_object_t
+{
+	list_object(value_t head, value_t tail);
+
+	value_t head;
+	// Either another list_object or the empty list
+	value_t tail;
+	std::size_t length;
+};
+
+struct lambda_object : heap_object_t
+{
+	lambda_object(std::shared_ptr<const function_t> function, frame_t* frame)
+		: heap_object_t(value_type::lambda), function(std::move(function)), frame(frame) {}
+
+	std::shared_ptr<const function_t> function;
+	// Frame the lambda was created in, null when it doesn't capture anything
+	frame_t* frame;
+};
+
+struct builtin_object : heap_object_t
+{
+	builtin_object(symbol_t name, builtin_func_t function)
+		: heap_object_t(value_type::builtin), name(name), function(function) {}
+	builtin_object(symbol_t name, host_func_t host)
+		: heap_object_t(value_type::builtin), name(name), function(nullptr), host(std::move(host)) {}
+
+	// Name it was registered under, kept when the value is bound to other names
+	symbol_t name;
+	// Null for a host function, which is called through host instead
+	builtin_func_t function;
+	host_func_t host;
+};
+
+// Numbers stored contiguously so arithmetic on all of them can use SIMD, see vector.h
+template <typename T, value_type type_id>
+struct vector_object : heap_object_t
+{
+	using element_type = T;
+
+	explicit vector_object(std::size_t size)
+		: heap_object_t(type_id), items(size) {}
+
+	std::vector<T> items;
+};
+
+using int_vector_object = vector_object<int64_t, value_type::int_vector>;
+using double_vector_object = vector_object<double, value_type::double_vector>;
+
+template <typename T, typename... Ts>
+T* make_object(Ts&&... args)
+{
+	auto object = new T(std::forward<Ts>(args)...);
+	heap_t::current().add(object, sizeof(T));
+	return object;
+}
+
+template <typename T, typename... Ts>
+value_t make_value(Ts&&... args)
+{
+	return value_t{ make_object<T>(std::forward<Ts>(args)...) };
+}
+
+// Converts a literal or quoted list from the AST, names become symbols
+value_t to_value(const object& obj);
+
+std::size_t list_length(const value_t& list);
+value_t cons(value_t head, value_t tail);
+// Builds a list out of [first, last)
+value_t make_list(const value_t* first, const value_t* last);
+// Elements [start, end) of list. Shares the cells after start when end is the
+// length, otherwise copies the ones in the range.
+value_t slice(const value_t& list, std::size_t start, std::size_t end);
+
+template <typename fn_t>
+void for_each_item(const value_t& list, fn_t&& fn)
+{
+	for (auto it = &list; !it->is_empty_list(); )
+	{
+		auto&& cell = it->get_object<list_object>();
+		fn(cell.head);
+		it = &cell.tail;
+	}
+}
+
+std::ostream& operator <<(std::ostream& lhs, const value_t& rhs);
+
+[[noreturn]] void throw_type_error(const char* op, const value_t& lhs, const value_t& rhs);
+
+[[noreturn]] void throw_overflow_error(const char* op);
+
+// int64_t arithmetic that throws instead of wrapping around
+inline int64_t checked_add(int64_t lhs, int64_t rhs)
+{
+	int64_t result;
+#ifdef _MSC_VER
+	result = static_cast<int64_t>(static_cast<std::uint64_t>(lhs) + static_cast<std::uint64_t>(rhs));
+	if ((lhs < 0) == (rhs < 0) && (result < 0) != (lhs < 0))
+#else
+	if (__builtin_add_overflow(lhs, rhs, &result))
+#endif
+		throw_overflow_error("+");
+	return result;
+}
+
+inline int64_t checked_subtract(int64_t lhs, int64_t rhs)
+{
+	int64_t result;
+#ifdef _MSC_VER
+	result = static_cast<int64_t>(static_cast<std::uint64_t>(lhs) - static_cast<std::uint64_t>(rhs));
+	if ((lhs < 0) != (rhs < 0) && (result < 0) != (lhs < 0))
+#else
+	if (__builtin_sub_overflow(lhs, rhs, &result))
+#endif
+		throw_overflow_error("-");
+	return result;
+}
+
+inline int64_t checked_multiply(int64_t lhs, int64_t rhs)
+{
+	int64_t result;
+#ifdef _MSC_VER
+	result = static_cast<int64_t>(static_cast<std::uint64_t>(lhs) * static_cast<std::uint64_t>(rhs));
+	if ((lhs == -1 && rhs == INT64_MIN) || (rhs == -1 && lhs == INT64_MIN)
+		|| (lhs != 0 && lhs != -1 && result / lhs != rhs))
+#else
+	if (__builtin_mul_overflow(lhs, rhs, &result))
+#endif
+		throw_overflow_error("*");
+	return result;
+}
+
+// Two small ints and two doubles are handled inline, mixed operands and boxed
+// ints go through the out of line name##_mixed. Small ints are 48 bits, so only
+// their products can overflow.
+#define MAKE_VALUE_OP(op, name, small_int_result) \
+value_t name##_mixed(const value_t& lhs, const value_t& rhs); \
+inline value_t operator op(const value_t& lhs, const value_t& rhs) \
+{ \
+	if (lhs.is_small_int() && rhs.is_small_int()) \
+	{ \
+		auto a = lhs.get_small_int(); \
+		auto b = rhs.get_small_int(); \
+		return value_t{ small_int_result }; \
+	} \
+	if (lhs.is_double() && rhs.is_double()) \
+		return value_t{ lhs.get_double() op rhs.get_double() }; \
+	return name##_mixed(lhs, rhs); \
+}
+
+MAKE_VALUE_OP(+, add, a + b)
+MAKE_VALUE_OP(-, subtract, a - b)
+MAKE_VALUE_OP(*, multiply, checked_multiply(a, b))
+MAKE_VALUE_OP(<, less, a < b)
+MAKE_VALUE_OP(>, greater, a > b)
+MAKE_VALUE_OP(<=, less_equal, a <= b)
+MAKE_VALUE_OP(>=, greater_equal, a >= b)
+
+#undef MAKE_VALUE_OP
+
+value_t operator /(const value_t& lhs, const value_t& rhs);
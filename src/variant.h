@@ -5,6 +5,9 @@
 #include <new>
 #include <cassert>
 #include <memory>
+#include <tuple>
+#include <cstring>
+#include "stats.h"
 
 template <typename T>
 struct identity
@@ -83,9 +86,15 @@ struct unique_ptr_with_copy : std::unique_ptr<T>
 		: std::unique_ptr<T>(std::move(src)) {}
 
 	unique_ptr_with_copy(const unique_ptr_with_copy& src)
+		: std::unique_ptr<T>(std::make_unique<T>(*src.get())) {}
+	unique_ptr_with_copy(unique_ptr_with_copy&&) = default;
+
+	unique_ptr_with_copy& operator =(const unique_ptr_with_copy& src)
 	{
-		*this = std::make_unique<T>(*src.get());
+		std::unique_ptr<T>::operator =(std::make_unique<T>(*src.get()));
+		return *this;
 	}
+	unique_ptr_with_copy& operator =(unique_ptr_with_copy&&) = default;
 };
 
 template <typename T>
@@ -117,28 +126,61 @@ struct variant_impl
 		this->construct(std::forward<T>(obj));
 	}
 
+	// Copies, moves and destruction dispatch through tables indexed by type_index,
+	// with scalars handled inline since they are by far the most common
 	variant_impl(const variant_impl& src) {
-		src.visit([&](auto&& val) { this->construct(std::forward<decltype(val)>(val)); });
+		using copier_t = void (*)(char*, const char*);
+		static constexpr copier_t copiers[] = { &copy<Ts>... };
+		static constexpr bool trivial[] = { std::is_trivially_copyable<Ts>::value... };
+		CATLANG_COUNT(stat_variant_copies);
+		type_index = src.type_index;
+		if (trivial[type_index])
+			std::memcpy(buffer, src.buffer, size);
+		else
+			copiers[type_index](buffer, src.buffer);
 	}
-	variant_impl(variant_impl&& src) {
-		src.visit([&](auto&& val) { this->construct(std::forward<decltype(val)>(val)); });
+	// Steals the payload, heap wrapped values keep their allocation. Has to be noexcept
+	// for std::vector to move instead of copy when it grows.
+	variant_impl(variant_impl&& src) noexcept {
+		using mover_t = void (*)(variant_impl&, variant_impl&);
+		static constexpr mover_t movers[] = { &mover<Ts>::move... };
+		static constexpr bool trivial[] = { std::is_trivially_copyable<Ts>::value... };
+		CATLANG_COUNT(stat_variant_moves);
+		type_index = src.type_index;
+		if (trivial[type_index])
+			std::memcpy(buffer, src.buffer, size);
+		else
+			movers[type_index](*this, src);
 	}
 
-	variant_impl& operator =(const variant_impl& src) { return assign(src); }
-	variant_impl& operator =(variant_impl&& src) { return assign(std::move(src)); }
+	variant_impl& operator =(const variant_impl& src)
+	{
+		if (this != &src)
+			assign(variant_impl{ src });
+		return *this;
+	}
+	variant_impl& operator =(variant_impl&& src) noexcept
+	{
+		if (this != &src)
+			assign(std::move(src));
+		return *this;
+	}
 
+	// Destroys the stored alternative itself rather than what visit hands out,
+	// so heap wrapped values free their allocation
 	~variant_impl()
 	{
-		visit([&](auto&& val) {
-			using type = std::remove_reference_t<decltype(val)>;
-			val.~type();
-		});
+		using destroyer_t = void (*)(char*);
+		static constexpr destroyer_t destroyers[] = { &destroy<Ts>... };
+		static constexpr bool trivial[] = { std::is_trivially_destructible<Ts>::value... };
+		if (!trivial[type_index])
+			destroyers[type_index](buffer);
 	}
 
 	template <typename fn_t>
-	void visit(fn_t&& fn) { visit_impl<fn_t, 0, Ts...>(std::forward<fn_t>(fn)); }
+	void visit(fn_t&& fn) { visit_impl<fn_t>(std::forward<fn_t>(fn)); }
 	template <typename fn_t>
-	void visit(fn_t&& fn) const { visit_impl<fn_t, 0, Ts...>(std::forward<fn_t>(fn)); }
+	void visit(fn_t&& fn) const { visit_impl<fn_t>(std::forward<fn_t>(fn)); }
 
 	template <typename T, typename = std::enable_if_t<
 		any_of<(std::is_same<substitute_heap_wrapper_t<T>, Ts>::value
@@ -207,6 +249,45 @@ private:
 		return *this;
 	}
 
+	template <typename T>
+	static void copy(char* buffer, const char* src)
+	{
+		new (buffer) T(reinterpret_cast<const T&>(*src));
+	}
+
+	template <typename T>
+	static void destroy(char* buffer)
+	{
+		reinterpret_cast<T&>(*buffer).~T();
+	}
+
+	template <typename T>
+	struct mover
+	{
+		static void move(variant_impl& dst, variant_impl& src)
+		{
+			new (dst.buffer) T(std::move(reinterpret_cast<T&>(src.buffer)));
+		}
+	};
+
+	// A moved-from heap_wrapper holds null, which visit can't deal with, so the
+	// source is left holding a default constructed first alternative instead
+	template <typename T>
+	struct mover<heap_wrapper<T>>
+	{
+		static void move(variant_impl& dst, variant_impl& src)
+		{
+			using first_t = std::tuple_element_t<0, std::tuple<Ts...>>;
+			static_assert(std::is_nothrow_default_constructible<first_t>::value,
+				"the first alternative is the moved-from state and has to be default constructible");
+
+			new (dst.buffer) heap_wrapper<T>(std::move(reinterpret_cast<heap_wrapper<T>&>(src.buffer)));
+			destroy<heap_wrapper<T>>(src.buffer);
+			new (src.buffer) first_t();
+			src.type_index = 0;
+		}
+	};
+
 	template <typename T>
 	void set_index() { type_index = get_index_of_type<T>(); }
 
@@ -238,27 +319,24 @@ private:
 		}
 	};
 
-	template <typename fn_t, int cur_type_index, typename cur_type, typename... rest>
+	// One entry per alternative, indexed by type_index
+	template <typename fn_t>
 	void visit_impl(fn_t&& fn)
 	{
-		if (cur_type_index == type_index)
-			dummy<fn_t, cur_type>::call_visitor(std::forward<fn_t>(fn), buffer);
-		else
-			visit_impl<fn_t, cur_type_index + 1, rest...>(std::forward<fn_t>(fn));
+		using caller_t = void (*)(fn_t&&, char*);
+		static constexpr caller_t callers[] = { &dummy<fn_t, Ts>::template call_visitor<char>... };
+		assert(type_index >= 0 && type_index < static_cast<int>(sizeof...(Ts)));
+		callers[type_index](std::forward<fn_t>(fn), buffer);
 	}
-	template <typename fn_t, int cur_type_index>
-	void visit_impl(fn_t&&) { assert(false); }
 
-	template <typename fn_t, int cur_type_index, typename cur_type, typename... rest>
+	template <typename fn_t>
 	void visit_impl(fn_t&& fn) const
 	{
-		if (cur_type_index == type_index)
-			dummy<fn_t, const cur_type>::call_visitor(std::forward<fn_t>(fn), buffer);
-		else
-			visit_impl<fn_t, cur_type_index + 1, rest...>(std::forward<fn_t>(fn));
+		using caller_t = void (*)(fn_t&&, const char*);
+		static constexpr caller_t callers[] = { &dummy<fn_t, const Ts>::template call_visitor<const char>... };
+		assert(type_index >= 0 && type_index < static_cast<int>(sizeof...(Ts)));
+		callers[type_index](std::forward<fn_t>(fn), buffer);
 	}
-	template <typename fn_t, int cur_type_index>
-	void visit_impl(fn_t&&) const { assert(false); }
 
 	int type_index;
 	alignas(alignment) char buffer[size];
@@ -0,0 +1,555 @@
+#include "vector.h"
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "vm.h"
+
+// Kernels are plain loops the compiler vectorizes. Each one is compiled twice,
+// for AVX2 and for the baseline target, and the AVX2 version is picked at
+// runtime when the CPU has it.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define KERNEL_INLINE __attribute__((always_inline)) inline
+
+static bool has_avx2()
+{
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+
+#define MAKE_KERNEL(ret, name, params, args) \
+__attribute__((target("avx2"))) static ret name##_avx2 params { return name##_impl args; } \
+static ret name params { return has_avx2() ? name##_avx2 args : name##_impl args; }
+#else
+#define KERNEL_INLINE inline
+#define MAKE_KERNEL(ret, name, params, args) static ret name params { return name##_impl args; }
+#endif
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef __int128 int128_t;
+#endif
+
+// Which operands of an element-wise op are vectors, the other one is a single number
+enum class shape_t
+{
+	vectors,
+	scalar_lhs,
+	scalar_rhs,
+};
+
+template <bool scalar_lhs, bool scalar_rhs, typename T, typename R, typename op_t>
+KERNEL_INLINE void map_loop(const T* __restrict lhs, const T* __restrict rhs, R* __restrict out,
+	std::size_t count, op_t& op)
+{
+	for (std::size_t i = 0; i < count; ++i)
+		out[i] = op(lhs[scalar_lhs ? 0 : i], rhs[scalar_rhs ? 0 : i]);
+}
+
+template <typename T, typename R, typename op_t>
+KERNEL_INLINE void map(const T* lhs, const T* rhs, R* out, std::size_t count, shape_t shape, op_t&& op)
+{
+	switch (shape)
+	{
+	case shape_t::vectors: map_loop<false, false>(lhs, rhs, out, count, op); break;
+	case shape_t::scalar_lhs: map_loop<true, false>(lhs, rhs, out, count, op); break;
+	case shape_t::scalar_rhs: map_loop<false, true>(lhs, rhs, out, count, op); break;
+	}
+}
+
+// Int + and - wrap and remember whether any element overflowed, so the loop stays
+// free of branches and the whole vector is checked once
+struct add_op
+{
+	int64_t operator ()(int64_t a, int64_t b)
+	{
+		auto result = static_cast<int64_t>(static_cast<std::uint64_t>(a) + static_cast<std::uint64_t>(b));
+		overflow |= static_cast<std::uint64_t>((a ^ result) & (b ^ result));
+		return result;
+	}
+	std::uint64_t overflow = 0;
+};
+
+struct subtract_op
+{
+	int64_t operator ()(int64_t a, int64_t b)
+	{
+		auto result = static_cast<int64_t>(static_cast<std::uint64_t>(a) - static_cast<std::uint64_t>(b));
+		overflow |= static_cast<std::uint64_t>((a ^ b) & (a ^ result));
+		return result;
+	}
+	std::uint64_t overflow = 0;
+};
+
+// There's no 64-bit multiply in AVX2, so this one stays scalar and throws right away
+struct multiply_op
+{
+	int64_t operator ()(int64_t a, int64_t b) const { return checked_multiply(a, b); }
+};
+
+KERNEL_INLINE void map_doubles_impl(arithmetic_op op, const double* lhs, const double* rhs, double* out,
+	std::size_t count, shape_t shape)
+{
+	switch (op)
+	{
+	case arithmetic_op::add: map(lhs, rhs, out, count, shape, std::plus<double>{}); break;
+	case arithmetic_op::subtract: map(lhs, rhs, out, count, shape, std::minus<double>{}); break;
+	case arithmetic_op::multiply: map(lhs, rhs, out, count, shape, std::multiplies<double>{}); break;
+	case arithmetic_op::divide: map(lhs, rhs, out, count, shape, std::divides<double>{}); break;
+	default: break;
+	}
+}
+
+template <typename T>
+KERNEL_INLINE void compare_impl(arithmetic_op op, const T* lhs, const T* rhs, int64_t* out,
+	std::size_t count, shape_t shape)
+{
+	switch (op)
+	{
+	case arithmetic_op::less: map(lhs, rhs, out, count, shape, std::less<T>{}); break;
+	case arithmetic_op::greater: map(lhs, rhs, out, count, shape, std::greater<T>{}); break;
+	case arithmetic_op::less_equal: map(lhs, rhs, out, count, shape, std::less_equal<T>{}); break;
+	case arithmetic_op::greater_equal: map(lhs, rhs, out, count, shape, std::greater_equal<T>{}); break;
+	default: break;
+	}
+}
+
+KERNEL_INLINE void compare_doubles_impl(arithmetic_op op, const double* lhs, const double* rhs, int64_t* out,
+	std::size_t count, shape_t shape)
+{
+	compare_impl(op, lhs, rhs, out, count, shape);
+}
+
+// Division isn't handled here, there's no SIMD instruction for it. Returns false on overflow.
+KERNEL_INLINE bool map_ints_impl(arithmetic_op op, const int64_t* lhs, const int64_t* rhs, int64_t* out,
+	std::size_t count, shape_t shape)
+{
+	switch (op)
+	{
+	case arithmetic_op::add:
+	{
+		add_op add;
+		map(lhs, rhs, out, count, shape, add);
+		return static_cast<int64_t>(add.overflow) >= 0;
+	}
+	case arithmetic_op::subtract:
+	{
+		subtract_op subtract;
+		map(lhs, rhs, out, count, shape, subtract);
+		return static_cast<int64_t>(subtract.overflow) >= 0;
+	}
+	case arithmetic_op::multiply:
+		map(lhs, rhs, out, count, shape, multiply_op{});
+		return true;
+	default:
+		compare_impl(op, lhs, rhs, out, count, shape);
+		return true;
+	}
+}
+
+KERNEL_INLINE double sum_doubles_impl(const double* items, std::size_t count)
+{
+	double sum = 0;
+	for (std::size_t i = 0; i < count; ++i)
+		sum += items[i];
+	return sum;
+}
+
+// Returns false if the sum doesn't fit in an int64_t
+KERNEL_INLINE bool sum_ints_impl(const int64_t* items, std::size_t count, int64_t& result)
+{
+#ifdef __SIZEOF_INT128__
+	// The low and high 32 bits are summed separately so neither sum can overflow
+	// within a block, the exact total is put back together in 128 bits
+	const std::size_t block_size = std::size_t{ 1 } << 31;
+	int128_t total = 0;
+	for (std::size_t start = 0; start < count; start += block_size)
+	{
+		auto end = count - start > block_size ? start + block_size : count;
+		std::uint64_t low = 0;
+		std::uint64_t high = 0;
+		std::uint64_t negative = 0;
+		for (auto i = start; i < end; ++i)
+		{
+			auto bits = static_cast<std::uint64_t>(items[i]);
+			low += bits & 0xffffffff;
+			high += bits >> 32;
+			negative += bits >> 63;
+		}
+		total += (static_cast<int128_t>(high) << 32) + low - (static_cast<int128_t>(negative) << 64);
+	}
+	if (total < std::numeric_limits<int64_t>::min() || total > std::numeric_limits<int64_t>::max())
+		return false;
+	result = static_cast<int64_t>(total);
+	return true;
+#else
+	int64_t sum = 0;
+	for (std::size_t i = 0; i < count; ++i)
+		sum = checked_add(sum, items[i]);
+	result = sum;
+	return true;
+#endif
+}
+
+// count has to be at least 1
+template <typename T>
+KERNEL_INLINE T min_impl(const T* items, std::size_t count)
+{
+	auto min = items[0];
+	for (std::size_t i = 1; i < count; ++i)
+		min = items[i] < min ? items[i] : min;
+	return min;
+}
+
+template <typename T>
+KERNEL_INLINE T max_impl(const T* items, std::size_t count)
+{
+	auto max = items[0];
+	for (std::size_t i = 1; i < count; ++i)
+		max = items[i] > max ? items[i] : max;
+	return max;
+}
+
+KERNEL_INLINE double min_doubles_impl(const double* items, std::size_t count) { return min_impl(items, count); }
+KERNEL_INLINE double max_doubles_impl(const double* items, std::size_t count) { return max_impl(items, count); }
+KERNEL_INLINE int64_t min_ints_impl(const int64_t* items, std::size_t count) { return min_impl(items, count); }
+KERNEL_INLINE int64_t max_ints_impl(const int64_t* items, std::size_t count) { return max_impl(items, count); }
+
+KERNEL_INLINE double dot_doubles_impl(const double* lhs, const double* rhs, std::size_t count)
+{
+	double sum = 0;
+	for (std::size_t i = 0; i < count; ++i)
+		sum += lhs[i] * rhs[i];
+	return sum;
+}
+
+// The caller checks that the last element doesn't overflow
+template <typename T>
+KERNEL_INLINE void range_impl(T start, T step, T* out, std::size_t count)
+{
+	for (std::size_t i = 0; i < count; ++i)
+		out[i] = start + static_cast<T>(i) * step;
+}
+
+KERNEL_INLINE void range_doubles_impl(double start, double step, double* out, std::size_t count) { range_impl(start, step, out, count); }
+KERNEL_INLINE void range_ints_impl(int64_t start, int64_t step, int64_t* out, std::size_t count) { range_impl(start, step, out, count); }
+
+MAKE_KERNEL(void, map_doubles, (arithmetic_op op, const double* lhs, const double* rhs, double* out, std::size_t count, shape_t shape), (op, lhs, rhs, out, count, shape))
+MAKE_KERNEL(void, compare_doubles, (arithmetic_op op, const double* lhs, const double* rhs, int64_t* out, std::size_t count, shape_t shape), (op, lhs, rhs, out, count, shape))
+MAKE_KERNEL(bool, map_ints, (arithmetic_op op, const int64_t* lhs, const int64_t* rhs, int64_t* out, std::size_t count, shape_t shape), (op, lhs, rhs, out, count, shape))
+MAKE_KERNEL(double, sum_doubles, (const double* items, std::size_t count), (items, count))
+MAKE_KERNEL(bool, sum_ints, (const int64_t* items, std::size_t count, int64_t& result), (items, count, result))
+MAKE_KERNEL(double, min_doubles, (const double* items, std::size_t count), (items, count))
+MAKE_KERNEL(double, max_doubles, (const double* items, std::size_t count), (items, count))
+MAKE_KERNEL(int64_t, min_ints, (const int64_t* items, std::size_t count), (items, count))
+MAKE_KERNEL(int64_t, max_ints, (const int64_t* items, std::size_t count), (items, count))
+MAKE_KERNEL(double, dot_doubles, (const double* lhs, const double* rhs, std::size_t count), (lhs, rhs, count))
+MAKE_KERNEL(void, range_doubles, (double start, double step, double* out, std::size_t count), (start, step, out, count))
+MAKE_KERNEL(void, range_ints, (int64_t start, int64_t step, int64_t* out, std::size_t count), (start, step, out, count))
+
+#undef MAKE_KERNEL
+#undef KERNEL_INLINE
+
+// Vectors are accounted with their elements so big ones bring the next collection closer
+template <typename T>
+static T* make_vector(std::size_t size)
+{
+	auto vector = make_object<T>(size);
+	heap_t::current().allocated += size * sizeof(typename T::element_type);
+	return vector;
+}
+
+std::size_t vector_length(const value_t& vector)
+{
+	if (vector.is_object(value_type::int_vector))
+		return vector.get_object<int_vector_object>().items.size();
+	return vector.get_object<double_vector_object>().items.size();
+}
+
+static const char* get_op_name(arithmetic_op op)
+{
+	switch (op)
+	{
+	case arithmetic_op::add: return "+";
+	case arithmetic_op::subtract: return "-";
+	case arithmetic_op::multiply: return "*";
+	case arithmetic_op::divide: return "/";
+	case arithmetic_op::less: return "<";
+	case arithmetic_op::greater: return ">";
+	case arithmetic_op::less_equal: return "<=";
+	case arithmetic_op::greater_equal: return ">=";
+	}
+	return "?";
+}
+
+static bool has_doubles(const value_t& value)
+{
+	return value.is_double() || value.is_object(value_type::double_vector);
+}
+
+// The elements of a vector or number as doubles, converted into buffer when they aren't already
+static const double* get_doubles(const value_t& value, std::vector<double>& buffer)
+{
+	if (value.is_object(value_type::double_vector))
+		return value.get_object<double_vector_object>().items.data();
+	if (value.is_object(value_type::int_vector))
+	{
+		auto&& items = value.get_object<int_vector_object>().items;
+		buffer.assign(items.begin(), items.end());
+	}
+	else
+		buffer.assign(1, value.get_number());
+	return buffer.data();
+}
+
+static const int64_t* get_ints(const value_t& value, int64_t& scalar)
+{
+	if (value.is_object(value_type::int_vector))
+		return value.get_object<int_vector_object>().items.data();
+	scalar = value.get_int();
+	return &scalar;
+}
+
+static value_t divide_ints(const int64_t* lhs, const int64_t* rhs, std::size_t count, shape_t shape)
+{
+	auto result = make_vector<int_vector_object>(count);
+	auto out = result->items.data();
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		auto a = lhs[shape == shape_t::scalar_lhs ? 0 : i];
+		auto b = rhs[shape == shape_t::scalar_rhs ? 0 : i];
+		if (b == 0)
+			throw std::runtime_error{ "Division by zero" };
+		if (a == std::numeric_limits<int64_t>::min() && b == -1)
+			throw_overflow_error("/");
+		out[i] = a / b;
+	}
+	return value_t{ result };
+}
+
+value_t apply_vector_op(arithmetic_op op, const value_t& lhs, const value_t& rhs)
+{
+	auto name = get_op_name(op);
+	if ((!is_vector(lhs) && !lhs.is_number()) || (!is_vector(rhs) && !rhs.is_number()))
+		throw_type_error(name, lhs, rhs);
+
+	auto shape = !is_vector(lhs) ? shape_t::scalar_lhs : !is_vector(rhs) ? shape_t::scalar_rhs : shape_t::vectors;
+	auto count = vector_length(shape == shape_t::scalar_lhs ? rhs : lhs);
+	if (shape == shape_t::vectors && vector_length(rhs) != count)
+		throw std::runtime_error{ std::string{ "Vector lengths don't match in " } +name };
+	auto comparison = op >= arithmetic_op::less;
+
+	if (has_doubles(lhs) || has_doubles(rhs))
+	{
+		std::vector<double> lhs_buffer;
+		std::vector<double> rhs_buffer;
+		auto lhs_items = get_doubles(lhs, lhs_buffer);
+		auto rhs_items = get_doubles(rhs, rhs_buffer);
+		if (comparison)
+		{
+			auto result = make_vector<int_vector_object>(count);
+			compare_doubles(op, lhs_items, rhs_items, result->items.data(), count, shape);
+			return value_t{ result };
+		}
+		auto result = make_vector<double_vector_object>(count);
+		map_doubles(op, lhs_items, rhs_items, result->items.data(), count, shape);
+		return value_t{ result };
+	}
+
+	int64_t lhs_scalar;
+	int64_t rhs_scalar;
+	auto lhs_items = get_ints(lhs, lhs_scalar);
+	auto rhs_items = get_ints(rhs, rhs_scalar);
+	if (op == arithmetic_op::divide)
+		return divide_ints(lhs_items, rhs_items, count, shape);
+	auto result = make_vector<int_vector_object>(count);
+	if (!map_ints(op, lhs_items, rhs_items, result->items.data(), count, shape))
+		throw_overflow_error(name);
+	return value_t{ result };
+}
+
+static const value_t& get_vector_argument(const char* name, const value_t& value)
+{
+	if (!is_vector(value))
+		throw std::runtime_error{ std::string{ name } +" expects a vector, got " + get_type_name(value.get_type()) };
+	return value;
+}
+
+// An int vector when every item is an int, a double vector otherwise
+static value_t make_vector_from(const char* name, const value_t* first, const value_t* last)
+{
+	auto doubles = false;
+	for (auto it = first; it != last; ++it)
+	{
+		if (!it->is_number())
+			throw std::runtime_error{ std::string{ name } +" expects numbers, got " + get_type_name(it->get_type()) };
+		doubles = doubles || it->is_double();
+	}
+
+	auto count = static_cast<std::size_t>(last - first);
+	if (doubles)
+	{
+		auto result = make_vector<double_vector_object>(count);
+		for (std::size_t i = 0; i < count; ++i)
+			result->items[i] = first[i].get_number();
+		return value_t{ result };
+	}
+	auto result = make_vector<int_vector_object>(count);
+	for (std::size_t i = 0; i < count; ++i)
+		result->items[i] = first[i].get_int();
+	return value_t{ result };
+}
+
+// (vector a b c ...)
+static value_t builtin_vector(const value_t* args, size_t count)
+{
+	return make_vector_from("vector", args, args + count);
+}
+
+static value_t builtin_to_vector(const value_t* args, size_t count)
+{
+	check_argument_count("to-vector", count, 1, 1);
+	if (is_vector(args[0]))
+		return args[0];
+	if (!args[0].is_list())
+		throw std::runtime_error{ std::string{ "to-vector expects a list, got " } +get_type_name(args[0].get_type()) };
+	std::vector<value_t> items;
+	items.reserve(list_length(args[0]));
+	for_each_item(args[0], [&](const value_t& item) { items.push_back(item); });
+	return make_vector_from("to-vector", items.data(), items.data() + items.size());
+}
+
+static value_t builtin_to_list(const value_t* args, size_t count)
+{
+	check_argument_count("to-list", count, 1, 1);
+	auto&& vector = get_vector_argument("to-list", args[0]);
+	std::vector<value_t> items;
+	if (vector.is_object(value_type::int_vector))
+	{
+		auto&& source = vector.get_object<int_vector_object>().items;
+		items.assign(source.begin(), source.end());
+	}
+	else
+	{
+		auto&& source = vector.get_object<double_vector_object>().items;
+		items.assign(source.begin(), source.end());
+	}
+	return make_list(items.data(), items.data() + items.size());
+}
+
+// (range end), (range start end) or (range start end step), end is excluded
+static value_t builtin_range(const value_t* args, size_t count)
+{
+	check_argument_count("range", count, 1, 3);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!args[i].is_number())
+			throw std::runtime_error{ std::string{ "range expects numbers, got " } +get_type_name(args[i].get_type()) };
+	}
+	auto start = count >= 2 ? args[0] : value_t{ 0 };
+	auto end = count >= 2 ? args[1] : args[0];
+	auto step = count == 3 ? args[2] : value_t{ 1 };
+
+	if (start.is_int() && end.is_int() && step.is_int())
+	{
+		auto first = start.get_int();
+		auto last = end.get_int();
+		auto increment = step.get_int();
+		if (increment == 0)
+			throw std::runtime_error{ "range step can't be 0" };
+		// Computed in unsigned so the distance between any two int64_t fits
+		std::uint64_t size = 0;
+		if (increment > 0 && last > first)
+			size = (static_cast<std::uint64_t>(last) - static_cast<std::uint64_t>(first) - 1) / static_cast<std::uint64_t>(increment) + 1;
+		else if (increment < 0 && last < first)
+			size = (static_cast<std::uint64_t>(first) - static_cast<std::uint64_t>(last) - 1) / (0 - static_cast<std::uint64_t>(increment)) + 1;
+		auto result = make_vector<int_vector_object>(static_cast<std::size_t>(size));
+		range_ints(first, increment, result->items.data(), result->items.size());
+		return value_t{ result };
+	}
+
+	auto first = start.get_number();
+	auto increment = step.get_number();
+	if (increment == 0)
+		throw std::runtime_error{ "range step can't be 0" };
+	auto steps = (end.get_number() - first) / increment;
+	if (!(steps <= static_cast<double>(std::numeric_limits<std::uint32_t>::max()) * 16))
+		throw std::runtime_error{ "range is too long" };
+	auto size = steps > 0 ? static_cast<std::size_t>(std::ceil(steps)) : 0;
+	auto result = make_vector<double_vector_object>(size);
+	range_doubles(first, increment, result->items.data(), size);
+	return value_t{ result };
+}
+
+static value_t builtin_sum(const value_t* args, size_t count)
+{
+	check_argument_count("sum", count, 1, 1);
+	auto&& vector = get_vector_argument("sum", args[0]);
+	if (vector.is_object(value_type::double_vector))
+	{
+		auto&& items = vector.get_object<double_vector_object>().items;
+		return sum_doubles(items.data(), items.size());
+	}
+	auto&& items = vector.get_object<int_vector_object>().items;
+	int64_t sum;
+	if (!sum_ints(items.data(), items.size(), sum))
+		throw_overflow_error("sum");
+	return sum;
+}
+
+#define MAKE_EXTREMUM_BUILTIN(name) \
+static value_t builtin_##name(const value_t* args, size_t count) \
+{ \
+	check_argument_count(#name, count, 1, 1); \
+	auto&& vector = get_vector_argument(#name, args[0]); \
+	if (vector_length(vector) == 0) \
+		throw std::runtime_error{ #name " of an empty vector" }; \
+	if (vector.is_object(value_type::double_vector)) \
+	{ \
+		auto&& items = vector.get_object<double_vector_object>().items; \
+		return name##_doubles(items.data(), items.size()); \
+	} \
+	auto&& items = vector.get_object<int_vector_object>().items; \
+	return name##_ints(items.data(), items.size()); \
+}
+
+MAKE_EXTREMUM_BUILTIN(min)
+MAKE_EXTREMUM_BUILTIN(max)
+
+#undef MAKE_EXTREMUM_BUILTIN
+
+static value_t builtin_dot(const value_t* args, size_t count)
+{
+	check_argument_count("dot", count, 2, 2);
+	auto size = vector_length(get_vector_argument("dot", args[0]));
+	if (vector_length(get_vector_argument("dot", args[1])) != size)
+		throw std::runtime_error{ "Vector lengths don't match in dot" };
+
+	if (has_doubles(args[0]) || has_doubles(args[1]))
+	{
+		std::vector<double> lhs_buffer;
+		std::vector<double> rhs_buffer;
+		return dot_doubles(get_doubles(args[0], lhs_buffer), get_doubles(args[1], rhs_buffer), size);
+	}
+	// Checked like scalar ints, AVX2 has no 64-bit multiply to vectorize this with
+	auto&& lhs = args[0].get_object<int_vector_object>().items;
+	auto&& rhs = args[1].get_object<int_vector_object>().items;
+	int64_t sum = 0;
+	for (std::size_t i = 0; i < size; ++i)
+		sum = checked_add(sum, checked_multiply(lhs[i], rhs[i]));
+	return sum;
+}
+
+void add_vector_builtins(vm_t& vm)
+{
+	vm.add_builtin("vector", builtin_vector);
+	vm.add_builtin("to-vector", builtin_to_vector);
+	vm.add_builtin("to-list", builtin_to_list);
+	vm.add_builtin("range", builtin_range);
+	vm.add_builtin("sum", builtin_sum);
+	vm.add_builtin("min", builtin_min);
+	vm.add_builtin("max", builtin_max);
+	vm.add_builtin("dot", builtin_dot);
+}
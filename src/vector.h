@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include "value.h"
+
+struct vm_t;
+
+enum class arithmetic_op
+{
+	add,
+	subtract,
+	multiply,
+	divide,
+	less,
+	greater,
+	less_equal,
+	greater_equal,
+};
+
+inline bool is_vector(const value_t& value)
+{
+	return value.is_object(value_type::int_vector) || value.is_object(value_type::double_vector);
+}
+
+std::size_t vector_length(const value_t& vector);
+
+// Applies op to every element. One side may be a plain number, it's used with
+// every element of the other. Ints are promoted to doubles when the other side
+// has doubles, comparisons give an int vector of 0s and 1s.
+value_t apply_vector_op(arithmetic_op op, const value_t& lhs, const value_t& rhs);
+
+// vector, to-vector, to-list, range, sum, min, max and dot
+void add_vector_builtins(vm_t& vm);
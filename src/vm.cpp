@@ -0,0 +1,688 @@
+#include "vm.h"
+#include "profiler.h"
+#include "heap_profiler.h"
+#include "stats.h"
+#include <iostream>
+#include <stdexcept>
+
+static bool is_truthy(const value_t& value)
+{
+	switch (value.get_type())
+	{
+	case value_type::list: return true;
+	case value_type::int_vector: return true;
+	case value_type::double_vector: return true;
+	case value_type::nil: return false;
+	case value_type::boolean: return value.get_bool();
+	case value_type::int64: return value.get_int() != 0;
+	case value_type::double_: return value.get_double() != 0;
+	case value_type::string: throw std::runtime_error("Can't convert string to bool");
+	default: throw std::runtime_error("Unknown type");
+	}
+}
+
+void vm_t::add_variable(const std::string& name, value_t value)
+{
+	auto count = globals.size();
+	auto&& global = globals[intern(name)];
+	if (heap_profiler && globals.size() != count)
+		heap_profiler->add_binding();
+	global.value = value;
+	++global.version;
+}
+
+void vm_t::add_builtin(const std::string& name, builtin_func_t function)
+{
+	heap_scope_t scope{ heap };
+	auto symbol = intern(name);
+	auto&& global = globals[symbol];
+	global.value = make_value<builtin_object>(symbol, function);
+	++global.version;
+}
+
+void vm_t::add_host_builtin(const std::string& name, host_func_t function)
+{
+	heap_scope_t scope{ heap };
+	auto symbol = intern(name);
+	auto&& global = globals[symbol];
+	global.value = make_value<builtin_object>(symbol, std::move(function));
+	++global.version;
+}
+
+void vm_t::add_root(const std::shared_ptr<const function_t>& function)
+{
+	roots.push_back(function);
+}
+
+void check_argument_count(const char* name, size_t count, size_t min, size_t max)
+{
+	if (count < min || count > max)
+		throw std::runtime_error{ std::string{ "Wrong number of arguments to " } +name };
+}
+
+static frame_t& get_enclosing_frame(const call_frame_t& frame, std::uint16_t depth)
+{
+	auto environment = frame.environment;
+	for (; depth; --depth)
+		environment = environment->parent;
+	return *environment;
+}
+
+void vm_t::collect_garbage()
+{
+	for (auto&& value : stack)
+		heap.mark(value);
+	for (auto&& frame : frames)
+	{
+		heap.mark(frame.environment);
+		heap.mark(*frame.function);
+	}
+	for (auto it = roots.begin(); it != roots.end(); )
+	{
+		if (auto function = it->lock())
+		{
+			heap.mark(*function);
+			++it;
+		}
+		else
+			it = roots.erase(it);
+	}
+	// A parallel task can't have put anything of its own in them
+	if (!parent)
+	{
+		for (auto&& pair : globals)
+			heap.mark(pair.second.value);
+	}
+	heap.sweep();
+}
+
+global_t& vm_t::lookup_global(symbol_t name)
+{
+	auto&& globals = root().globals;
+	CATLANG_COUNT(stat_global_lookups);
+	auto it = globals.find(name);
+	if (it == globals.end())
+	{
+		CATLANG_COUNT(stat_global_misses);
+		throw std::runtime_error{ "Undefined variable " + get_symbol_name(name) };
+	}
+	return it->second;
+}
+
+// The binding names[index] refers to, looked up once per function
+global_t& vm_t::get_global(const function_t& function, std::int32_t index)
+{
+	auto&& global = function.resolved_globals[index];
+	if (global)
+		return *global;
+	auto&& found = lookup_global(function.names[index]);
+	if (!shared)
+		global = &found;
+	return found;
+}
+
+value_t vm_t::pop()
+{
+	auto ret = std::move(stack.back());
+	stack.pop_back();
+	return ret;
+}
+
+void vm_t::call(size_t argument_count)
+{
+	auto base = stack.size() - argument_count - 1;
+	auto&& callee = stack[base];
+
+	if (callee.is_object(value_type::lambda))
+	{
+		auto&& lambda = callee.get_object<lambda_object>();
+		auto&& function = *lambda.function;
+		if (function.parameters.size() != argument_count)
+			throw std::runtime_error{ "Wrong number of arguments to lambda" };
+		if (frames.size() >= max_call_depth)
+			throw std::runtime_error{ "Maximum call depth of " + std::to_string(max_call_depth) + " exceeded" };
+
+		if (!function.has_environment)
+		{
+			// Nothing can outlive the call, the arguments already sit in the first slots
+			stack.resize(base + 1 + function.locals.size());
+			frames.push_back({ &function, 0, base, lambda.frame });
+			if (heap_profiler)
+				set_allocation_site(function.name);
+			if (profiler)
+				profiler->enter(function.name, frames.size(), false);
+			else if (jit_enabled && !heap_profiler)
+				run_native(function, base);
+			return;
+		}
+
+		// The frame is the callee's
+		if (heap_profiler)
+			set_allocation_site(function.name);
+		auto environment = make_object<frame_t>(function.locals.size(), lambda.frame);
+		std::copy(stack.begin() + base + 1, stack.end(), environment->slots.begin());
+		frames.push_back({ &function, 0, base, environment });
+		if (profiler)
+			profiler->enter(function.name, frames.size(), false);
+		return;
+	}
+
+	if (callee.is_object(value_type::builtin))
+	{
+		auto&& builtin = callee.get_object<builtin_object>();
+		// Runs one deeper than the caller's frame, like a lambda would
+		if (profiler)
+			profiler->enter(builtin.name, frames.size() + 1, false);
+		allocation_site_t caller_site{};
+		if (heap_profiler)
+		{
+			caller_site = get_allocation_site();
+			set_allocation_site(caller_site.function, builtin.name, caller_site.line);
+		}
+		value_t result;
+		if (builtin.function)
+			result = builtin.function(stack.data() + base + 1, argument_count);
+		else
+		{
+			// A host function may call back into the VM and grow the stack under
+			// its arguments. They stay on the stack too, where the collector sees them.
+			std::vector<value_t> arguments(stack.begin() + base + 1, stack.end());
+			result = builtin.host(arguments.data(), argument_count);
+		}
+		if (heap_profiler)
+			get_allocation_site() = caller_site;
+		if (profiler)
+			profiler->leave(frames.size() + 1);
+		stack.erase(stack.begin() + base, stack.end());
+		stack.push_back(std::move(result));
+		return;
+	}
+
+	// A single value in parentheses evaluates to itself
+	if (argument_count == 0)
+		return;
+
+	throw std::runtime_error{ std::string{ "Can't call value of type " } +get_type_name(callee.get_type()) };
+}
+
+static const std::uint32_t max_native_compilations = 4;
+static const size_t max_native_depth = 1000;
+
+static std::uint8_t get_profile_bits(const value_t& value)
+{
+	if (value.is_small_int())
+		return jit_profile_int;
+	if (value.is_double())
+		return jit_profile_double;
+	return jit_profile_other;
+}
+
+static bool has_type(const value_t& value, jit_type type)
+{
+	switch (type)
+	{
+	case jit_type::int_: return value.is_small_int();
+	case jit_type::double_: return value.is_double();
+	case jit_type::bool_: return value.is_bool();
+	default: return true;
+	}
+}
+
+// Runs the frame call just pushed for function in native code once it's hot.
+// Either the call returns and leaves its result at base like a builtin would,
+// or the frames native code didn't finish are left for the interpreter.
+void vm_t::run_native(const function_t& function, size_t base)
+{
+	auto&& jit = function.jit;
+	auto arguments = stack.data() + base + 1;
+	auto&& parameters = function.parameters;
+	auto record_types = [&]
+	{
+		jit.argument_types.resize(parameters.size());
+		for (size_t i = 0; i < parameters.size(); ++i)
+			jit.argument_types[i] |= get_profile_bits(arguments[i]);
+	};
+
+	// While other threads may run the function its state is only read
+	if (!jit.code)
+	{
+		if (shared || jit.compilations >= max_native_compilations)
+			return;
+		record_types();
+		if (++jit.calls < jit_threshold || !compile_native(function))
+			return;
+	}
+
+	auto&& code = *jit.code;
+	for (size_t i = 0; i < parameters.size(); ++i)
+	{
+		if (has_type(arguments[i], code.parameter_types[i]))
+			continue;
+		if (shared)
+			return;
+		// Specialized to the wrong types, start profiling again for code that takes both
+		record_types();
+		if (++jit.guard_failures >= jit_threshold)
+		{
+			jit.retired.push_back(std::move(jit.code));
+			jit.calls = 0;
+			jit.guard_failures = 0;
+		}
+		return;
+	}
+	if (native_depth >= max_native_depth)
+		return;
+
+	auto frame = frames.size() - 1;
+	stack.resize(base + code.frame_size);
+	++native_depth;
+	auto status = code.entry(this, stack.data() + base);
+	--native_depth;
+
+	if (!status)
+	{
+		stack.resize(base + 1);
+		frames.pop_back();
+		return;
+	}
+	auto pc = status >> 2;
+	switch (status & 3)
+	{
+	case jit_exit_deopt:
+		frames[frame].pc = pc;
+		stack.resize(base + 1 + function.locals.size() + code.depths[pc]);
+		break;
+	case jit_exit_call:
+		frames[frame].pc = pc;
+		break;
+	default:
+	{
+		auto exception = native_exception;
+		native_exception = nullptr;
+		std::rethrow_exception(exception);
+	}
+	}
+}
+
+bool vm_t::compile_native(const function_t& function)
+{
+	auto&& jit = function.jit;
+	std::vector<jit_type> types;
+	for (auto bits : jit.argument_types)
+	{
+		types.push_back(bits == jit_profile_int ? jit_type::int_
+			: bits == jit_profile_double ? jit_type::double_ : jit_type::unknown);
+	}
+	++jit.compilations;
+	// Native code outlives parallel tasks, so it only refers to the VM they run for
+	auto&& owner = root();
+	jit.code = jit_compile(function, types, { &owner, &owner.heap, &owner.running_parallel, native_call, native_safe_point });
+	if (!jit.code)
+		jit.compilations = max_native_compilations;
+	return jit.code != nullptr;
+}
+
+std::uint64_t vm_t::native_call(vm_t* vm, value_t** frame, size_t top, size_t argument_count, size_t frame_size)
+{
+	auto&& stack = vm->stack;
+	auto base = static_cast<size_t>(*frame - stack.data());
+	stack.resize(base + top);
+	auto depth = vm->frames.size();
+	try
+	{
+		if (vm->heap.should_collect())
+			vm->collect_garbage();
+		vm->call(argument_count);
+	}
+	catch (...)
+	{
+		// Native code has no unwind information, so this can't be thrown through it
+		vm->native_exception = std::current_exception();
+		return jit_exit_exception;
+	}
+	if (vm->frames.size() > depth)
+		return jit_exit_call;
+	stack.resize(base + frame_size);
+	*frame = stack.data() + base;
+	return 0;
+}
+
+void vm_t::native_safe_point(vm_t* vm, value_t** frame, size_t top, size_t frame_size)
+{
+	auto&& stack = vm->stack;
+	auto base = static_cast<size_t>(*frame - stack.data());
+	stack.resize(base + top);
+	vm->collect_garbage();
+	stack.resize(base + frame_size);
+	*frame = stack.data() + base;
+}
+
+// Calls the builtin cache remembers if its global wasn't rebound since, any
+// other callee is left to the caller's normal call. Otherwise the cache is
+// refilled and the caller makes a normal call.
+bool vm_t::call_cached(call_cache_t& cache, const function_t& function, size_t argument_count)
+{
+	if (cache.global && cache.global->version == cache.version)
+	{
+		CATLANG_COUNT(stat_call_cache_hits);
+		// Calling a lambda only pushes its frame. A profiled call has to go
+		// through call to be seen, and so does one heap profiled.
+		if (!cache.builtin || profiler || heap_profiler)
+			return false;
+		auto base = stack.size() - argument_count - 1;
+		auto result = cache.builtin(stack.data() + base + 1, argument_count);
+		stack.resize(base);
+		stack.push_back(result);
+		return true;
+	}
+
+	if (shared)
+		return false;
+	CATLANG_COUNT(stat_call_cache_misses);
+	cache.global = &get_global(function, cache.name);
+	cache.version = cache.global->version;
+	auto&& callee = cache.global->value;
+	cache.builtin = callee.is_object(value_type::builtin) ? callee.get_object<builtin_object>().function : nullptr;
+	return false;
+}
+
+value_t vm_t::execute(const std::shared_ptr<const function_t>& function)
+{
+	heap_scope_t scope{ heap };
+	// A host function may run code while other code is running, that goes on above it
+	auto depth = frames.size();
+	auto base = stack.size();
+	allocation_site_t caller_site{};
+	if (heap_profiler)
+	{
+		caller_site = get_allocation_site();
+		set_allocation_site(function->name, no_symbol, function->line);
+	}
+	try
+	{
+		frames.push_back({ function.get(), 0, base, nullptr });
+		run(depth);
+	}
+	catch (...)
+	{
+		frames.resize(depth);
+		stack.resize(base);
+		if (heap_profiler)
+			get_allocation_site() = caller_site;
+		throw;
+	}
+	if (heap_profiler)
+		get_allocation_site() = caller_site;
+	auto result = stack.back();
+	stack.resize(base);
+	return result;
+}
+
+value_t vm_t::profile(const value_t& thunk, const std::string& path)
+{
+	profiler_t profiler{ symbol_profile };
+	auto previous = this->profiler;
+	this->profiler = &profiler;
+	value_t result;
+	try
+	{
+		result = apply(thunk, {});
+	}
+	catch (...)
+	{
+		this->profiler = previous;
+		throw;
+	}
+	this->profiler = previous;
+	profiler.stop();
+	profiler.report(path);
+	return result;
+}
+
+value_t vm_t::apply(const value_t& callee, std::initializer_list<value_t> arguments)
+{
+	auto depth = frames.size();
+	auto base = stack.size();
+	// The caller is back in charge of what's allocated once this returns
+	allocation_site_t caller_site{};
+	if (heap_profiler)
+		caller_site = get_allocation_site();
+	try
+	{
+		stack.push_back(callee);
+		stack.insert(stack.end(), arguments.begin(), arguments.end());
+		call(arguments.size());
+		if (frames.size() > depth)
+			run(depth);
+	}
+	catch (...)
+	{
+		frames.resize(depth);
+		stack.resize(base);
+		if (heap_profiler)
+			get_allocation_site() = caller_site;
+		throw;
+	}
+	if (heap_profiler)
+		get_allocation_site() = caller_site;
+	auto result = stack.back();
+	stack.resize(base);
+	return result;
+}
+
+void vm_t::run(size_t bottom)
+{
+#if CATLANG_STATS
+	// Counted when this returns, so (stats) doesn't see the run it's called from yet
+	dispatch_counts_t dispatches;
+#endif
+	while (true)
+	{
+		auto&& frame = frames.back();
+		auto&& ins = frame.function->code[frame.pc++];
+#if CATLANG_STATS
+		++dispatches.values[static_cast<size_t>(ins.op)];
+#endif
+
+		switch (ins.op)
+		{
+		case opcode::push_constant:
+			stack.push_back(frame.function->constants[ins.operand]);
+			break;
+
+		case opcode::load_local:
+		{
+			auto value = stack[frame.base + 1 + ins.operand];
+			stack.push_back(std::move(value));
+			break;
+		}
+
+		case opcode::load_enclosing:
+			stack.push_back(get_enclosing_frame(frame, ins.depth).slots[ins.operand]);
+			break;
+
+		case opcode::load_global:
+			stack.push_back(get_global(*frame.function, ins.operand).value);
+			break;
+
+		case opcode::store_local:
+			stack[frame.base + 1 + ins.operand] = pop();
+			break;
+
+		case opcode::store_enclosing:
+		{
+			auto&& environment = get_enclosing_frame(frame, ins.depth);
+			// Other tasks may be reading it
+			if (parent && !heap.owns(&environment))
+				throw std::runtime_error{ "Can't assign a captured variable in a parallel task" };
+			environment.slots[ins.operand] = pop();
+			break;
+		}
+
+		case opcode::store_global:
+		{
+			if (parent)
+				throw std::runtime_error{ "Can't assign global " + get_symbol_name(frame.function->names[ins.operand]) + " in a parallel task" };
+			// def creates the binding, so this can't go through get_global
+			auto&& global = frame.function->resolved_globals[ins.operand];
+			if (!global)
+			{
+				CATLANG_COUNT(stat_global_lookups);
+				auto count = globals.size();
+				global = &globals[frame.function->names[ins.operand]];
+				if (heap_profiler && globals.size() != count)
+					heap_profiler->add_binding();
+			}
+			global->value = pop();
+			++global->version;
+			break;
+		}
+
+		case opcode::pop:
+			stack.pop_back();
+			break;
+
+		case opcode::jump:
+			frame.pc = ins.operand;
+			// Loops are a safe point, everything live is in the roots
+			if (heap.should_collect())
+				collect_garbage();
+			break;
+
+		case opcode::jump_if_false:
+			if (!is_truthy(pop()))
+				frame.pc = ins.operand;
+			break;
+
+		case opcode::jump_if_rebound:
+		{
+			auto&& guard = frame.function->guards[ins.depth];
+			if (get_global(*frame.function, guard.name).version != guard.version)
+				frame.pc = ins.operand;
+			break;
+		}
+
+		case opcode::make_lambda:
+		{
+			auto&& function = frame.function->functions[ins.operand];
+			stack.push_back(make_value<lambda_object>(function,
+				function->captures_environment ? frame.environment : nullptr));
+			break;
+		}
+
+		case opcode::call:
+			if (heap.should_collect())
+				collect_garbage();
+			call(ins.operand);
+			break;
+
+		case opcode::call_global:
+			if (heap.should_collect())
+				collect_garbage();
+			if (!call_cached(frame.function->call_caches[ins.depth], *frame.function, ins.operand))
+				call(ins.operand);
+			break;
+
+		case opcode::tail_call:
+		case opcode::tail_call_global:
+		{
+			if (heap.should_collect())
+				collect_garbage();
+			auto cached = ins.op == opcode::tail_call_global
+				&& call_cached(frame.function->call_caches[ins.depth], *frame.function, ins.operand);
+			auto callee = stack.size() - ins.operand - 1;
+			if (!cached && stack[callee].is_object(value_type::lambda))
+			{
+				// Slide the callee and its arguments over the current frame and replace it
+				auto base = frame.base;
+				std::move(stack.begin() + callee, stack.end(), stack.begin() + base);
+				stack.resize(base + ins.operand + 1);
+				if (profiler)
+					profiler->leave(frames.size());
+				frames.pop_back();
+				call(ins.operand);
+				// Native code may have finished the call already
+				if (frames.size() == bottom)
+					return;
+				break;
+			}
+			// Builtins don't push a frame, so call them normally and return what they gave.
+			// A cached one has already left its result on the stack.
+			if (!cached)
+				call(ins.operand);
+		}
+		// Falls through
+
+		case opcode::return_:
+		{
+			auto result = pop();
+			// frame is stale when a call fell through to here, a host function it made may have grown frames
+			stack.erase(stack.begin() + frames.back().base, stack.end());
+			if (profiler)
+				profiler->leave(frames.size());
+			frames.pop_back();
+			stack.push_back(std::move(result));
+			if (frames.size() == bottom)
+				return;
+			if (heap_profiler)
+				set_allocation_site(frames.back().function->name, no_symbol, frames.back().function->line);
+			break;
+		}
+
+		case opcode::print:
+			std::cout << pop() << '\n';
+			stack.push_back(nil_t{});
+			break;
+
+		case opcode::vars:
+			if (frames.size() > 1 || parent)
+			{
+				auto&& locals = frame.function->locals;
+				for (size_t i = 0; i < locals.size(); ++i)
+				{
+					auto&& value = frame.function->has_environment ? frame.environment->slots[i]
+						: stack[frame.base + 1 + i];
+					std::cout << get_symbol_name(locals[i]) << " -> " << value << '\n';
+				}
+			}
+			else
+			{
+				for (auto&& pair : globals)
+					std::cout << get_symbol_name(pair.first) << " -> " << pair.second.value << '\n';
+			}
+			stack.push_back(nil_t{});
+			break;
+
+		case opcode::parallel:
+			if (heap.should_collect())
+				collect_garbage();
+			run_parallel(static_cast<parallel_op>(ins.operand));
+			break;
+
+		case opcode::profile:
+		{
+			std::string path = default_profile_path;
+			if (ins.operand)
+			{
+				auto value = pop();
+				if (!value.is_object(value_type::string))
+					throw std::runtime_error{ std::string{ "profile expects a path, got " } +get_type_name(value.get_type()) };
+				path = value.get_object<string_object>().value;
+			}
+			auto result = profile(stack.back(), path);
+			stack.back() = result;
+			break;
+		}
+
+		case opcode::profile_enter:
+			if (profiler)
+				profiler->enter(static_cast<symbol_t>(ins.operand), frames.size(), true);
+			break;
+
+		case opcode::profile_exit:
+			if (profiler)
+				profiler->leave_form(frames.size());
+			break;
+		}
+	}
+}
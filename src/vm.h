@@ -0,0 +1,112 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include "basic_types.h"
+#include "value.h"
+#include "compiler.h"
+
+struct profiler_t;
+
+// A global binding. version changes whenever the name is rebound, inline caches
+// compare it to tell whether what they remembered is still current. Bindings are
+// never removed, so pointers to them stay valid.
+struct global_t
+{
+	value_t value;
+	std::uint64_t version = 0;
+};
+
+using variable_map_t = std::unordered_map<symbol_t, global_t>;
+
+struct call_frame_t
+{
+	const function_t* function;
+	size_t pc;
+	// Stack index of the callee, its arguments follow it
+	size_t base;
+	// Innermost environment frame, null at the top level and when nothing is captured
+	frame_t* environment;
+};
+
+struct vm_t
+{
+	vm_t() = default;
+	// A VM that runs tasks of a parallel form for parent on one thread, see parallel.cpp
+	explicit vm_t(vm_t& parent);
+	vm_t(const vm_t&) = delete;
+	vm_t& operator =(const vm_t&) = delete;
+
+	value_t execute(const std::shared_ptr<const function_t>& function);
+	// Calls callee with arguments and returns what it gave
+	value_t apply(const value_t& callee, std::initializer_list<value_t> arguments);
+	// Keeps the constants of function alive for as long as something else holds it,
+	// for code that's compiled once and executed again later
+	void add_root(const std::shared_ptr<const function_t>& function);
+	void add_variable(const std::string& name, value_t value);
+	void add_builtin(const std::string& name, builtin_func_t function);
+	// Called through call rather than an inline cache. Named apart so a lambda
+	// that captures nothing can still be passed to add_builtin.
+	void add_host_builtin(const std::string& name, host_func_t function);
+	// Frees everything that isn't reachable from the globals or the running code
+	void collect_garbage();
+
+	// Declared first so it's destroyed after everything that points into it
+	heap_t heap;
+	variable_map_t globals;
+	// Calls nested deeper than this throw instead of exhausting memory
+	size_t max_call_depth = 4000000;
+	// Lambdas get native code after this many calls, see jit.h
+	bool jit_enabled = CATLANG_JIT_SUPPORTED != 0;
+	std::uint32_t jit_threshold = 1000;
+	// Calls and timed forms are recorded here when set, see profiler.h. Native
+	// code isn't entered meanwhile.
+	profiler_t* profiler = nullptr;
+
+private:
+	// Interprets until the frame count drops to bottom
+	void run(size_t bottom);
+	void call(size_t argument_count);
+	bool call_cached(call_cache_t& cache, const function_t& function, size_t argument_count);
+	global_t& lookup_global(symbol_t name);
+	global_t& get_global(const function_t& function, std::int32_t index);
+	value_t pop();
+	vm_t& root() { return parent ? *parent : *this; }
+
+	void run_parallel(parallel_op op);
+	// Calls thunk with a profiler of its own set and reports it to path
+	value_t profile(const value_t& thunk, const std::string& path);
+
+	void run_native(const function_t& function, size_t base);
+	bool compile_native(const function_t& function);
+	static std::uint64_t native_call(vm_t* vm, value_t** frame, size_t top, size_t argument_count, size_t frame_size);
+	static void native_safe_point(vm_t* vm, value_t** frame, size_t top, size_t frame_size);
+
+	std::vector<value_t> stack;
+	std::vector<call_frame_t> frames;
+	// Native code calling native code nests on the C++ stack, past this deep the
+	// interpreter takes over
+	size_t native_depth = 0;
+	// Thrown by a builtin called from native code, rethrown once it has returned
+	std::exception_ptr native_exception;
+	// See add_root, dropped once they expire
+	std::vector<std::weak_ptr<const function_t>> roots;
+
+	// Set on VMs running tasks of a parallel form. They use the parent's globals
+	// but can't assign them, nor captured variables the task didn't create.
+	vm_t* parent = nullptr;
+	// Whether other threads may be running the same functions. The caches and
+	// profiles in function_t are then only read.
+	bool shared = false;
+	// Set on the parent while a parallel form runs, native code checks it before
+	// assigning a global
+	bool running_parallel = false;
+};
+
+// Throws the error builtins report for a call with too few or too many arguments
+void check_argument_count(const char* name, size_t count, size_t min, size_t max);
@@ -0,0 +1,97 @@
+// Host functions that call back into the interpreter that called them. Exits
+// with 1 after printing what failed, run by ctest.
+#include "interpreter.h"
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+static int failures = 0;
+
+static void check(const char* name, const value_t& value, const std::string& expected)
+{
+	std::ostringstream out;
+	out << value;
+	if (out.str() == expected)
+		return;
+	std::cerr << name << ": expected " << expected << ", got " << out.str() << '\n';
+	++failures;
+}
+
+// The nested call grows the stack and frames far past what the outer call had
+// when it made the host call
+static void call_from_host()
+{
+	interpreter_t interpreter;
+	interpreter.set("deep-from-host", [&](const value_t* args, size_t)
+	{
+		return interpreter.call("deep", { args[0] }) + args[1];
+	});
+	auto script = interpreter.compile(
+		"(def (deep n) (if (< n 1) 0 (+ 1 (deep (- n 1)))))"
+		"(def (outer a b) (deep-from-host a b))"
+		"(def (tail a b) (if true (deep-from-host a b) 0))"
+		"(list (outer 2000 1) (tail 3000 2))");
+	check("call_from_host", interpreter.run(script), "{ 2001 3002 } ");
+}
+
+// A script run from a host function returns to the one that called it
+static void run_from_host()
+{
+	interpreter_t interpreter;
+	auto inner = interpreter.compile("(def counter (+ counter 1)) (list counter counter)");
+	interpreter.set("run-inner", [&](const value_t*, size_t) { return interpreter.run(inner); });
+	auto script = interpreter.compile(
+		"(def counter 0)"
+		"(def (f x) (list x (run-inner) x))"
+		"(f 1)");
+	check("run_from_host", interpreter.run(script), "{ 1 { 1 1 } 1 } ");
+}
+
+// An error in the nested call leaves the outer one where it was
+static void error_from_host()
+{
+	interpreter_t interpreter;
+	interpreter.set("try-call", [&](const value_t* args, size_t) -> value_t
+	{
+		try
+		{
+			return interpreter.call(args[0], { args[1] });
+		}
+		catch (std::runtime_error&)
+		{
+			return nil_t{};
+		}
+	});
+	auto script = interpreter.compile(
+		"(def (fails n) (if (< n 1) (head (list)) (fails (- n 1))))"
+		"(def (f x) (list x (try-call fails 100) x))"
+		"(f 2)");
+	check("error_from_host", interpreter.run(script), "{ 2 (nil) 2 } ");
+}
+
+// Compiling from a host function leaves the syntax tree of the forms after the
+// call alone. The outer source is big enough to span several arena chunks.
+static void compile_from_host()
+{
+	interpreter_t interpreter;
+	interpreter.set("compile-inner", [&](const value_t*, size_t) -> value_t
+	{
+		return interpreter.run(interpreter.compile("(list 1 2)"));
+	});
+	std::string numbers;
+	for (int i = 1; i <= 5000; ++i)
+		numbers += " " + std::to_string(i);
+	interpreter.interpret_line(
+		"(def inner (compile-inner))"
+		"(def outer (length '(" + numbers + ")))");
+	check("compile_from_host", interpreter.run(interpreter.compile("(list inner outer)")), "{ { 1 2 } 5000 } ");
+}
+
+int main()
+{
+	call_from_host();
+	run_from_host();
+	error_from_host();
+	compile_from_host();
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,54 @@
+// Runs each script with and without the optimizer, which has to give the same
+// result or error either way. Exits with 1 after printing what differed, run by ctest.
+#include "interpreter.h"
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+static std::string run(const std::string& source, bool optimize)
+{
+	interpreter_t interpreter;
+	interpreter.optimize = optimize;
+	std::ostringstream out;
+	try
+	{
+		out << interpreter.run(interpreter.compile(source));
+	}
+	catch (std::runtime_error& e)
+	{
+		out << "error: " << e.what();
+	}
+	return out.str();
+}
+
+static const char* const scripts[] = {
+	// Operators rebound after code folded with them was compiled
+	"(def (f) (+ 1 2)) (set + -) (f)",
+	"(def (f) (* (+ 1 2) (- 10 4))) (f) (set - +) (f)",
+	"(def (f) (< 1 2)) (set < >) (f)",
+	"(def plus +) (def (f) (plus 2 3)) (set plus *) (f)",
+	"(def (f) (+ 1 2)) (def + -) (f)",
+	"(def (f x) (def (double y) (* y (+ 1 1))) (double x)) (set + -) (f 3)",
+	// Long enough for f to run native code before the rebinding
+	"(def (f x) (+ x (* 2 3))) (def (loop i acc) (if (< i 3000) (loop (+ i 1) (f i)) acc)) (loop 0 0) (set * +) (f 1)",
+	// Constants branches are pruned on
+	"(def (g x) (if true x 0)) (set true false) (g 4)",
+	"(def (g) (cond (nil 1) (true 2))) (def nil 1) (g)",
+	"(def (g) (if false 1 2)) (g)",
+	"(def (g true) (if true 1 2)) (g false)",
+};
+
+int main()
+{
+	auto failures = 0;
+	for (auto script : scripts)
+	{
+		auto optimized = run(script, true);
+		auto plain = run(script, false);
+		if (optimized == plain)
+			continue;
+		std::cerr << script << "\n  optimized: " << optimized << "\n  not optimized: " << plain << '\n';
+		++failures;
+	}
+	return failures ? 1 : 0;
+}